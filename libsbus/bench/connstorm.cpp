@@ -0,0 +1,158 @@
+/*
+      SBUS library: Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** connstorm.cpp
+
+  Connection storm benchmark: many peers connect to a SMessenger at once
+  (i.e. a whole cluster restarting) and each sends a single message; it
+  measures how long it takes until every peer has been admitted and heard.
+
+  Usage: connstorm [peers] [reactors] [poll|uring] [listen backlog]
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <log.h>
+#include <errdefs.h>
+#include <timing.h>
+#include <stcp.h>
+#include <SBus.h>
+
+using namespace std;
+using namespace simple;
+
+/// Message code sent by every peer once connected
+#define STORM_MSGCODE 7
+/// Multicast port used by the benchmark
+#define STORM_MCPORT 10791
+/// Time (ms) given to the storm to be admitted
+#define STORM_TIMEOUT_MS 30000
+
+/// Receiving side state
+typedef struct StormReceiver {
+  SMessenger* smessenger;
+  int reactor;
+} StormReceiver;
+
+/// Messages heard so far
+static volatile int heard=0;
+/// Receiving threads life's flag
+static volatile bool alive=true;
+
+/// Receiving thread, one per reactor
+static void* stormReceiver(void* ptrArgs) {
+  StormReceiver* args=(StormReceiver*)ptrArgs;
+  SMsg* batch[64];
+  while(alive) {
+    int i;
+    int n=args->smessenger->recvBatch(args->reactor,batch,64,10);
+    for(i=0;i<n;i++) {
+      if(batch[i]->getMsgTag()==STORM_MSGCODE) {
+        __sync_add_and_fetch(&heard,1);
+      }
+      delete(batch[i]);
+    }
+  }
+  return NULL;
+}
+
+/// Connects a peer and sends its only message
+static int stormPeer(int port) {
+  int fd;
+  smsg_header hdr;
+  struct sockaddr_in addr;
+  RET_ON_PERROR((fd=socket(PF_INET,SOCK_STREAM,0)));
+  sockaddr_set(&addr,"127.0.0.1",port);
+  if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+    PERROR("Error connect()");
+    close(fd);
+    return -1;
+  }
+  hdr.code=htons(STORM_MSGCODE);
+  hdr.port=0;
+  hdr.length=0;
+  if(write(fd,&hdr,HDRLEN)!=(int)HDRLEN) {
+    PERROR("Error write()");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Main: args parsing
+int main(int argc, char* argv[]) {
+  int peers=(argc>1)?atoi(argv[1]):500;
+  SBusOptions options;
+  SBus::defaultOptions(&options);
+  options.reactors=(argc>2)?atoi(argv[2]):1;
+  options.engine=((argc>3)&&(strcmp(argv[3],"uring")==0))?SBUS_ENGINE_URING:SBUS_ENGINE_POLL;
+  if(argc>4) {
+    options.listenBacklog=atoi(argv[4]);
+  }
+  int i;
+  int* fds=(int*)calloc(peers,sizeof(int));
+  StormReceiver receivers[SBUS_MAX_REACTORS];
+  pthread_t threads[SBUS_MAX_REACTORS];
+  try {
+    SMessenger smessenger(NULL,DEFAULT_MCIP,STORM_MCPORT,&options);
+    int nreactors=smessenger.getReactorCount();
+    for(i=0;i<nreactors;i++) {
+      receivers[i].smessenger=&smessenger;
+      receivers[i].reactor=i;
+      pthread_create(&threads[i],NULL,stormReceiver,&receivers[i]);
+    }
+    // The storm
+    long long int start=timing_current_micros();
+    for(i=0;i<peers;i++) {
+      fds[i]=stormPeer(smessenger.getServerPort());
+    }
+    long long int connected=timing_current_micros();
+    long long int limit=timing_current_millis()+STORM_TIMEOUT_MS;
+    while((heard<peers)&&(timing_current_millis()<limit)) {
+      usleep(100);
+    }
+    long long int end=timing_current_micros();
+    printf("%d peers, %d reactors, %s engine, listen backlog %d\n",peers,nreactors,
+      (options.engine==SBUS_ENGINE_URING)?"uring":"poll",options.listenBacklog);
+    printf("  connect() calls done in %lld us\n",connected-start);
+    printf("  %d peers heard in %lld us (%.0f connections/s)\n",heard,end-start,
+      (end>start)?(heard*1000000.0/(end-start)):0.0);
+    alive=false;
+    for(i=0;i<nreactors;i++) {
+      pthread_join(threads[i],NULL);
+    }
+    for(i=0;i<peers;i++) {
+      if(fds[i]>=0) {
+        close(fds[i]);
+      }
+    }
+  } catch(string* s) {
+    ERROR("Exception %s",s->c_str());
+    return -1;
+  }
+  free(fds);
+  return (heard==peers)?0:1;
+}
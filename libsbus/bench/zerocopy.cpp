@@ -0,0 +1,198 @@
+/*
+      SBUS library: Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** zerocopy.cpp
+
+  Zero-copy crossover benchmark: streams unicast messages of growing sizes
+  between two SBus, first copied to the kernel and then with MSG_ZEROCOPY
+  (SBusOptions.zeroCopyBytes), and tells the throughput of both.
+
+  Note that on loopback the kernel copies zero-copy pages anyway when they
+  are delivered locally, so there it only shows what pinning and reaping the
+  completions cost; run it across hosts to see the real crossover.
+
+  Usage: zerocopy [MB per size] [messages in flight]
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <log.h>
+#include <errdefs.h>
+#include <timing.h>
+#include <SBufPool.h>
+#include <SBus.h>
+
+using namespace std;
+using namespace simple;
+
+/// Message code streamed
+#define ZC_MSGCODE 9
+/// Message code announcing the receiver
+#define ZC_HELLO 8
+/// First multicast port used by the benchmark (one per run)
+#define ZC_MCPORT 10801
+/// Time (ms) given to each run
+#define ZC_TIMEOUT_MS 60000
+/// Runs per size and mode, the best one counts
+#define ZC_RUNS 3
+/// Most bytes in flight (under the default outbound queue high watermark)
+#define ZC_MAX_INFLIGHT_BYTES (2*1024*1024)
+
+/// Receiving side state
+typedef struct ZcReceiver {
+  SBus* sbus;
+  volatile int heard;
+  volatile bool alive;
+} ZcReceiver;
+
+/// Receiving thread
+static void* zcReceiver(void* ptrArgs) {
+  ZcReceiver* args=(ZcReceiver*)ptrArgs;
+  while(args->alive) {
+    if(args->sbus->getPending()==0) {
+      usleep(50);
+      continue;
+    }
+    int msgtag;
+    SBusPeer peer;
+    SBufSlice body;
+    if((args->sbus->recv(&msgtag,&peer,body)>=0)&&(msgtag==ZC_MSGCODE)) {
+      args->heard++;
+    }
+  }
+  return NULL;
+}
+
+/**
+  Streams messages of a size and measures the throughput
+  @return the MB/s, or -1 on error
+*/
+static double zcRun(int size, int count, int inflight, bool zerocopy, int mcport) {
+  SBusOptions options;
+  SBus::defaultOptions(&options);
+  options.zeroCopyBytes=zerocopy?1:0;
+  double mbs=-1;
+  try {
+    SBus sender(NULL,DEFAULT_MCIP,mcport,&options);
+    SBus receiver(NULL,DEFAULT_MCIP,mcport,&options);
+    ZcReceiver args;
+    pthread_t thread;
+    SBusPeer peer=-1;
+    int msgtag;
+    string hello="zc";
+    // The sender learns the receiver from its multicast hello
+    receiver.send(ZC_HELLO,hello);
+    long long int limit=timing_current_millis()+ZC_TIMEOUT_MS;
+    while((peer<0)&&(timing_current_millis()<limit)) {
+      string msg;
+      SBusPeer from;
+      if(sender.getPending()==0) {
+        usleep(1000);
+      } else if((sender.recv(&msgtag,&from,msg)>=0)&&(msgtag==ZC_HELLO)) {
+        peer=from;
+      }
+    }
+    if(peer<0) {
+      ERROR("Receiver not heard");
+      return -1;
+    }
+    args.sbus=&receiver;
+    args.heard=0;
+    args.alive=true;
+    pthread_create(&thread,NULL,zcReceiver,&args);
+    SBuf* buf=SBufPool::alloc(size);
+    memset(buf->data(),'z',size);
+    SBufSlice body(buf,0,size);
+    buf->unref();
+    long long int start=timing_current_micros();
+    int sent=0;
+    while((args.heard<count)&&(timing_current_millis()<limit)) {
+      // Keep a few messages in flight, so the peer outbound queue does not fill up
+      if((sent<count)&&(sent-args.heard<inflight)&&(sender.send(ZC_MSGCODE,peer,body)>=0)) {
+        sent++;
+      } else {
+        sched_yield();
+      }
+    }
+    long long int end=timing_current_micros();
+    args.alive=false;
+    pthread_join(thread,NULL);
+    if(args.heard==count) {
+      mbs=((double)size*count)/(end-start);
+    }
+  } catch(string* s) {
+    ERROR("Exception %s",s->c_str());
+  }
+  return mbs;
+}
+
+// Main: args parsing
+int main(int argc, char* argv[]) {
+  int mb=(argc>1)?atoi(argv[1]):64;
+  int inflight=(argc>2)?atoi(argv[2]):16;
+  int sizes[]={ 4096, 16384, 65536, 131072, 262144, 524288, 1048576-64 };
+  int nsizes=sizeof(sizes)/sizeof(int);
+  int mcport=ZC_MCPORT;
+  int crossover=-1;
+  int i;
+  int k;
+  printf("%10s %12s %12s %8s\n","size","copy MB/s","zcopy MB/s","ratio");
+  for(i=0;i<nsizes;i++) {
+    int count=(int)(((long long int)mb*1024*1024)/sizes[i]);
+    int window=ZC_MAX_INFLIGHT_BYTES/sizes[i];
+    double copy=-1;
+    double zcopy=-1;
+    if(count<100) {
+      count=100;
+    }
+    window=(window<1)?1:((window<inflight)?window:inflight);
+    for(k=0;k<ZC_RUNS;k++) {
+      double mbs;
+      if((mbs=zcRun(sizes[i],count,window,false,mcport++))>copy) {
+        copy=mbs;
+      }
+      if((mbs=zcRun(sizes[i],count,window,true,mcport++))>zcopy) {
+        zcopy=mbs;
+      }
+    }
+    if((copy<0)||(zcopy<0)) {
+      printf("%10d run failed\n",sizes[i]);
+      return 1;
+    }
+    printf("%10d %12.1f %12.1f %8.2f\n",sizes[i],copy,zcopy,zcopy/copy);
+    // The crossover is the size from which zero-copy keeps winning
+    if(zcopy<copy) {
+      crossover=-1;
+    } else if(crossover<0) {
+      crossover=sizes[i];
+    }
+  }
+  if(crossover>0) {
+    printf("MSG_ZEROCOPY pays off from %d bytes\n",crossover);
+  } else {
+    printf("MSG_ZEROCOPY did not pay off at any size\n");
+  }
+  return 0;
+}
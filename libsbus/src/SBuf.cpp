@@ -0,0 +1,151 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SBuf.cpp
+   @brief Reference counted message buffers (see SBufPool) and slices of them
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <string.h>
+
+#include <errdefs.h>
+#include <SBuf.h>
+#include <SBufPool.h>
+
+using namespace simple;
+
+/// Buffer memory
+char* SBuf::data() {
+  return (char*)(this+1);
+}
+
+/// Usable bytes
+int SBuf::getCapacity() {
+  return capacity;
+}
+
+/// Takes one more reference
+void SBuf::ref() {
+  __sync_add_and_fetch(&refs,1);
+}
+
+/// Drops a reference, the last one gives the buffer back to its pool
+void SBuf::unref() {
+  if(__sync_sub_and_fetch(&refs,1)==0) {
+    SBufPool::release(this);
+  }
+}
+
+/// Tells if someone else holds a reference too
+bool SBuf::isShared() {
+  return refs>1;
+}
+
+/// Empty slice
+SBufSlice::SBufSlice() {
+  buf=NULL;
+  offset=length=0;
+}
+
+/// Slice of a buffer, takes its own reference
+SBufSlice::SBufSlice(SBuf* buf, int offset, int length) {
+  this->buf=buf;
+  this->offset=offset;
+  this->length=length;
+  if(buf!=NULL) {
+    buf->ref();
+  }
+}
+
+/// Shares the same bytes
+SBufSlice::SBufSlice(const SBufSlice& other) {
+  buf=other.buf;
+  offset=other.offset;
+  length=other.length;
+  if(buf!=NULL) {
+    buf->ref();
+  }
+}
+
+/// Shares the same bytes
+SBufSlice& SBufSlice::operator=(const SBufSlice& other) {
+  if(other.buf!=NULL) {
+    other.buf->ref();
+  }
+  release();
+  buf=other.buf;
+  offset=other.offset;
+  length=other.length;
+  return *this;
+}
+
+/// Drops the buffer reference
+SBufSlice::~SBufSlice() {
+  release();
+}
+
+/**
+  Makes this slice a copy of some bytes on a new pooled buffer
+  @param bytes are the bytes to copy
+  @param len is the number of bytes
+  @return 0 on success or -1 on error
+*/
+int SBufSlice::copy(const char* bytes, int len) {
+  SBuf* newbuf;
+  release();
+  if(len<=0) {
+    return 0;
+  }
+  RET_ON_FALSE(((newbuf=SBufPool::alloc(len))!=NULL));
+  memcpy(newbuf->data(),bytes,len);
+  buf=newbuf; // the pool reference is kept
+  offset=0;
+  length=len;
+  return 0;
+}
+
+/// Slice of this slice (sharing the same buffer)
+SBufSlice SBufSlice::sub(int offset, int length) {
+  return SBufSlice(buf,this->offset+offset,length);
+}
+
+/// First byte
+const char* SBufSlice::data() {
+  return (buf!=NULL)?buf->data()+offset:"";
+}
+
+/// Slice length
+int SBufSlice::size() {
+  return length;
+}
+
+/// Referenced buffer (NULL for an empty slice), no reference is taken
+SBuf* SBufSlice::buffer() {
+  return buf;
+}
+
+/// Drops the buffer reference, leaving an empty slice
+void SBufSlice::release() {
+  if(buf!=NULL) {
+    buf->unref();
+    buf=NULL;
+  }
+  offset=length=0;
+}
@@ -0,0 +1,102 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SBuf.h
+   @brief Reference counted message buffers (see SBufPool) and slices of them
+
+  Received payloads are written once into a SBuf and then handed, by
+  reference, through SMsg, the incomming queue and the user as SBufSlice's
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+
+#ifndef SBUF
+#define SBUF
+
+namespace simple {
+
+class SBufPool;
+
+class SBuf {
+  private:
+	/// References held (slices, connections, pool users)
+	volatile int refs;
+	/// Pool size class (-1 for buffers too big to be pooled)
+	int sizeClass;
+	/// Usable bytes
+	int capacity;
+	/// Next free buffer while in the pool
+	SBuf* next;
+	friend class SBufPool;
+  public:
+	/// Buffer memory
+	char* data();
+	/// Usable bytes
+	int getCapacity();
+	/// Takes one more reference
+	void ref();
+	/// Drops a reference, the last one gives the buffer back to its pool
+	void unref();
+	/// Tells if someone else holds a reference too
+	bool isShared();
+};
+
+class SBufSlice {
+  private:
+	/// Referenced buffer (NULL for an empty slice)
+	SBuf* buf;
+	/// First byte on the buffer
+	int offset;
+	/// Slice length
+	int length;
+  public:
+	/// Empty slice
+	SBufSlice();
+	/// Slice of a buffer, takes its own reference
+	SBufSlice(SBuf* buf, int offset, int length);
+	/// Shares the same bytes
+	SBufSlice(const SBufSlice& other);
+	/// Shares the same bytes
+	SBufSlice& operator=(const SBufSlice& other);
+	/// Drops the buffer reference
+	~SBufSlice();
+	/**
+	  Makes this slice a copy of some bytes on a new pooled buffer
+	  @param bytes are the bytes to copy
+	  @param len is the number of bytes
+	  @return 0 on success or -1 on error
+	*/
+	int copy(const char* bytes, int len);
+	/// Slice of this slice (sharing the same buffer)
+	SBufSlice sub(int offset, int length);
+	/// First byte
+	const char* data();
+	/// Slice length
+	int size();
+	/// Referenced buffer (NULL for an empty slice), no reference is taken
+	SBuf* buffer();
+	/// Drops the buffer reference, leaving an empty slice
+	void release();
+};
+
+}
+
+#endif
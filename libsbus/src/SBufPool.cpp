@@ -0,0 +1,99 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SBufPool.cpp
+   @brief Size classed pool of reference counted SBuf's
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <errdefs.h>
+#include <SBufPool.h>
+
+using namespace simple;
+
+/// Number of size classes
+#define SBUFPOOL_CLASSES (SBUFPOOL_MAX_CLASS-SBUFPOOL_MIN_CLASS+1)
+
+/// Free buffers per size class
+static SBuf* freeList[SBUFPOOL_CLASSES];
+/// Free buffers count per size class
+static int freeCount[SBUFPOOL_CLASSES];
+/// Pool mutex (buffers are freed on the application threads)
+static pthread_mutex_t poolMutex=PTHREAD_MUTEX_INITIALIZER;
+
+/// Size class for a size (-1 if too big to be pooled)
+static int sizeClassOf(int size) {
+  int c=0;
+  while((c<SBUFPOOL_CLASSES)&&((1<<(c+SBUFPOOL_MIN_CLASS))<size)) {
+    c++;
+  }
+  return (c<SBUFPOOL_CLASSES)?c:-1;
+}
+
+/**
+  Gets a buffer with one reference held by the caller
+  @param size is the minimum capacity needed
+  @return the buffer or NULL on error
+*/
+SBuf* SBufPool::alloc(int size) {
+  SBuf* buf=NULL;
+  int c=sizeClassOf(size);
+  if(c>=0) {
+    pthread_mutex_lock(&poolMutex);
+    if((buf=freeList[c])!=NULL) {
+      freeList[c]=buf->next;
+      freeCount[c]--;
+    }
+    pthread_mutex_unlock(&poolMutex);
+    size=1<<(c+SBUFPOOL_MIN_CLASS);
+  }
+  if(buf==NULL) {
+    if((buf=(SBuf*)malloc(sizeof(SBuf)+size))==NULL) {
+      ERROR("Could not allocate a %d bytes buffer",size);
+      return NULL;
+    }
+    buf->sizeClass=c;
+    buf->capacity=size;
+  }
+  buf->next=NULL;
+  buf->refs=1;
+  return buf;
+}
+
+/// Takes back a buffer with no references left (called by SBuf::unref())
+void SBufPool::release(SBuf* buf) {
+  int c=buf->sizeClass;
+  if(c>=0) {
+    pthread_mutex_lock(&poolMutex);
+    if((freeCount[c]+1)*buf->capacity<=SBUFPOOL_KEEP_BYTES) {
+      buf->next=freeList[c];
+      freeList[c]=buf;
+      freeCount[c]++;
+      buf=NULL;
+    }
+    pthread_mutex_unlock(&poolMutex);
+  }
+  if(buf!=NULL) {
+    free(buf);
+  }
+}
@@ -0,0 +1,59 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SBufPool.h
+   @brief Size classed pool of reference counted SBuf's
+
+  Buffers come in power of 2 size classes, from SBUFPOOL_MIN_CLASS to
+  SBUFPOOL_MAX_CLASS bytes; freed buffers are kept per class for reuse
+  (up to SBUFPOOL_KEEP_BYTES per class), bigger ones are plain malloc()s
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <SBuf.h>
+
+#ifndef SBUFPOOL
+#define SBUFPOOL
+
+/// Smallest size class (2^8=256 bytes)
+#define SBUFPOOL_MIN_CLASS 8
+/// Biggest size class (2^21=2MB, fits MAX_DATALEN plus header)
+#define SBUFPOOL_MAX_CLASS 21
+/// Freed bytes kept for reuse on each size class
+#define SBUFPOOL_KEEP_BYTES (4*1024*1024)
+
+namespace simple {
+
+class SBufPool {
+  public:
+	/**
+	  Gets a buffer with one reference held by the caller
+	  @param size is the minimum capacity needed
+	  @return the buffer or NULL on error
+	*/
+	static SBuf* alloc(int size);
+	/// Takes back a buffer with no references left (called by SBuf::unref())
+	static void release(SBuf* buf);
+};
+
+}
+
+#endif
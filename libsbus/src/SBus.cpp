@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -37,6 +38,8 @@
 #include <sudp.h>
 #include <spoll.h>
 
+#include <timing.h>
+#include <SIdle.h>
 #include <SBus.h>
 
 #define SBUS_FIND       0
@@ -44,29 +47,87 @@
 #define INVALID_SOCKET -1
 
 #define WAIT_MS 50
+/// Maximum messages moved to the incomming queue at once
+#define IN_BATCH 64
 
-#define SLEEP_uS 5000
+/// Longest time the receiving threads wait at once for room on a full incoming queue
+#define FULL_WAIT_MS 50
 
 using namespace std;
 using namespace simple;
 
 /// Starts the inLoop receiver queue feeder
-static void* inLoopStarter(void* ptrThis) {
-  (reinterpret_cast<SBus*>(ptrThis))->inLoop();
+static void* inLoopStarter(void* ptrArgs) {
+  SBusInLoop* args=reinterpret_cast<SBusInLoop*>(ptrArgs);
+  args->sbus->inLoop(args->reactor);
+  pthread_exit(NULL);
+}
+
+/// Starts the asyncLoop asynchronous sender
+static void* asyncLoopStarter(void* ptrArgs) {
+  reinterpret_cast<SBus*>(ptrArgs)->asyncLoop();
+  pthread_exit(NULL);
+}
+
+/// Starts the asyncConnect peer connector
+static void* asyncConnectStarter(void* ptrArgs) {
+  SBusConnect* args=reinterpret_cast<SBusConnect*>(ptrArgs);
+  args->sbus->asyncConnect(args->peer);
+  delete(args);
   pthread_exit(NULL);
 }
 
 /// Initializes the SBus
-void SBus::init(const char* device, const char* mcip, int mcport) {
-  smessenger=new SMessenger(device,mcip, mcport);
+void SBus::init(const char* device, const char* mcip, int mcport, SBusOptions* options) {
+  SBusOptions defaults;
+  if(options==NULL) {
+    defaultOptions(&defaults);
+    options=&defaults;
+  }
+  spinUs=options->spinUs;
+  yieldUs=options->yieldUs;
+  streamReassembleBytes=options->streamReassembleBytes;
+  lastStream=0;
+  smessenger=new SMessenger(device,mcip, mcport, options);
   scontacts=new SContacts();
   setDefaultSafeName();
-  pthread_mutex_init(&inMutex, NULL);
+  // Contacts may be looked up again while processing a message
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&contactsMutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  // Priority lanes, then the default one
+  int weights[SBUS_MAX_LANES+1];
+  nlanes=options->lanes;
+  if(nlanes<0) {
+    nlanes=0;
+  } else if(nlanes>SBUS_MAX_LANES) {
+    WARN("%d incoming queue lanes requested, using %d",nlanes,SBUS_MAX_LANES);
+    nlanes=SBUS_MAX_LANES;
+  }
+  for(int i=0;i<nlanes;i++) {
+    lanes[i]=options->lane[i];
+    weights[i]=lanes[i].weight;
+  }
+  weights[nlanes]=1;
+  inq=new SMsgQueue(options->inQueueMsgs,options->inQueueBytes,nlanes+1,
+    (options->laneDequeue==SBUS_LANES_WEIGHTED)?weights:NULL);
+  inQueuePolicy=options->inQueuePolicy;
+  bzero(&inStats,sizeof(inStats));
+  pthread_mutex_init(&asyncMutex, NULL);
+  pthread_cond_init(&asyncCond, NULL);
+  asyncStarted=false;
+  asyncConnecting=0;
   alive=true;
-  if(pthread_create(&inThread, NULL, inLoopStarter, (void*)this)!=0) {
-    throw new string("Cannot start receiving loop thread");
+  // One receiving thread per reactor, all feeding the same incoming queue
+  for(nInThreads=0;nInThreads<smessenger->getReactorCount();nInThreads++) {
+    inLoops[nInThreads].sbus=this;
+    inLoops[nInThreads].reactor=nInThreads;
+    if(pthread_create(&inThreads[nInThreads], NULL, inLoopStarter, (void*)&inLoops[nInThreads])!=0) {
+      throw new string("Cannot start receiving loop thread");
+    }
   }
-  pthread_detach(inThread);
 }
 
 /**
@@ -74,7 +135,7 @@ void SBus::init(const char* device, const char* mcip, int mcport) {
   NOTA: IT IS NOT thread-safe, avoid using the same SBus object on different threads
 */
 SBus::SBus() {
-  init(NULL,DEFAULT_MCIP,DEFAULT_MCPORT);
+  init(NULL,DEFAULT_MCIP,DEFAULT_MCPORT,NULL);
 }
 
 /**
@@ -83,7 +144,7 @@ SBus::SBus() {
   @param port is the multicast port to bind to
 */
 SBus::SBus(int port) {
-  init(NULL,DEFAULT_MCIP,port);
+  init(NULL,DEFAULT_MCIP,port,NULL);
 }
 
 /**
@@ -92,7 +153,7 @@ SBus::SBus(int port) {
   @param device is the net interface to bind to
 */
 SBus::SBus(const char* device) {
-  init(device,DEFAULT_MCIP,DEFAULT_MCPORT);
+  init(device,DEFAULT_MCIP,DEFAULT_MCPORT,NULL);
 }
 
 /**
@@ -102,7 +163,7 @@ SBus::SBus(const char* device) {
   @param port is the multicast port to bind to
 */
 SBus::SBus(const char* device, int port) {
-  init(device,DEFAULT_MCIP,port);
+  init(device,DEFAULT_MCIP,port,NULL);
 }
 
 /**
@@ -113,13 +174,59 @@ SBus::SBus(const char* device, int port) {
   @param port is the multicast port to bind to
 */
 SBus::SBus(const char* device, const char* mcip, int mcport) {
-  init(device,mcip,mcport);
+  init(device,mcip,mcport,NULL);
+}
+
+/**
+  Creates a SBus binding on a specified multicast port with custom options
+  NOTA: IT IS NOT thread-safe, avoid using the same SBus object on different threads
+  @param device is the net interface to bind to
+  @param mcip is the multicast address to bind to
+  @param port is the multicast port to bind to
+  @param options are the creation options (start from defaultOptions())
+*/
+SBus::SBus(const char* device, const char* mcip, int mcport, SBusOptions* options) {
+  init(device,mcip,mcport,options);
+}
+
+/**
+  Fills the default creation options
+  @param options is the options struct to fill
+*/
+void SBus::defaultOptions(SBusOptions* options) {
+  bzero(options,sizeof(SBusOptions));
+  options->engine=SBUS_ENGINE_POLL;
+  options->quantumMsgs=SBUS_QUANTUM_MSGS;
+  options->quantumBytes=SBUS_QUANTUM_BYTES;
+  options->reactors=1;
+  options->reactorPolicy=SBUS_REACTOR_LEAST_LOADED;
+  options->listenBacklog=SBUS_LISTEN_BACKLOG;
+  options->sendHighWatermark=SBUS_SEND_HIGH_WATERMARK;
+  options->sendLowWatermark=SBUS_SEND_LOW_WATERMARK;
+  options->mcastDatagramBytes=0;
+  options->streamReassembleBytes=SBUS_STREAM_REASSEMBLE_BYTES;
+  options->inQueueMsgs=SBUS_IN_QUEUE_MSGS;
+  options->inQueueBytes=SBUS_IN_QUEUE_BYTES;
+  options->inQueuePolicy=SBUS_IN_QUEUE_BLOCK;
+  // A single lane, messages are taken in arrival order
+  options->lanes=0;
+  options->laneDequeue=SBUS_LANES_STRICT;
+}
+
+/**
+  Sets how much is taken from a peer connection on each receive cycle,
+  so a chatty peer can not starve the others
+  @param msgs is the maximum messages per peer and cycle (0 unlimited)
+  @param bytes is the maximum bytes per peer and cycle (0 unlimited)
+*/
+void SBus::setQuantum(int msgs, int bytes) {
+  smessenger->setQuantum(msgs,bytes);
 }
 
 /**
   Sends a multicast message with a msgtag and empty data
   @param msgtag is the message code to send
-  @return is 0 if the message was sent succesfully or -1 on error
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the coalescing window (mcastBatchUs) or -1 on error
 */
 int SBus::send(int msgtag) {
   return smessenger->send(msgtag);
@@ -129,42 +236,88 @@ int SBus::send(int msgtag) {
   Sends a multicast message 
   @param msgtag is the message code to send
   @param msg is the message to send (Note: a string C++ can contain binary or test data)
-  @return is 0 if the message was sent succesfully or -1 on error
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the coalescing window (mcastBatchUs) or -1 on error
 */
 int SBus::send(int msgtag, string& msg) {
   return smessenger->send(msgtag,msg);
 }
 
+/**
+  Sends a multicast message gathered from several fragments, with no copies
+  @param msgtag is the message code to send
+  @param iov are the message fragments
+  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the coalescing window (mcastBatchUs) or -1 on error
+*/
+int SBus::send(int msgtag, const struct iovec* iov, int iovcnt) {
+  return smessenger->send(msgtag,iov,iovcnt);
+}
+
+/**
+  Sends several multicast messages at once, a single system call
+  (sendmmsg) per SBUS_MCAST_SEND_BATCH messages
+  @param msgs are the messages to send, in order
+  @param n is the number of messages
+  @return the number of messages sent (the first ones) or -1 on error
+*/
+int SBus::sendBatch(const SBusBatchMsg* msgs, int n) {
+  return smessenger->sendBatch(msgs,n);
+}
+
+/**
+  Sends right away the multicast messages waiting on the coalescing window
+  and the unicast messages held back for every peer (corked mode)
+  @return is 0 on success or -1 on error (some messages were lost)
+*/
+int SBus::flush() {
+  return smessenger->flush();
+}
+
 /**
   Gets the socket of a peer, connecting to it if needed
   @param peer is a local id for the SBus peer 
   @return the socket found or -1 on error
 */
 SocketType SBus::peer2Socket(int peer) {
+  pthread_mutex_lock(&contactsMutex);
   SPeerInfo* peerInfo=scontacts->find(peer);
   SocketType socket=-1;
   if(peerInfo!=NULL) {
     socket=peerInfo->getSocket();
   } else {
+    pthread_mutex_unlock(&contactsMutex);
     return -1;
   }
+  int ip=peerInfo->getIP();
+  unsigned short port=peerInfo->getPort();
+  string name=peerInfo->getName();
+  pthread_mutex_unlock(&contactsMutex);
   if(socket>=0) {
     return socket;
   } else {
-    int ip=peerInfo->getIP();
-    unsigned short port=peerInfo->getPort();
     // If we know the location...
     if(ip!=-1) {
-      // ...connect
+      // ...connect (the contacts are not locked meanwhile)
       socket=smessenger->connect(ip,port);
       if(socket>=0) {
-        peerInfo=scontacts->updateSocket(peerInfo,socket);
+        SocketType other=-1;
+        pthread_mutex_lock(&contactsMutex);
+        if((peerInfo=scontacts->find(peer))!=NULL) {
+          // Another sender may have connected meanwhile, the first connection stays
+          if((other=peerInfo->getSocket())<0) {
+            scontacts->updateSocket(peerInfo,socket);
+          }
+        }
+        pthread_mutex_unlock(&contactsMutex);
+        if(other>=0) {
+          smessenger->disconnect(socket);
+          socket=other;
+        }
       }
       return socket;
     // Otherwise
     } else {
       // ...error but find it!
-      string name=peerInfo->getName();
       if(name.size()>0) {
          send(SBUS_FIND,name);
       }
@@ -173,11 +326,27 @@ SocketType SBus::peer2Socket(int peer) {
   return -1;
 }
 
+/**
+  Gets the socket of a peer already connected, it never waits for a connection
+  @param peer is a local id for the SBus peer 
+  @return the socket found or -1 if not connected (or not known)
+*/
+SocketType SBus::peerSocket(int peer) {
+  SocketType socket=-1;
+  pthread_mutex_lock(&contactsMutex);
+  SPeerInfo* peerInfo=scontacts->find(peer);
+  if(peerInfo!=NULL) {
+    socket=peerInfo->getSocket();
+  }
+  pthread_mutex_unlock(&contactsMutex);
+  return socket;
+}
+
 /**
   Sends an unicast message to a peer with a msgtag and empty data
   @param msgtag is the message code to send
   @param peer is a local id for the SBus peer to send the message to
-  @return is 0 if the message was sent succesfully or -1 on error
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
 */
 int SBus::send(int msgtag, SBusPeer peer){
   SocketType socket=peer2Socket(peer);
@@ -192,7 +361,7 @@ int SBus::send(int msgtag, SBusPeer peer){
   @param msgtag is the message code to send
   @param peer is a local id for the SBus peer to send the message to
   @param msg is the message to send (Note: a string C++ can contain binary or test data)
-  @return is 0 if the message was sent succesfully or -1 on error
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
 */
 int SBus::send(int msgtag, SBusPeer peer, string& msg) {
   SocketType socket=peer2Socket(peer);
@@ -202,36 +371,421 @@ int SBus::send(int msgtag, SBusPeer peer, string& msg) {
   return smessenger->send(msgtag,socket,msg);
 }
 
+/**
+  Sends an unicast message to a peer gathered from several fragments, with no copies
+  (i.e. an application header and a payload kept apart)
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param iov are the message fragments
+  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
+*/
+int SBus::send(int msgtag, SBusPeer peer, const struct iovec* iov, int iovcnt) {
+  SocketType socket=peer2Socket(peer);
+  if(socket<0) {
+    return -1;
+  }
+  return smessenger->send(msgtag,socket,iov,iovcnt);
+}
+
+/**
+  Sends an unicast message to a peer from a library buffer (i.e. a received
+  body being forwarded); from SBusOptions.zeroCopyBytes on it is sent with
+  MSG_ZEROCOPY, the buffer is kept referenced until the kernel is done with it
+  (so its bytes must not be changed meanwhile)
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param body is the message to send
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
+*/
+int SBus::send(int msgtag, SBusPeer peer, SBufSlice& body) {
+  SocketType socket=peer2Socket(peer);
+  if(socket<0) {
+    return -1;
+  }
+  return smessenger->send(msgtag,socket,body);
+}
+
+/**
+  Sends an unicast message to a peer whose body is a region of a regular file
+  (i.e. a snapshot), the bytes go from the page cache to the connection
+  (sendfile()) without being read or copied by the process
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param fd is the file holding the message (it can be closed on return)
+  @param offset is the message start on the file
+  @param len is the message length (up to MAX_DATALEN); the region must
+    not be truncated until the message is sent
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
+*/
+int SBus::sendFile(int msgtag, SBusPeer peer, int fd, off_t offset, int len) {
+  SocketType socket=peer2Socket(peer);
+  if(socket<0) {
+    return -1;
+  }
+  return smessenger->sendFile(msgtag,socket,fd,offset,len);
+}
+
+/**
+  Begins a streamed message to a peer, a body of any size written in parts
+  and sent in chunks of up to SBUS_STREAM_CHUNK_BYTES; the peer gets it
+  reassembled or chunk by chunk (see recvStream())
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param total is the message length, if known (-1 unknown)
+  @return the stream writer (write() on it, then close() and delete it) or NULL on error
+*/
+SStreamWriter* SBus::openStream(int msgtag, SBusPeer peer, long long int total) {
+  SocketType socket=peer2Socket(peer);
+  if(socket<0) {
+    return NULL;
+  }
+  try {
+    return new SStreamWriter(smessenger,socket,__sync_add_and_fetch(&lastStream,1),msgtag,total);
+  } catch(string* s) {
+    ERROR("Could not open a stream to peer %d: %s",peer,s->c_str());
+    delete(s);
+    return NULL;
+  }
+}
+
+/**
+  Sends a message of any size to a peer as a stream (see openStream()),
+  it blocks while SBUS_STREAM_WINDOW chunks wait on the peer connection
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param data is the message to send
+  @param bytes is the message length
+  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if its end waits on the peer outbound queue or -1 on error
+*/
+int SBus::sendStream(int msgtag, SBusPeer peer, const char* data, long long int bytes) {
+  SStreamWriter* writer;
+  int res;
+  if((writer=openStream(msgtag,peer,bytes))==NULL) {
+    return -1;
+  }
+  if((res=writer->write(data,bytes))==0) {
+    res=writer->close();
+  }
+  delete(writer);
+  return res;
+}
+
+/**
+  Sends right away the unicast messages held back for a peer (corked mode)
+  @param peer is a local id for the SBus peer
+  @return is SBUS_SENT (0) if the messages were sent, SBUS_QUEUED (1) if they wait for room on the connection or -1 on error
+*/
+int SBus::flush(SBusPeer peer) {
+  SocketType socket=peer2Socket(peer);
+  if(socket<0) {
+    return -1;
+  }
+  return smessenger->flush(socket);
+}
+
+/**
+  Sends an unicast message to a peer asynchronously, it returns right away and
+  the sending thread connects to the peer (if needed) and writes the message
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param msg is the message to send (copied, it can be reused right away)
+  @return the send handle (wait() on it for the completion, unref() it when done)
+    or NULL on error
+*/
+SSend* SBus::sendAsync(int msgtag, SBusPeer peer, string& msg) {
+  struct iovec iov;
+  iov.iov_base=(void*)msg.data();
+  iov.iov_len=msg.size();
+  return sendAsync(msgtag,peer,&iov,1);
+}
+
+/**
+  Sends an unicast message to a peer asynchronously, gathered from several fragments
+  @param msgtag is the message code to send
+  @param peer is a local id for the SBus peer to send the message to
+  @param iov are the message fragments (copied, they can be reused right away)
+  @param iovcnt is the number of fragments
+  @return the send handle (wait() on it for the completion, unref() it when done)
+    or NULL on error
+*/
+SSend* SBus::sendAsync(int msgtag, SBusPeer peer, const struct iovec* iov, int iovcnt) {
+  SSend* handle;
+  try {
+    handle=new SSend(msgtag,peer,iov,iovcnt);
+  } catch(string* s) {
+    ERROR("Could not create asynchronous send: %s",s->c_str());
+    delete(s);
+    return NULL;
+  }
+  pthread_mutex_lock(&asyncMutex);
+  // The sending thread is only started if asynchronous sends are used
+  if(!asyncStarted) {
+    if(pthread_create(&asyncThread, NULL, asyncLoopStarter, (void*)this)!=0) {
+      pthread_mutex_unlock(&asyncMutex);
+      PERROR("Cannot start sending loop thread");
+      handle->unref();
+      return NULL;
+    }
+    asyncStarted=true;
+  }
+  // The queue holds its own reference until the message is handed over
+  handle->ref();
+  asyncq.push_back(handle);
+  pthread_cond_signal(&asyncCond);
+  pthread_mutex_unlock(&asyncMutex);
+  return handle;
+}
+
+/**
+  Hands an asynchronous send to the messenger, dropping the sending thread reference
+  @param handle is the asynchronous send
+  @param socket is the peer socket (-1 if it could not be connected)
+*/
+void SBus::asyncSend(SSend* handle, SocketType socket) {
+  struct iovec iov;
+  if(socket<0) {
+    handle->complete(EHOSTUNREACH);
+  } else {
+    handle->getBody(&iov);
+    smessenger->send(handle->getMsgTag(),socket,&iov,1,handle);
+  }
+  handle->unref();
+}
+
+/// Bucle principal de la hebra de envo asncrono
+void SBus::asyncLoop() {
+  SSend* handle;
+  pthread_t connector;
+  pthread_mutex_lock(&asyncMutex);
+  while(alive) {
+    if(asyncq.empty()) {
+      pthread_cond_wait(&asyncCond,&asyncMutex);
+      continue;
+    }
+    handle=asyncq.front();
+    asyncq.pop_front();
+    SBusPeer peer=handle->getPeer();
+    // The peer is being connected, it goes behind the sends already waiting
+    PendingSendHash::iterator it=asyncPending.find(peer);
+    if(it!=asyncPending.end()) {
+      it->second->push_back(handle);
+      continue;
+    }
+    pthread_mutex_unlock(&asyncMutex);
+    SocketType socket=peerSocket(peer);
+    if(socket>=0) {
+      asyncSend(handle,socket);
+      pthread_mutex_lock(&asyncMutex);
+      continue;
+    }
+    // Connecting may take a while, a thread of its own waits for it and
+    // the sends to other peers go on meanwhile
+    SBusConnect* args=new SBusConnect;
+    args->sbus=this;
+    args->peer=peer;
+    pthread_mutex_lock(&asyncMutex);
+    deque<SSend*>* pending=new deque<SSend*>();
+    pending->push_back(handle);
+    asyncPending[peer]=pending;
+    asyncConnecting++;
+    if(pthread_create(&connector, NULL, asyncConnectStarter, (void*)args)!=0) {
+      PERROR("Cannot start connecting thread, connecting from the sending thread");
+      delete(args);
+      pthread_mutex_unlock(&asyncMutex);
+      asyncConnect(peer);
+      pthread_mutex_lock(&asyncMutex);
+    } else {
+      pthread_detach(connector);
+    }
+  }
+  // What was not handed over yet is cancelled
+  while(!asyncq.empty()) {
+    asyncq.front()->complete(ECANCELED);
+    asyncq.front()->unref();
+    asyncq.pop_front();
+  }
+  // The connecting threads use the messenger until they are done
+  while(asyncConnecting>0) {
+    pthread_cond_wait(&asyncCond,&asyncMutex);
+  }
+  pthread_mutex_unlock(&asyncMutex);
+  DEBUG("Inner thread [asyncLoop()] ends");
+}
+
+/**
+  Connects to a peer and hands over the asynchronous sends waiting for it, in order
+  @param peer is a local id for the SBus peer
+*/
+void SBus::asyncConnect(SBusPeer peer) {
+  SSend* handle;
+  SocketType socket=peer2Socket(peer);
+  pthread_mutex_lock(&asyncMutex);
+  deque<SSend*>* pending=asyncPending[peer];
+  // Sends queued meanwhile are added here, the peer is done when none is left
+  while(!pending->empty()) {
+    handle=pending->front();
+    pending->pop_front();
+    if(!alive) {
+      handle->complete(ECANCELED);
+      handle->unref();
+      continue;
+    }
+    pthread_mutex_unlock(&asyncMutex);
+    asyncSend(handle,socket);
+    pthread_mutex_lock(&asyncMutex);
+  }
+  asyncPending.erase(peer);
+  delete(pending);
+  asyncConnecting--;
+  // The sending thread waits for the last one on shutdown
+  pthread_cond_signal(&asyncCond);
+  pthread_mutex_unlock(&asyncMutex);
+}
+
 /// Bucle principal de la hebra de recepcin
-void SBus::inLoop() {
+void SBus::inLoop(int reactor) {
+  SMsg* batch[IN_BATCH];
+  SIdle idler(spinUs,yieldUs);
+  bool parked=idler.idle();
   do {
-    SMsg* msg=smessenger->recv(WAIT_MS);
-    if(msg!=NULL) {
-      pthread_mutex_lock(&inMutex);
-      inq.push_back(msg);
-      pthread_mutex_unlock(&inMutex);
-      //DEBUG("New message of size %d in queue, total=%d",msg->getMsg().size(),inq.size());
+    int i;
+    // In low latency mode the sockets are busy-polled until the thread parks
+    int n=smessenger->recvBatch(reactor,batch,IN_BATCH,parked?WAIT_MS:0);
+    if(n>0) {
+      for(i=0;i<n;i++) {
+        enqueue(batch[i]);
+      }
+      //DEBUG("%d new messages in queue, total=%d",n,inq->size());
+      idler.reset();
+      parked=false;
+    } else {
+      parked=idler.idle();
     }
   } while(alive);
-  DEBUG("Inner thread [inLoop()] ends");
+  DEBUG("Inner thread [inLoop(%d)] ends",reactor);
+}
+
+/// Queues a received message, doing with a full queue what inQueuePolicy says
+void SBus::enqueue(SMsg* msg) {
+  bool waited=false;
+  int lane=laneOf(msg);
+  while(!inq->push(msg,lane)) {
+    // Peer disconnections are never dropped
+    if(!msg->isError()) {
+      if(inQueuePolicy==SBUS_IN_QUEUE_DROP_NEWEST) {
+        __sync_add_and_fetch(&inStats.droppedNewest,1);
+        delete(msg);
+        return;
+      }
+      if((inQueuePolicy==SBUS_IN_QUEUE_DROP_MCAST)&&
+         (msg->getSocket()==smessenger->getMulticastSocket())) {
+        __sync_add_and_fetch(&inStats.droppedMCast,1);
+        delete(msg);
+        return;
+      }
+      if(inQueuePolicy==SBUS_IN_QUEUE_DROP_OLDEST) {
+        bool kept;
+        SMsg* oldest=inq->popDroppable(lane,&kept);
+        if(oldest!=NULL) {
+          __sync_add_and_fetch(&inStats.droppedOldest,1);
+          delete(oldest);
+          continue;
+        }
+        if(kept) {
+          // A peer disconnection keeps its place, this one goes instead
+          __sync_add_and_fetch(&inStats.droppedNewest,1);
+          delete(msg);
+          return;
+        }
+        continue;
+      }
+    }
+    // A full queue holds this reactor back, so do the peers (TCP backpressure)
+    if(!waited) {
+      __sync_add_and_fetch(&inStats.blocked,1);
+      waited=true;
+    }
+    if(!alive) {
+      delete(msg);
+      return;
+    }
+    inq->waitRoom(msg,lane,FULL_WAIT_MS);
+  }
+}
+
+/// Gives the incoming queue lane of a message
+int SBus::laneOf(SMsg* msg) {
+  // Peer disconnections come after whatever the peer sent
+  if(!msg->isError()) {
+    int msgtag=msg->getMsgTag();
+    for(int i=0;i<nlanes;i++) {
+      if((msgtag>=lanes[i].fromTag)&&(msgtag<=lanes[i].toTag)) {
+        return i;
+      }
+    }
+  }
+  return nlanes;
+}
+
+/**
+  Gets the incoming queue overflow counters
+  @param stats is filled with the counters
+*/
+void SBus::getInQueueStats(SBusInQueueStats* stats) {
+  stats->droppedNewest=inStats.droppedNewest;
+  stats->droppedOldest=inStats.droppedOldest;
+  stats->droppedMCast=inStats.droppedMCast;
+  stats->blocked=inStats.blocked;
+}
+
+/**
+  Receives messages with this code: from the first subscription on, only
+  the subscribed codes (and the system ones) are received, the rest are
+  dropped as soon as their header is read, before copying or queueing them
+  @param msgtag is the message code (1 to 32767)
+*/
+void SBus::subscribe(int msgtag) {
+  smessenger->subscribe(msgtag);
+}
+
+/**
+  Stops receiving messages with this code, they are dropped as soon as
+  their header is read, before copying or queueing them
+  @param msgtag is the message code (1 to 32767)
+*/
+void SBus::unsubscribe(int msgtag) {
+  smessenger->unsubscribe(msgtag);
 }
 
 /**
   Gives the number of pending messages to be received
 */
 int SBus::getPending() {
-  return inq.size();
+  return inq->size();
 }
 
 /**
-  Gets a peer location while processing the message
-  @param peer is the reference to the peer
-  @param ip will be filled with the peer ip
-  @param port will be filled with the peer port
-  @return 0 on success or -1 if not found, not valid or consumed
+  Gives a descriptor to watch from an event loop (poll, epoll...), readable
+  whenever there are pending messages, to take them with tryRecv() until
+  it returns 0
+  @return the descriptor (not to be read nor closed)
 */
-SBusPeer SBus::processSMsg(SMsg* smsg) {
+int SBus::getNotifyFd() {
+  return inq->getNotifyFd();
+}
+
+/**
+  Gets a peer location while processing the message (contacts mutex held); the
+  system replies are not sent here, connecting to the peer would keep the contacts locked
+  @param smsg is the message received
+  @param replyPeer is filled with the peer owed a system reply (-1 if none)
+  @param replyTag is filled with the system reply message code
+  @return the sender peer or -1 if not found, not valid or consumed
+*/
+SBusPeer SBus::processSMsg(SMsg* smsg, SBusPeer* replyPeer, int* replyTag) {
   SocketType socket=smsg->getSocket();
+  *replyPeer=-1;
   int ip=smsg->getIP();
   unsigned short port=smsg->getPort();
   //DEBUG("smsg->isError()=%d",smsg->isError());
@@ -271,14 +825,16 @@ SBusPeer SBus::processSMsg(SMsg* smsg) {
         case SBUS_FIND:
           DEBUG("Got a FIND");
 	  if(name==smsg->getMsg()) {
-	    send(SBUS_MANAMEIS,peer,name);
+	    *replyPeer=peer;
+	    *replyTag=SBUS_MANAMEIS;
 	  }
 	  return -1;
 	case SBUS_MANAMEIS:
           DEBUG("Got a MANAMEIS");
           scontacts->updateName(peerInfo,smsg->getMsg());
 	  if(name==smsg->getMsg()) {
-	    send(SBUS_NAMETAKEN,peer,name);
+	    *replyPeer=peer;
+	    *replyTag=SBUS_NAMETAKEN;
             DEBUG("NAMETAKEN internally detected and notified");
 	  }
 	  break;
@@ -287,6 +843,11 @@ SBusPeer SBus::processSMsg(SMsg* smsg) {
           peerInfo=scontacts->updateName(peerInfo,smsg->getMsg());
 	  // Nothing more done here, user application decides if this is a bad thing
 	  break;
+	case SSTREAM_BEGIN:
+	case SSTREAM_CHUNK:
+	case SSTREAM_END:
+	  // Taken by recvStream()
+	  break;
 	default:
           WARN("Unsupported system message tag %d received",msgtag);
 	  break;
@@ -299,6 +860,8 @@ SBusPeer SBus::processSMsg(SMsg* smsg) {
   } else {
     SPeerInfo* peerInfo=scontacts->findFromSocket(socket);
     if(peerInfo!=NULL) {
+      // Streams cut short are not coming back
+      peerInfo->dropStreams();
       peerInfo=scontacts->updateSocket(peerInfo,INVALID_SOCKET);
       DEBUG("Peer's %d socket %d no longer valid (it's probably disconnected)",
         peerInfo->getPeer(),socket);
@@ -309,32 +872,247 @@ SBusPeer SBus::processSMsg(SMsg* smsg) {
   return -1;
 }
 
+/**
+  Takes a stream frame (contacts mutex held), reassembling its message or
+  telling where the frame stands on it; streams going wrong are dropped,
+  handed in parts they end right there with a cancelled end (total -1)
+  @param peer is the sender peer
+  @param frametag is the stream frame tag
+  @param pmsgtag is filled with the message code of the streamed message
+  @param body is the frame body, left referencing the message (or chunk) bytes
+  @param part is filled with the stream position
+  @return true if the message (or the part) has to be handed to the application
+*/
+bool SBus::takeStream(SBusPeer peer, int frametag, int* pmsgtag, SBufSlice& body,
+  SBusStreamPart* part) {
+  SPeerInfo* peerInfo=scontacts->find(peer);
+  SBufSlice frame=body;
+  SStream* sstream;
+  unsigned int stream;
+  long long int value;
+  bool reassembled;
+  if((peerInfo==NULL)||(SStream::unpack(frame,&stream,pmsgtag,&value,body)<0)) {
+    WARN("Malformed stream frame from peer %d dropped",peer);
+    return false;
+  }
+  part->stream=stream;
+  if(frametag==SSTREAM_BEGIN) {
+    // Stream frames pass the filter, the code of their message is checked here
+    if(!smessenger->isWanted(*pmsgtag)) {
+      DEBUG("Stream %u from peer %d with msgtag %d not subscribed, dropped",stream,peer,*pmsgtag);
+      return false;
+    }
+    try {
+      sstream=new SStream(*pmsgtag,value,streamReassembleBytes);
+    } catch(string* s) {
+      ERROR("Stream %u from peer %d dropped: %s",stream,peer,s->c_str());
+      delete(s);
+      return false;
+    }
+    peerInfo->addStream(stream,sstream);
+    part->kind=SBUS_STREAM_BEGIN;
+    part->offset=0;
+    part->total=value;
+    return !sstream->isReassembled();
+  }
+  if((sstream=peerInfo->findStream(stream))==NULL) {
+    // Its begin was missed or it was dropped already
+    DEBUG("Frame of unknown stream %u from peer %d dropped",stream,peer);
+    return false;
+  }
+  reassembled=sstream->isReassembled();
+  part->offset=sstream->getReceived();
+  if(frametag==SSTREAM_CHUNK) {
+    part->kind=SBUS_STREAM_CHUNK;
+    part->total=sstream->getTotal();
+    if((value==sstream->getReceived())&&(sstream->add(body)==0)) {
+      return !reassembled;
+    }
+    WARN("Stream %u from peer %d dropped (chunk at %lld after %lld bytes)",
+      stream,peer,value,sstream->getReceived());
+    value=-1;
+  } else if(reassembled&&(value==sstream->getReceived())) {
+    part->kind=SBUS_STREAM_NONE;
+    part->offset=0;
+    part->total=value;
+    body=sstream->take();
+    peerInfo->dropStream(stream);
+    return true;
+  } else if(value!=sstream->getReceived()) {
+    DEBUG("Stream %u from peer %d cut short (%lld bytes, %lld sent)",
+      stream,peer,sstream->getReceived(),value);
+  }
+  part->kind=SBUS_STREAM_END;
+  part->total=value;
+  body.release();
+  peerInfo->dropStream(stream);
+  return !reassembled;
+}
+
 /**
   Blocks and receives the next pending message (use getPending() to avoid blocking)
+  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
   @param pmsgtag is filled with the message code received
   @param ppeer is filled with the sender peer's local id
   @param msg is the message received (Note: a string C++ can contain binary or test data)
   @return is 0 if there was no message, the message received length, or -1 on error
 */
 int SBus::recv(int* pmsgtag, SBusPeer* ppeer, string& msg) {
+  return recv(pmsgtag,ppeer,msg,-1);
+}
+
+/**
+  Receives the next pending message, waiting for it up to a timeout
+  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id (-1 on timeout)
+  @param msg is the message received (Note: a string C++ can contain binary or test data)
+  @param timeout is the longest wait (ms, 0 does not wait, -1 forever)
+  @return is 0 on timeout, the message received length, or -1 on error
+*/
+int SBus::recv(int* pmsgtag, SBusPeer* ppeer, string& msg, int timeout) {
+  SBufSlice body;
+  int res=recvStream(pmsgtag,ppeer,body,NULL,timeout);
+  msg.assign(body.data(),body.size());
+  return res;
+}
+
+/**
+  Blocks and receives the next pending message without copying it (use getPending() to avoid blocking)
+  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id
+  @param body is left referencing the received message bytes (valid until released)
+  @return is 0 if there was no message, the message received length, or -1 on error
+*/
+int SBus::recv(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body) {
+  return recvStream(pmsgtag,ppeer,body,NULL,-1);
+}
+
+/**
+  Receives the next pending message without copying it, waiting for it up to a timeout
+  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id (-1 on timeout)
+  @param body is left referencing the received message bytes (valid until released)
+  @param timeout is the longest wait (ms, 0 does not wait, -1 forever)
+  @return is 0 on timeout, the message received length, or -1 on error
+*/
+int SBus::recv(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body, int timeout) {
+  return recvStream(pmsgtag,ppeer,body,NULL,timeout);
+}
+
+/**
+  Receives the next pending message, if any, without waiting
+  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id (-1 if there was no message)
+  @param msg is the message received (Note: a string C++ can contain binary or test data)
+  @return is 0 if there was no message, the message received length, or -1 on error
+*/
+int SBus::tryRecv(int* pmsgtag, SBusPeer* ppeer, string& msg) {
+  return recv(pmsgtag,ppeer,msg,0);
+}
+
+/**
+  Receives the next pending message, if any, without waiting nor copying it
+  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id (-1 if there was no message)
+  @param body is left referencing the received message bytes (valid until released)
+  @return is 0 if there was no message, the message received length, or -1 on error
+*/
+int SBus::tryRecv(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body) {
+  return recvStream(pmsgtag,ppeer,body,NULL,0);
+}
+
+/**
+  Blocks and receives the next pending message without copying it, telling
+  where it stands on its stream: streamed messages up to
+  SBusOptions.streamReassembleBytes come whole, bigger ones (or all, with
+  reassembly off) come as a begin, their chunks, in order, and an end
+  (those of unknown length outgrowing it are dropped)
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id
+  @param body is left referencing the received message (or chunk) bytes
+  @param part is filled with the stream position (see SBusStreamPart)
+  @return is 0 if there was no message, the message (or chunk) length, or -1 on error
+*/
+int SBus::recvStream(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body, SBusStreamPart* part) {
+  return recvStream(pmsgtag,ppeer,body,part,-1);
+}
+
+/**
+  Receives the next pending message without copying it, telling where it
+  stands on its stream (see recvStream()), waiting for it up to a timeout
+  @param pmsgtag is filled with the message code received
+  @param ppeer is filled with the sender peer's local id (-1 on timeout)
+  @param body is left referencing the received message (or chunk) bytes
+  @param part is filled with the stream position (see SBusStreamPart)
+  @param timeout is the longest wait (ms, 0 does not wait, -1 forever)
+  @return is 0 on timeout, the message (or chunk) length, or -1 on error
+*/
+int SBus::recvStream(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body, SBusStreamPart* part,
+  int timeout) {
+  SIdle idler(spinUs,yieldUs);
+  SBusStreamPart whole;
+  long long int deadline=(timeout>0)?timing_current_micros()+timeout*1000LL:0;
+  // Called from recv(), only whole messages are wanted
+  bool wholeOnly=(part==NULL);
+  if(wholeOnly) {
+    part=&whole;
+  }
   do {
-    pthread_mutex_lock(&inMutex);
-    if(inq.empty()) {
-      pthread_mutex_unlock(&inMutex);
-      usleep(SLEEP_uS);
+    SMsg* pmsg=inq->pop();
+    if(pmsg==NULL) {
+      int wait=WAIT_MS;
+      if(timeout>=0) {
+        long long int left=(timeout>0)?deadline-timing_current_micros():0;
+        if(left<=0) {
+          *ppeer=-1;
+          body.release();
+          return 0;
+        }
+        wait=(left<WAIT_MS*1000LL)?(int)((left+999)/1000):WAIT_MS;
+      }
+      // Parked until a receiving thread pushes a message
+      if(idler.idle()) {
+        inq->wait(wait);
+      }
       continue;
     }
-    SMsg* pmsg=inq.front();
-    inq.pop_front();
-    pthread_mutex_unlock(&inMutex);
+    idler.reset();
     if(pmsg!=NULL) {
-      if((*ppeer=processSMsg(pmsg))>=0) {
+      bool deliver;
+      SBusPeer replyPeer;
+      int replyTag;
+      pthread_mutex_lock(&contactsMutex);
+      *ppeer=processSMsg(pmsg,&replyPeer,&replyTag);
+      deliver=(*ppeer>=0);
+      if(deliver) {
         *pmsgtag=pmsg->getMsgTag();
-        msg=pmsg->getMsg();
-        delete(pmsg);
-        return msg.size();
-      } else {
-        delete(pmsg);
+        body=pmsg->getBody();
+        bzero(part,sizeof(SBusStreamPart));
+        part->total=body.size();
+        if((*pmsgtag<=SSTREAM_BEGIN)&&(*pmsgtag>=SSTREAM_END)) {
+          deliver=takeStream(*ppeer,*pmsgtag,pmsgtag,body,part);
+          if(deliver&&wholeOnly&&(part->kind!=SBUS_STREAM_NONE)) {
+            if(part->kind==SBUS_STREAM_BEGIN) {
+              WARN("Stream %u from peer %d (msgtag %d, %lld bytes) is not reassembled,"
+                " its parts are dropped (use recvStream())",part->stream,*ppeer,*pmsgtag,part->total);
+            }
+            deliver=false;
+          }
+        }
+      }
+      pthread_mutex_unlock(&contactsMutex);
+      // Replied with the contacts unlocked, the peer may have to be connected
+      if(replyPeer>=0) {
+        send(replyTag,replyPeer,name);
+      }
+      delete(pmsg);
+      if(deliver) {
+        return body.size();
       }
     }
   } while(1);
@@ -374,7 +1152,19 @@ void SBus::setDefaultSafeName() {
 
 /// Closes and frees the SBus resources
 SBus::~SBus() {
+  int i;
+  pthread_mutex_lock(&asyncMutex);
   alive=false;
+  pthread_cond_signal(&asyncCond);
+  pthread_mutex_unlock(&asyncMutex);
+  // The sending and receiving threads use the messenger until they see the flag
+  if(asyncStarted) {
+    pthread_join(asyncThread,NULL);
+  }
+  for(i=0;i<nInThreads;i++) {
+    pthread_join(inThreads[i],NULL);
+  }
+  delete(inq);
   scontacts->~SContacts();
   smessenger->~SMessenger();
 }
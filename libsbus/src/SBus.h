@@ -28,6 +28,7 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <deque>
 #include <string>
@@ -37,6 +38,10 @@ using namespace std;
 #include <sbusdefs.h>
 #include <SMessenger.h>
 #include <SContacts.h>
+#include <SSend.h>
+#include <SStream.h>
+#include <SStreamWriter.h>
+#include <SMsgQueue.h>
 
 /// Default Multicast Port
 #define DEFAULT_MCPORT 10001
@@ -45,6 +50,27 @@ using namespace std;
 
 namespace simple {
 
+class SBus;
+
+/// Asynchronous sends waiting for the connection to their peer, by peer
+typedef hash_map<SBusPeer,deque<SSend*>*> PendingSendHash;
+
+/// Receiving thread start up arguments
+typedef struct SBusInLoop {
+  /// SBus the thread feeds
+  SBus* sbus;
+  /// Reactor the thread serves
+  int reactor;
+} SBusInLoop;
+
+/// Connecting thread start up arguments
+typedef struct SBusConnect {
+  /// SBus the thread sends for
+  SBus* sbus;
+  /// Peer the thread connects to
+  SBusPeer peer;
+} SBusConnect;
+
 class SBus {
   private:
 	/// This SBus name
@@ -53,20 +79,65 @@ class SBus {
 	SMessenger* smessenger;
 	/// The contacts manager, with the list of know SBus peers
 	SContacts* scontacts;
-	/// Incoming message's queue asociated mutex
-	pthread_mutex_t inMutex;
-	/// Incoming message's queue
-	deque<SMsg*> inq;
-	/// Incoming message's queue thread
-	pthread_t inThread;
+	/// Contacts manager mutex (the asynchronous sends look peers up too)
+	pthread_mutex_t contactsMutex;
+	/// Incoming message's queue (lock-free, bounded)
+	SMsgQueue* inq;
+	/// Incoming message's queue threads, one per reactor
+	pthread_t inThreads[SBUS_MAX_REACTORS];
+	/// Incoming message's queue threads arguments
+	SBusInLoop inLoops[SBUS_MAX_REACTORS];
+	/// Incoming message's queue threads started
+	int nInThreads;
 	/// Incoming message's queue thread life's flag
 	bool alive;
+	/// Asynchronous sends waiting for the sending thread
+	deque<SSend*> asyncq;
+	/// Asynchronous sends queue mutex
+	pthread_mutex_t asyncMutex;
+	/// Signals the sending thread a new asynchronous send (or the shutdown)
+	pthread_cond_t asyncCond;
+	/// Asynchronous sends thread
+	pthread_t asyncThread;
+	/// The asynchronous sends thread was started
+	bool asyncStarted;
+	/// Asynchronous sends of the peers being connected, the others are not held by them
+	PendingSendHash asyncPending;
+	/// Connecting threads still running
+	int asyncConnecting;
+	/// Low latency mode spinning time (us) before yielding
+	int spinUs;
+	/// Low latency mode yielding time (us) before blocking
+	int yieldUs;
+	/// Streamed messages up to these bytes are reassembled (0 all handed in parts)
+	int streamReassembleBytes;
+	/// Last stream id given
+	unsigned int lastStream;
+	/// What is done with a full incoming queue (SBUS_IN_QUEUE_BLOCK, SBUS_IN_QUEUE_DROP_...)
+	int inQueuePolicy;
+	/// Incoming queue overflow counters
+	SBusInQueueStats inStats;
+	/// Incoming queue priority lanes (the default one aside)
+	int nlanes;
+	/// Message codes of each priority lane
+	SBusLane lanes[SBUS_MAX_LANES];
+	/// Gives the incoming queue lane of a message
+	int laneOf(SMsg* msg);
+	/// Queues a received message, doing with a full queue what inQueuePolicy says
+	void enqueue(SMsg* msg);
 	/// Gets the socket of a peer, connecting to it if needed
 	SocketType peer2Socket(int peer);
-	/// Gets a peer location
-	SBusPeer processSMsg(SMsg* smsg);
+	/// Gets the socket of a peer already connected
+	SocketType peerSocket(int peer);
+	/// Hands an asynchronous send to the messenger (or fails it)
+	void asyncSend(SSend* handle, SocketType socket);
+	/// Gets a peer location, telling which system reply is owed to the sender
+	SBusPeer processSMsg(SMsg* smsg, SBusPeer* replyPeer, int* replyTag);
+	/// Takes a stream frame, telling if something has to be handed to the application
+	bool takeStream(SBusPeer peer, int frametag, int* pmsgtag, SBufSlice& body,
+	  SBusStreamPart* part);
 	/// Initializes the SBus
-	void init(const char* device, const char* mcip, int mcport);
+	void init(const char* device, const char* mcip, int mcport, SBusOptions* options);
   public:
 	/**
 	  Creates a SBus binding with default settings
@@ -100,26 +171,96 @@ class SBus {
 	  @param port is the multicast port to bind to
 	*/
 	SBus(const char* device, const char* mcip, int mcport);
+	/**
+	  Creates a SBus binding on a specified multicast port with custom options
+	  NOTA: IT IS NOT thread-safe, avoid using the same SBus object on different threads
+	  @param device is the net interface to bind to
+	  @param mcip is the multicast address to bind to
+	  @param port is the multicast port to bind to
+	  @param options are the creation options (start from defaultOptions())
+	*/
+	SBus(const char* device, const char* mcip, int mcport, SBusOptions* options);
+	/**
+	  Fills the default creation options
+	  @param options is the options struct to fill
+	*/
+	static void defaultOptions(SBusOptions* options);
+	/**
+	  Sets how much is taken from a peer connection on each receive cycle,
+	  so a chatty peer can not starve the others
+	  @param msgs is the maximum messages per peer and cycle (0 unlimited)
+	  @param bytes is the maximum bytes per peer and cycle (0 unlimited)
+	*/
+	void setQuantum(int msgs, int bytes);
 	/// Closes and frees the SBus resources
 	~SBus();
 	/**
 	  Sends a multicast message with a msgtag and empty data
 	  @param msgtag is the message code to send
-	  @return is 0 if the message was sent succesfully or -1 on error
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the coalescing window (mcastBatchUs) or -1 on error
 	*/
 	int send(int msgtag);
 	/**
 	  Sends a multicast message 
 	  @param msgtag is the message code to send
 	  @param msg is the message to send (Note: a string C++ can contain binary or test data)
-	  @return is 0 if the message was sent succesfully or -1 on error
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the coalescing window (mcastBatchUs) or -1 on error
 	*/
 	int send(int msgtag, string& msg);
+	/**
+	  Sends a multicast message gathered from several fragments, with no copies
+	  @param msgtag is the message code to send
+	  @param iov are the message fragments
+	  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the coalescing window (mcastBatchUs) or -1 on error
+	*/
+	int send(int msgtag, const struct iovec* iov, int iovcnt);
+	/**
+	  Sends several multicast messages at once, a single system call
+	  (sendmmsg) per SBUS_MCAST_SEND_BATCH messages
+	  @param msgs are the messages to send, in order
+	  @param n is the number of messages
+	  @return the number of messages sent (the first ones) or -1 on error
+	*/
+	int sendBatch(const SBusBatchMsg* msgs, int n);
+	/**
+	  Sends right away the multicast messages waiting on the coalescing window
+	  and the unicast messages held back for every peer (corked mode)
+	  @return is 0 on success or -1 on error (some messages were lost)
+	*/
+	int flush();
+	/**
+	  Sends right away the unicast messages held back for a peer (corked mode)
+	  @param peer is a local id for the SBus peer
+	  @return is SBUS_SENT (0) if the messages were sent, SBUS_QUEUED (1) if they wait for room on the connection or -1 on error
+	*/
+	int flush(SBusPeer peer);
+	/**
+	  Sends an unicast message to a peer asynchronously, it returns right away and
+	  the sending thread connects to the peer (if needed) and writes the message;
+	  asynchronous sends keep their order among them, not with the synchronous ones
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param msg is the message to send (copied, it can be reused right away)
+	  @return the send handle (wait() on it for the completion, unref() it when done)
+	    or NULL on error
+	*/
+	SSend* sendAsync(int msgtag, SBusPeer peer, string& msg);
+	/**
+	  Sends an unicast message to a peer asynchronously, gathered from several fragments
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param iov are the message fragments (copied, they can be reused right away)
+	  @param iovcnt is the number of fragments
+	  @return the send handle (wait() on it for the completion, unref() it when done)
+	    or NULL on error
+	*/
+	SSend* sendAsync(int msgtag, SBusPeer peer, const struct iovec* iov, int iovcnt);
 	/**
 	  Sends an unicast message to a peer with a msgtag and empty data
 	  @param msgtag is the message code to send
 	  @param peer is a local id for the SBus peer to send the message to
-	  @return is 0 if the message was sent succesfully or -1 on error
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
 	*/
 	int send(int msgtag, SBusPeer peer);
 	/**
@@ -127,22 +268,174 @@ class SBus {
 	  @param msgtag is the message code to send
 	  @param peer is a local id for the SBus peer to send the message to
 	  @param msg is the message to send (Note: a string C++ can contain binary or test data)
-	  @return is 0 if the message was sent succesfully or -1 on error
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
 	*/
 	int send(int msgtag, SBusPeer peer, string& msg);
+	/**
+	  Sends an unicast message to a peer gathered from several fragments, with no copies
+	  (i.e. an application header and a payload kept apart)
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param iov are the message fragments
+	  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
+	*/
+	int send(int msgtag, SBusPeer peer, const struct iovec* iov, int iovcnt);
+	/**
+	  Sends an unicast message to a peer from a library buffer (i.e. a received
+	  body being forwarded); from SBusOptions.zeroCopyBytes on it is sent with
+	  MSG_ZEROCOPY, the buffer is kept referenced until the kernel is done with it
+	  (so its bytes must not be changed meanwhile)
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param body is the message to send
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
+	*/
+	int send(int msgtag, SBusPeer peer, SBufSlice& body);
+	/**
+	  Begins a streamed message to a peer, a body of any size written in parts
+	  and sent in chunks of up to SBUS_STREAM_CHUNK_BYTES; the peer gets it
+	  reassembled or chunk by chunk (see recvStream())
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param total is the message length, if known (-1 unknown)
+	  @return the stream writer (write() on it, then close() and delete it) or NULL on error
+	*/
+	SStreamWriter* openStream(int msgtag, SBusPeer peer, long long int total=-1);
+	/**
+	  Sends a message of any size to a peer as a stream (see openStream()),
+	  it blocks while SBUS_STREAM_WINDOW chunks wait on the peer connection
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param data is the message to send
+	  @param bytes is the message length
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if its end waits on the peer outbound queue or -1 on error
+	*/
+	int sendStream(int msgtag, SBusPeer peer, const char* data, long long int bytes);
+	/**
+	  Sends an unicast message to a peer whose body is a region of a regular file
+	  (i.e. a snapshot), the bytes go from the page cache to the connection
+	  (sendfile()) without being read or copied by the process
+	  @param msgtag is the message code to send
+	  @param peer is a local id for the SBus peer to send the message to
+	  @param fd is the file holding the message (it can be closed on return)
+	  @param offset is the message start on the file
+	  @param len is the message length (up to MAX_DATALEN); the region must
+	    not be truncated until the message is sent
+	  @return is SBUS_SENT (0) if the message was sent, SBUS_QUEUED (1) if it waits on the peer outbound queue or -1 on error
+	*/
+	int sendFile(int msgtag, SBusPeer peer, int fd, off_t offset, int len);
 	/**
 	  Gives the number of pending message to be received
 	  @return the number of pending messages in the queue
 	*/
 	int getPending();
+	/**
+	  Gets the incoming queue overflow counters
+	  @param stats is filled with the counters
+	*/
+	void getInQueueStats(SBusInQueueStats* stats);
+	/**
+	  Receives messages with this code: from the first subscription on, only
+	  the subscribed codes (and the system ones) are received, the rest are
+	  dropped as soon as their header is read, before copying or queueing them
+	  @param msgtag is the message code (1 to 32767)
+	*/
+	void subscribe(int msgtag);
+	/**
+	  Stops receiving messages with this code, they are dropped as soon as
+	  their header is read, before copying or queueing them
+	  @param msgtag is the message code (1 to 32767)
+	*/
+	void unsubscribe(int msgtag);
+	/**
+	  Gives a descriptor to watch from an event loop (poll, epoll...), readable
+	  whenever there are pending messages, to take them with tryRecv() until
+	  it returns 0
+	  @return the descriptor (not to be read nor closed)
+	*/
+	int getNotifyFd();
 	/**
 	  Blocks and receives the next pending message (use getPending() to avoid blocking)
+	  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
 	  @param pmsgtag is filled with the message code received
 	  @param ppeer is filled with the sender peer's local id
 	  @param msg is the message received (Note: a string C++ can contain binary or test data)
 	  @return is 0 if there was no message, the message received length, or -1 on error
 	*/
 	int recv(int* pmsgtag, SBusPeer* ppeer, string& msg);
+	/**
+	  Receives the next pending message, waiting for it up to a timeout
+	  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id (-1 on timeout)
+	  @param msg is the message received (Note: a string C++ can contain binary or test data)
+	  @param timeout is the longest wait (ms, 0 does not wait, -1 forever)
+	  @return is 0 on timeout, the message received length, or -1 on error
+	*/
+	int recv(int* pmsgtag, SBusPeer* ppeer, string& msg, int timeout);
+	/**
+	  Blocks and receives the next pending message without copying it (use getPending() to avoid blocking)
+	  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id
+	  @param body is left referencing the received message bytes (valid until released)
+	  @return is 0 if there was no message, the message received length, or -1 on error
+	*/
+	int recv(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body);
+	/**
+	  Receives the next pending message without copying it, waiting for it up to a timeout
+	  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id (-1 on timeout)
+	  @param body is left referencing the received message bytes (valid until released)
+	  @param timeout is the longest wait (ms, 0 does not wait, -1 forever)
+	  @return is 0 on timeout, the message received length, or -1 on error
+	*/
+	int recv(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body, int timeout);
+	/**
+	  Receives the next pending message, if any, without waiting
+	  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id (-1 if there was no message)
+	  @param msg is the message received (Note: a string C++ can contain binary or test data)
+	  @return is 0 if there was no message, the message received length, or -1 on error
+	*/
+	int tryRecv(int* pmsgtag, SBusPeer* ppeer, string& msg);
+	/**
+	  Receives the next pending message, if any, without waiting nor copying it
+	  (streamed messages bigger than SBusOptions.streamReassembleBytes need recvStream(), their parts are dropped here)
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id (-1 if there was no message)
+	  @param body is left referencing the received message bytes (valid until released)
+	  @return is 0 if there was no message, the message received length, or -1 on error
+	*/
+	int tryRecv(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body);
+	/**
+	  Blocks and receives the next pending message without copying it, telling
+	  where it stands on its stream: streamed messages up to
+	  SBusOptions.streamReassembleBytes come whole, bigger ones (or all, with
+	  reassembly off) come as a begin, their chunks, in order, and an end
+	  (those of unknown length outgrowing it are dropped)
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id
+	  @param body is left referencing the received message (or chunk) bytes
+	  @param part is filled with the stream position (see SBusStreamPart)
+	  @return is 0 if there was no message, the message (or chunk) length, or -1 on error
+	*/
+	int recvStream(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body, SBusStreamPart* part);
+	/**
+	  Receives the next pending message without copying it, telling where it
+	  stands on its stream (see recvStream()), waiting for it up to a timeout
+	  @param pmsgtag is filled with the message code received
+	  @param ppeer is filled with the sender peer's local id (-1 on timeout)
+	  @param body is left referencing the received message (or chunk) bytes
+	  @param part is filled with the stream position (see SBusStreamPart)
+	  @param timeout is the longest wait (ms, 0 does not wait, -1 forever)
+	  @return is 0 on timeout, the message (or chunk) length, or -1 on error
+	*/
+	int recvStream(int* pmsgtag, SBusPeer* ppeer, SBufSlice& body, SBusStreamPart* part,
+	  int timeout);
 	/**
 	  Get this SBus registered name
 	  @return a copy of the name string
@@ -152,7 +445,7 @@ class SBus {
 	  Registers this SBus with a name
 	  (Note that there may be name conflicts, received as messages)  
 	  @param name name to register this SBus with
-	  @return 0 on success, -1 on error
+	  @return is SBUS_SENT (0) or SBUS_QUEUED (1) on success (the name goes out as a multicast message), -1 on error
         */
 	int setName(string& name);
 	/**
@@ -173,8 +466,12 @@ class SBus {
 	  @return the channel found or -1 if the name was not know yet
 	*/
 	int find(string& name);
-	// Main reception thread loop
-	void inLoop();
+	// Main reception thread loop, feeding the incoming queue from a reactor
+	void inLoop(int reactor);
+	// Asynchronous sending thread loop
+	void asyncLoop();
+	// Connects to a peer for the asynchronous sends waiting on it
+	void asyncConnect(SBusPeer peer);
 };
 
 }
@@ -0,0 +1,782 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SConn.cpp
+   @brief Per TCP connection state, keeps partially received frames between polls
+   and the outbound frames the socket could not take yet
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <string>
+
+#include <errdefs.h>
+#include <sbusdefs.h>
+#include <stcp.h>
+#include <SBufPool.h>
+#include <SConn.h>
+
+using namespace std;
+using namespace simple;
+
+/// Initial (and idle) receive buffer size
+#define INITIAL_CAPACITY 16384
+/// Minimum free space for a read()
+#define MIN_READ 4096
+/// Queued frames handed to a single sendmsg()
+#define FLUSH_IOV 64
+/// File bytes read per send where there is no sendfile()
+#define SENDFILE_CHUNK 65536
+
+/// Last connection id given
+static unsigned int lastId=0;
+
+/**
+  Makes room for the expected frame, or for some more bytes, at the end of the buffer;
+  a buffer still referenced by received messages is never moved, a new one is used
+*/
+int SConn::reserve(int extra) {
+  int pending=end-start;
+  int needed=(expected>pending+extra)?expected:pending+extra;
+  bool shared=buf->isShared();
+  // Nothing left to keep, rewind
+  if((pending==0)&&!shared) {
+    start=end=0;
+  }
+  // Enough space left at the end
+  if((capacity-start)>=needed) {
+    return 0;
+  }
+  // Compaction of the partial frame to the buffer beginning
+  if(!shared&&(capacity>=needed)) {
+    memmove(buf->data(),&buf->data()[start],pending);
+    start=0;
+    end=pending;
+    return 0;
+  }
+  // Move the partial frame to a new buffer big enough for the whole frame
+  SBuf* newbuf;
+  RET_ON_FALSE(((newbuf=SBufPool::alloc((needed>INITIAL_CAPACITY)?needed:INITIAL_CAPACITY))!=NULL));
+  memcpy(newbuf->data(),&buf->data()[start],pending);
+  buf->unref();
+  buf=newbuf;
+  capacity=buf->getCapacity();
+  start=0;
+  end=pending;
+  if(capacity>INITIAL_CAPACITY) {
+    DEBUG("sconn: socket=%d buffer grown to %d bytes",socket,capacity);
+  }
+  return 0;
+}
+
+/// Creates the connection state for a connected socket
+SConn::SConn(SocketType socket) {
+  this->socket=socket;
+  this->id=__sync_add_and_fetch(&lastId,1);
+  this->ip=stcp_getIP(socket);
+  if((buf=SBufPool::alloc(INITIAL_CAPACITY))==NULL) {
+    throw new string("Could not create receive buffer for SConn object");
+  }
+  capacity=buf->getCapacity();
+  start=end=expected=0;
+  backlogged=false;
+  reactor=0;
+  refs=1;
+  outSent=outPending=0;
+  highWatermark=lowWatermark=0;
+  outBlocked=outArmed=outClosed=false;
+  corkBytes=0;
+  corkListed=false;
+  outQueued=outWritten=0;
+  zeroCopyBytes=0;
+  zeroCopySeq=0;
+  zeroCopyArmed=false;
+  pthread_mutex_init(&outMutex, NULL);
+}
+
+/// Drops the receive buffer and the outbound queue (the socket is NOT closed)
+SConn::~SConn() {
+  buf->unref();
+  while(!outq.empty()) {
+    if(outq.front().fd>=0) {
+      close(outq.front().fd);
+    }
+    outq.pop_front();
+  }
+  failWaiters(EPIPE);
+  // The socket is closed by now, the kernel does not read the buffers any more
+  unpinZeroCopy(0,(unsigned int)-1);
+  pthread_mutex_destroy(&outMutex);
+}
+
+/// Takes one more reference
+void SConn::ref() {
+  __sync_add_and_fetch(&refs,1);
+}
+
+/// Drops a reference, the last one frees the connection state
+void SConn::unref() {
+  if(__sync_sub_and_fetch(&refs,1)==0) {
+    delete(this);
+  }
+}
+
+/// Socket getter
+SocketType SConn::getSocket() {
+  return socket;
+}
+
+/// Id getter
+unsigned int SConn::getId() {
+  return id;
+}
+
+/// Remote IP getter
+int SConn::getIP() {
+  return ip;
+}
+
+/**
+  Reads whatever is available on the socket with a single read()
+  @return the bytes read, SOCK_TIMEOUT if nothing was ready,
+    SOCK_DISCONN if the peer closed or SOCK_ERROR on error
+*/
+int SConn::fill() {
+  int res;
+  RET_ON_ERROR(reserve(MIN_READ));
+  if((res=read(socket,&buf->data()[end],capacity-end))<0) {
+    if((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)) {
+      return SOCK_TIMEOUT;
+    }
+    PERROR("Error read()");
+    return SOCK_ERROR;
+  }
+  end+=res;
+  return res;
+}
+
+/**
+  Appends bytes received by other means (i.e. io_uring provided buffers)
+  @return 0 on success or -1 on error
+*/
+int SConn::append(const char* bytes, int len) {
+  RET_ON_ERROR(reserve(len));
+  memcpy(&buf->data()[end],bytes,len);
+  end+=len;
+  return 0;
+}
+
+/// Received bytes not consumed yet
+int SConn::available() {
+  return end-start;
+}
+
+/// Pointer to the first byte not consumed yet
+char* SConn::data() {
+  return &buf->data()[start];
+}
+
+/// Slice of the bytes not consumed yet, sharing the receive buffer
+SBufSlice SConn::slice(int offset, int length) {
+  return SBufSlice(buf,start+offset,length);
+}
+
+/// Marks bytes as consumed
+void SConn::consume(int bytes) {
+  start+=bytes;
+  expected=0;
+  // Once drained, big buffers used by big frames are given back
+  if((start==end)&&(capacity>INITIAL_CAPACITY)) {
+    SBuf* newbuf=SBufPool::alloc(INITIAL_CAPACITY);
+    if(newbuf!=NULL) {
+      buf->unref();
+      buf=newbuf;
+      capacity=buf->getCapacity();
+      start=end=0;
+    }
+  }
+}
+
+/// Tells how many bytes (from data()) the next frame needs to be complete
+void SConn::expect(int bytes) {
+  expected=bytes;
+}
+
+/// Tells if complete frames are waiting for the next receive cycle
+bool SConn::isBacklogged() {
+  return backlogged;
+}
+
+/// Marks (or unmarks) the connection as having complete frames waiting
+void SConn::setBacklogged(bool backlogged) {
+  this->backlogged=backlogged;
+}
+
+/// Reactor (receiving thread) serving the connection
+int SConn::getReactor() {
+  return reactor;
+}
+
+/// Assigns the reactor (receiving thread) serving the connection
+void SConn::setReactor(int reactor) {
+  this->reactor=reactor;
+}
+
+/**
+  Sets how much the outbound queue may hold
+  @param high is the queue size that refuses new frames (0 unlimited)
+  @param low is the queue size that accepts new frames again
+*/
+void SConn::setWatermarks(int high, int low) {
+  highWatermark=high;
+  lowWatermark=(low<high)?low:high;
+}
+
+/**
+  Holds back small frames on the outbound queue, so they go out together
+  (disables Nagle's algorithm on the socket, flushes are sent right away)
+  @param bytes is the queue size that sends the frames held back (0 off)
+*/
+void SConn::setCork(int bytes) {
+  int nodelay=(bytes>0)?1:0;
+  corkBytes=bytes;
+  if(setsockopt(socket,IPPROTO_TCP,TCP_NODELAY,&nodelay,sizeof(nodelay))<0) {
+    PERROR("Error setsockopt(TCP_NODELAY)");
+  }
+}
+
+/// Tells if the connection waits on the corked connections list
+bool SConn::isCorkListed() {
+  return corkListed;
+}
+
+/// Marks (or unmarks) the connection as waiting on the corked connections list
+void SConn::setCorkListed(bool listed) {
+  corkListed=listed;
+}
+
+/// Locks the outbound queue, needed around send(), flush() and the out flags
+void SConn::lockOut() {
+  pthread_mutex_lock(&outMutex);
+}
+
+/// Unlocks the outbound queue
+void SConn::unlockOut() {
+  pthread_mutex_unlock(&outMutex);
+}
+
+/**
+  Queues the part of a frame not sent yet, copied to a pooled buffer
+  @param vec are the frame fragments
+  @param veccnt is the number of fragments
+  @param skip is the number of bytes already sent
+  @return 0 on success or -1 on error
+*/
+int SConn::queue(const struct iovec* vec, int veccnt, int skip) {
+  int i;
+  int len=0;
+  int at=0;
+  SBuf* out;
+  SOutChunk chunk;
+  for(i=0;i<veccnt;i++) {
+    len+=vec[i].iov_len;
+  }
+  len-=skip;
+  RET_ON_FALSE(((out=SBufPool::alloc(len))!=NULL));
+  for(i=0;i<veccnt;i++) {
+    int piece=vec[i].iov_len;
+    const char* from=(const char*)vec[i].iov_base;
+    if(skip>=piece) {
+      skip-=piece;
+      continue;
+    }
+    memcpy(&out->data()[at],from+skip,piece-skip);
+    at+=piece-skip;
+    skip=0;
+  }
+  chunk.bytes=SBufSlice(out,0,len);
+  chunk.fd=-1;
+  chunk.offset=0;
+  chunk.length=len;
+  outq.push_back(chunk);
+  out->unref();
+  outPending+=len;
+  outQueued+=len;
+  return 0;
+}
+
+/**
+  Queues a file region, the queue owns the given dup() of the file
+  @param copy is the file descriptor (closed once the region is sent)
+  @param offset is the region start
+  @param length is the region length
+*/
+void SConn::queueFile(int copy, off_t offset, int length) {
+  SOutChunk chunk;
+  chunk.fd=copy;
+  chunk.offset=offset;
+  chunk.length=length;
+  outq.push_back(chunk);
+  outPending+=length;
+  outQueued+=length;
+}
+
+/// Drops the sent bytes from the outbound queue
+void SConn::dequeue(int sent) {
+  outPending-=sent;
+  outWritten+=sent;
+  while(sent>0) {
+    int left=outq.front().length-outSent;
+    if(sent>=left) {
+      sent-=left;
+      if(outq.front().fd>=0) {
+        close(outq.front().fd);
+      }
+      outq.pop_front();
+      outSent=0;
+    } else {
+      outSent+=sent;
+      sent=0;
+    }
+  }
+}
+
+/// Has an asynchronous send (if any) wait for the last queued frame to be written
+void SConn::addWaiter(SSend* done) {
+  SOutWaiter waiter;
+  if(done==NULL) {
+    return;
+  }
+  done->ref();
+  waiter.end=outQueued;
+  waiter.done=done;
+  outWaiters.push_back(waiter);
+}
+
+/// Completes the asynchronous sends whose frames were written
+void SConn::completeWaiters() {
+  while(!outWaiters.empty()&&(outWaiters.front().end<=outWritten)) {
+    outWaiters.front().done->complete(0);
+    outWaiters.front().done->unref();
+    outWaiters.pop_front();
+  }
+}
+
+/// Fails every asynchronous send still waiting
+void SConn::failWaiters(int error) {
+  while(!outWaiters.empty()) {
+    outWaiters.front().done->complete(error);
+    outWaiters.front().done->unref();
+    outWaiters.pop_front();
+  }
+}
+
+/**
+  Sends a frame without blocking, whatever the socket does not take is queued;
+  frames go after the ones already queued, so they keep their order
+  @param vec are the frame fragments (header included)
+  @param veccnt is the number of fragments
+  @param total is the frame length
+  @param done is the asynchronous send to complete once a queued frame is written (or NULL)
+  @return SBUS_SENT, SBUS_QUEUED (needs room on the socket), SCONN_CORKED
+    (held back by the cork) or -1 on error or when the queue is over its
+    high watermark (errno ENOBUFS, nothing sent)
+*/
+int SConn::send(const struct iovec* vec, int veccnt, int total, SSend* done,
+  SBuf* head, SBuf* body) {
+  int res;
+  int sent=0;
+  if(outClosed) {
+    errno=EPIPE;
+    return -1;
+  }
+  if((outPending>0)||((corkBytes>0)&&(total<corkBytes))) {
+    if(outBlocked||((highWatermark>0)&&(outPending+total>highWatermark))) {
+      outBlocked=(highWatermark>0);
+      errno=ENOBUFS;
+      return -1;
+    }
+    RET_ON_ERROR(queue(vec,veccnt,0));
+    addWaiter(done);
+    if(outArmed||(corkBytes==0)) {
+      return SBUS_QUEUED;
+    }
+    if(outPending<corkBytes) {
+      return SCONN_CORKED;
+    }
+    // The cork is full, all the frames held back go out together
+    RET_ON_ERROR((res=flush()));
+    return (res>0)?SBUS_QUEUED:SBUS_SENT;
+  }
+  if((head!=NULL)&&(body!=NULL)&&(zeroCopyBytes>0)&&(total>=zeroCopyBytes)) {
+    RET_ON_ERROR((sent=sendZeroCopy(vec,veccnt,head,body)));
+  } else {
+    RET_ON_ERROR((sent=sendNow(vec,veccnt,0)));
+  }
+  if(sent==total) {
+    return SBUS_SENT;
+  }
+  // The rest of the frame has to follow, whatever the watermarks say
+  RET_ON_ERROR(queue(vec,veccnt,sent));
+  addWaiter(done);
+  return SBUS_QUEUED;
+}
+
+/**
+  Sends a frame whose body is a file region without blocking, the body goes
+  from the page cache to the socket (sendfile()) and whatever the socket
+  does not take is queued (the file can be closed on return, a dup() is kept);
+  file frames are never held back by the cork
+  @param head is the frame header
+  @param headlen is the frame header length
+  @param fd is the file holding the body
+  @param offset is the body start on the file
+  @param length is the body length (not 0)
+  @return SBUS_SENT, SBUS_QUEUED (needs room on the socket) or -1 on error
+    or when the queue is over its high watermark (errno ENOBUFS, nothing sent)
+*/
+int SConn::sendFile(const char* head, int headlen, int fd, off_t offset, int length) {
+  struct iovec vec;
+  int copy;
+  int res;
+  int sent;
+  if(outClosed) {
+    errno=EPIPE;
+    return -1;
+  }
+  vec.iov_base=(void*)head;
+  vec.iov_len=headlen;
+  if(outPending>0) {
+    if(outBlocked||((highWatermark>0)&&(outPending+headlen+length>highWatermark))) {
+      outBlocked=(highWatermark>0);
+      errno=ENOBUFS;
+      return -1;
+    }
+    RET_ON_PERROR((copy=fcntl(fd,F_DUPFD_CLOEXEC,0)));
+    if(queue(&vec,1,0)<0) {
+      close(copy);
+      return -1;
+    }
+    queueFile(copy,offset,length);
+    if(outArmed) {
+      return SBUS_QUEUED;
+    }
+    // Frames held back by the cork go out along with the file
+    RET_ON_ERROR((res=flush()));
+    return (res>0)?SBUS_QUEUED:SBUS_SENT;
+  }
+  // The header waits for the first file bytes, to share their segment
+  RET_ON_ERROR((sent=sendNow(&vec,1,MSG_MORE)));
+  if(sent==headlen) {
+    RET_ON_ERROR((sent=sendFileNow(fd,offset,length)));
+    if(sent==length) {
+      return SBUS_SENT;
+    }
+    // The rest of the file has to follow, whatever the watermarks say
+    RET_ON_PERROR((copy=fcntl(fd,F_DUPFD_CLOEXEC,0)));
+    queueFile(copy,offset+sent,length-sent);
+    return SBUS_QUEUED;
+  }
+  RET_ON_PERROR((copy=fcntl(fd,F_DUPFD_CLOEXEC,0)));
+  if(queue(&vec,1,sent)<0) {
+    close(copy);
+    return -1;
+  }
+  queueFile(copy,offset,length);
+  return SBUS_QUEUED;
+}
+
+/**
+  Sends a file region with a single non blocking sendfile()
+  @return the bytes sent (0 if the socket had no room) or -1 on error; a file
+    ending before the region does too, and the connection is shut down, as
+    its frame can not be completed
+*/
+int SConn::sendFileNow(int fd, off_t offset, int length) {
+  ssize_t sent;
+#ifdef __linux__
+  while((sent=sendfile(socket,fd,&offset,length))<0) {
+    if((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+      return 0;
+    }
+    if(errno!=EINTR) {
+      return -1;
+    }
+  }
+#else
+  // No Linux like sendfile(), the region goes through a bounce buffer
+  char chunk[SENDFILE_CHUNK];
+  struct iovec vec;
+  while((sent=pread(fd,chunk,(length<SENDFILE_CHUNK)?length:SENDFILE_CHUNK,offset))<0) {
+    if(errno!=EINTR) {
+      return -1;
+    }
+  }
+  if(sent>0) {
+    vec.iov_base=chunk;
+    vec.iov_len=sent;
+    return sendNow(&vec,1,0);
+  }
+#endif
+  if(sent==0) {
+    ERROR("sconn: socket=%d file %d ended before the message body, dropping the connection",
+      socket,fd);
+    shutdown(socket,SHUT_RDWR);
+    errno=EIO;
+    return -1;
+  }
+  return sent;
+}
+
+/**
+  Sends a frame with a single non blocking sendmsg()
+  @return the bytes sent (0 if the socket had no room) or -1 on error
+*/
+int SConn::sendNow(const struct iovec* vec, int veccnt, int flags) {
+  struct msghdr mh;
+  int sent;
+  bzero(&mh,sizeof(mh));
+  mh.msg_iov=(struct iovec*)vec;
+  mh.msg_iovlen=veccnt;
+  while((sent=sendmsg(socket,&mh,MSG_DONTWAIT|MSG_NOSIGNAL|flags))<0) {
+    if((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+      return 0;
+    }
+    if(errno!=EINTR) {
+      return -1;
+    }
+  }
+  return sent;
+}
+
+/**
+  Sends a frame with MSG_ZEROCOPY, the kernel reads its pages while it sends them,
+  so its buffers are kept until the completion arrives on the error queue
+  @return the bytes sent (0 if the socket had no room) or -1 on error
+*/
+int SConn::sendZeroCopy(const struct iovec* vec, int veccnt, SBuf* head, SBuf* body) {
+#ifdef MSG_ZEROCOPY
+  SZeroCopyPin pin;
+  int sent=sendNow(vec,veccnt,MSG_ZEROCOPY);
+  // Over the locked memory limit, a plain send does
+  if((sent<0)&&(errno==ENOBUFS)) {
+    return sendNow(vec,veccnt,0);
+  }
+  if(sent>0) {
+    head->ref();
+    body->ref();
+    pin.seq=zeroCopySeq++;
+    pin.head=head;
+    pin.body=body;
+    zeroCopyPins.push_back(pin);
+  }
+  return sent;
+#else
+  return sendNow(vec,veccnt,0);
+#endif
+}
+
+/// Gives back the buffers of the zero-copy sends from lo to hi (both included)
+void SConn::unpinZeroCopy(unsigned int lo, unsigned int hi) {
+  deque<SZeroCopyPin>::iterator it=zeroCopyPins.begin();
+  while(it!=zeroCopyPins.end()) {
+    // Send numbers wrap around
+    if((unsigned int)(it->seq-lo)<=(unsigned int)(hi-lo)) {
+      it->head->unref();
+      it->body->unref();
+      it=zeroCopyPins.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+/**
+  Sends big frames without copying them to the kernel (SO_ZEROCOPY)
+  @param bytes is the frame size from which MSG_ZEROCOPY is used (0 off)
+  @return 0 on success or -1 if the socket does not support it
+*/
+int SConn::setZeroCopy(int bytes) {
+#ifdef SO_ZEROCOPY
+  int on=1;
+  if((bytes>0)&&(setsockopt(socket,SOL_SOCKET,SO_ZEROCOPY,&on,sizeof(on))<0)) {
+    PERROR("Error setsockopt(SO_ZEROCOPY)");
+    zeroCopyBytes=0;
+    return -1;
+  }
+  zeroCopyBytes=bytes;
+  return 0;
+#else
+  errno=ENOTSUP;
+  return -1;
+#endif
+}
+
+/// Tells if the kernel may still be reading buffers of zero-copy sends
+bool SConn::hasZeroCopyPending() {
+  return !zeroCopyPins.empty();
+}
+
+/**
+  Reads the zero-copy completions on the socket error queue, giving back
+  the buffers the kernel is done with
+  @return the completions read, or -1 if the socket has a real error
+*/
+int SConn::reapZeroCopy() {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err)+sizeof(struct sockaddr_in6))];
+  struct msghdr mh;
+  struct cmsghdr* cm;
+  struct sock_extended_err* serr;
+  int reaped=0;
+  while(1) {
+    bzero(&mh,sizeof(mh));
+    mh.msg_control=control;
+    mh.msg_controllen=sizeof(control);
+    if(recvmsg(socket,&mh,MSG_ERRQUEUE|MSG_DONTWAIT)<0) {
+      if(errno==EINTR) {
+        continue;
+      }
+      if((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+        break;
+      }
+      return -1;
+    }
+    for(cm=CMSG_FIRSTHDR(&mh);cm!=NULL;cm=CMSG_NXTHDR(&mh,cm)) {
+      if(!(((cm->cmsg_level==SOL_IP)&&(cm->cmsg_type==IP_RECVERR))||
+           ((cm->cmsg_level==SOL_IPV6)&&(cm->cmsg_type==IPV6_RECVERR)))) {
+        continue;
+      }
+      serr=(struct sock_extended_err*)CMSG_DATA(cm);
+      if((serr->ee_origin!=SO_EE_ORIGIN_ZEROCOPY)||(serr->ee_errno!=0)) {
+        errno=(serr->ee_errno!=0)?serr->ee_errno:EIO;
+        return -1;
+      }
+      unpinZeroCopy(serr->ee_info,serr->ee_data);
+      reaped++;
+    }
+  }
+  // Nothing to reap, the socket error is a real one
+  return (reaped>0)?reaped:-1;
+#else
+  return -1;
+#endif
+}
+
+/**
+  Sends as much of the outbound queue as the socket takes without blocking
+  @return the bytes still queued or -1 on error
+*/
+int SConn::flush() {
+  struct iovec vec[FLUSH_IOV];
+  struct msghdr mh;
+  int n;
+  int sent;
+  int flags;
+  deque<SOutChunk>::iterator it;
+  if(outClosed) {
+    errno=EPIPE;
+    return -1;
+  }
+  bzero(&mh,sizeof(mh));
+  while(!outq.empty()) {
+    if(outq.front().fd>=0) {
+      // File regions go from the page cache to the socket
+      if((sent=sendFileNow(outq.front().fd,outq.front().offset+outSent,
+        outq.front().length-outSent))<0) {
+        PERROR("Error sendfile()");
+        return -1;
+      }
+      if(sent==0) {
+        break;
+      }
+      dequeue(sent);
+      continue;
+    }
+    for(n=0,it=outq.begin();(it!=outq.end())&&(it->fd<0)&&(n<FLUSH_IOV);it++,n++) {
+      int from=(n==0)?outSent:0;
+      vec[n].iov_base=(void*)(it->bytes.data()+from);
+      vec[n].iov_len=it->length-from;
+    }
+    mh.msg_iov=vec;
+    mh.msg_iovlen=n;
+    // More frames follow, let the kernel fill up the segments
+    flags=MSG_DONTWAIT|MSG_NOSIGNAL|((it!=outq.end())?MSG_MORE:0);
+    if((sent=sendmsg(socket,&mh,flags))<0) {
+      if(errno==EINTR) {
+        continue;
+      }
+      if((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+        break;
+      }
+      PERROR("Error sendmsg()");
+      return -1;
+    }
+    dequeue(sent);
+  }
+  completeWaiters();
+  if(outBlocked&&(outPending<=lowWatermark)) {
+    outBlocked=false;
+  }
+  return outPending;
+}
+
+/// Bytes waiting on the outbound queue
+int SConn::getPending() {
+  return outPending;
+}
+
+/// Tells if the poller is watching for room on the socket
+bool SConn::isOutArmed() {
+  return outArmed;
+}
+
+/// Marks (or unmarks) the poller as watching for room on the socket
+void SConn::setOutArmed(bool armed) {
+  outArmed=armed;
+}
+
+/// Tells if the io_uring engine is polling the socket for zero-copy completions
+bool SConn::isZeroCopyArmed() {
+  return zeroCopyArmed;
+}
+
+/// Marks (or unmarks) the socket as polled for zero-copy completions
+void SConn::setZeroCopyArmed(bool armed) {
+  zeroCopyArmed=armed;
+}
+
+/// Refuses any further frame, the connection is being dropped
+void SConn::closeOut() {
+  outClosed=true;
+  failWaiters(EPIPE);
+}
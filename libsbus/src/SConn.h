@@ -0,0 +1,287 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SConn.h
+   @brief Per TCP connection state, keeps partially received frames between polls
+   and the outbound frames the socket could not take yet
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <deque>
+
+#include <stcp.h>
+#include <SBuf.h>
+#include <SSend.h>
+
+#ifndef SCONN
+#define SCONN
+
+/// Send result: the frame was held back on the outbound queue by the cork
+#define SCONN_CORKED 2
+
+using namespace std;
+
+namespace simple {
+
+/// Buffers lent to the kernel by a MSG_ZEROCOPY send
+typedef struct SZeroCopyPin {
+  /// Zero-copy send number, as the kernel counts them on the socket
+  unsigned int seq;
+  /// Frame header buffer (a reference is held)
+  SBuf* head;
+  /// Frame body buffer (a reference is held)
+  SBuf* body;
+} SZeroCopyPin;
+
+/// An outbound queue entry, bytes on a buffer or a region of a file
+typedef struct SOutChunk {
+  /// Bytes to send (empty for a file region)
+  SBufSlice bytes;
+  /// File sent with sendfile(), a dup() owned by the queue (-1 for bytes)
+  int fd;
+  /// File region start
+  off_t offset;
+  /// Chunk length (the bytes or the file region)
+  int length;
+} SOutChunk;
+
+/// An asynchronous send waiting for its queued frame to be written
+typedef struct SOutWaiter {
+  /// Queued bytes count (see SConn::outQueued) once its frame is written
+  long long int end;
+  /// The send to complete (a reference is held)
+  SSend* done;
+} SOutWaiter;
+
+class SConn {
+  private:
+	/// Connection socket
+	SocketType socket;
+	/// Unique id, tells apart connections reusing the same socket number
+	unsigned int id;
+	/// Remote peer IP (cached, so we do not getpeername() per message)
+	int ip;
+	/// Receive buffer, shared with the messages parsed from it
+	SBuf* buf;
+	/// Receive buffer total capacity
+	int capacity;
+	/// First received byte not consumed yet
+	int start;
+	/// End of the received bytes
+	int end;
+	/// Bytes needed to complete the next frame (0 if unknown)
+	int expected;
+	/// Complete frames are waiting for the next receive cycle
+	bool backlogged;
+	/// Reactor (receiving thread) serving the connection
+	int reactor;
+	/// References held (the connections table and the senders using it)
+	int refs;
+	/// Outbound frames (or their unsent tails) waiting for room on the socket
+	deque<SOutChunk> outq;
+	/// Bytes already sent of the first queued chunk
+	int outSent;
+	/// Bytes waiting on the outbound queue
+	int outPending;
+	/// Outbound queue size that refuses new frames
+	int highWatermark;
+	/// Outbound queue size that accepts new frames again
+	int lowWatermark;
+	/// New frames are refused until the queue drains to the low watermark
+	bool outBlocked;
+	/// The poller is watching for room on the socket
+	bool outArmed;
+	/// The connection is being dropped, no more frames are taken
+	bool outClosed;
+	/// Outbound bytes held back to go out together (0 off)
+	int corkBytes;
+	/// The connection waits on the corked connections list
+	bool corkListed;
+	/// Bytes ever queued
+	long long int outQueued;
+	/// Bytes ever written from the queue
+	long long int outWritten;
+	/// Asynchronous sends waiting for their queued frames, in queue order
+	deque<SOutWaiter> outWaiters;
+	/// Frames from this size on are sent with MSG_ZEROCOPY, if their buffers can be kept (0 off)
+	int zeroCopyBytes;
+	/// Next zero-copy send number
+	unsigned int zeroCopySeq;
+	/// Buffers the kernel may still be reading, in send order
+	deque<SZeroCopyPin> zeroCopyPins;
+	/// The io_uring engine is polling the socket for zero-copy completions
+	bool zeroCopyArmed;
+	/// Sends a frame with a single non blocking sendmsg()
+	int sendNow(const struct iovec* vec, int veccnt, int flags);
+	/// Sends a file region with a single non blocking sendfile()
+	int sendFileNow(int fd, off_t offset, int length);
+	/// Queues a file region, the queue owns the given dup() of the file
+	void queueFile(int copy, off_t offset, int length);
+	/// Drops the sent bytes from the outbound queue
+	void dequeue(int sent);
+	/// Sends a frame with MSG_ZEROCOPY, keeping its buffers until the kernel is done
+	int sendZeroCopy(const struct iovec* vec, int veccnt, SBuf* head, SBuf* body);
+	/// Gives back the buffers of the zero-copy sends from lo to hi (both included)
+	void unpinZeroCopy(unsigned int lo, unsigned int hi);
+	/// Has an asynchronous send (if any) wait for the last queued frame to be written
+	void addWaiter(SSend* done);
+	/// Completes the asynchronous sends whose frames were written
+	void completeWaiters();
+	/// Fails every asynchronous send still waiting
+	void failWaiters(int error);
+	/// Outbound queue mutex (senders run on the application threads)
+	pthread_mutex_t outMutex;
+	/// Makes room for the expected frame, or for some more bytes, at the end of the buffer
+	int reserve(int extra);
+	/// Queues the part of a frame not sent yet, copied to a pooled buffer
+	int queue(const struct iovec* vec, int veccnt, int skip);
+  public:
+	/// Creates the connection state for a connected socket
+	SConn(SocketType socket);
+	/// Drops the receive buffer and the outbound queue (the socket is NOT closed)
+	~SConn();
+	/// Takes one more reference
+	void ref();
+	/// Drops a reference, the last one frees the connection state
+	void unref();
+	/// Socket getter
+	SocketType getSocket();
+	/// Id getter
+	unsigned int getId();
+	/// Remote IP getter
+	int getIP();
+	/**
+	  Reads whatever is available on the socket with a single read()
+	  @return the bytes read, SOCK_TIMEOUT if nothing was ready,
+	    SOCK_DISCONN if the peer closed or SOCK_ERROR on error
+	*/
+	int fill();
+	/**
+	  Appends bytes received by other means (i.e. io_uring provided buffers)
+	  @return 0 on success or -1 on error
+	*/
+	int append(const char* bytes, int len);
+	/// Received bytes not consumed yet
+	int available();
+	/// Pointer to the first byte not consumed yet
+	char* data();
+	/// Slice of the bytes not consumed yet, sharing the receive buffer
+	SBufSlice slice(int offset, int length);
+	/// Marks bytes as consumed
+	void consume(int bytes);
+	/// Tells how many bytes (from data()) the next frame needs to be complete
+	void expect(int bytes);
+	/// Tells if complete frames are waiting for the next receive cycle
+	bool isBacklogged();
+	/// Marks (or unmarks) the connection as having complete frames waiting
+	void setBacklogged(bool backlogged);
+	/// Reactor (receiving thread) serving the connection
+	int getReactor();
+	/// Assigns the reactor (receiving thread) serving the connection
+	void setReactor(int reactor);
+	/**
+	  Sets how much the outbound queue may hold
+	  @param high is the queue size that refuses new frames (0 unlimited)
+	  @param low is the queue size that accepts new frames again
+	*/
+	void setWatermarks(int high, int low);
+	/**
+	  Holds back small frames on the outbound queue, so they go out together
+	  (disables Nagle's algorithm on the socket, flushes are sent right away)
+	  @param bytes is the queue size that sends the frames held back (0 off)
+	*/
+	void setCork(int bytes);
+	/// Tells if the connection waits on the corked connections list
+	bool isCorkListed();
+	/// Marks (or unmarks) the connection as waiting on the corked connections list
+	void setCorkListed(bool listed);
+	/// Locks the outbound queue, needed around send(), flush() and the out flags
+	void lockOut();
+	/// Unlocks the outbound queue
+	void unlockOut();
+	/**
+	  Sends a frame without blocking, whatever the socket does not take is queued;
+	  frames go after the ones already queued, so they keep their order
+	  @param vec are the frame fragments (header included)
+	  @param veccnt is the number of fragments
+	  @param total is the frame length
+	  @param done is the asynchronous send to complete once a queued frame is written (or NULL)
+	  @param head is the buffer holding the frame header, if it can be kept (or NULL)
+	  @param body is the buffer holding the frame body, if it can be kept (or NULL);
+	    with both, big frames are sent with MSG_ZEROCOPY (see setZeroCopy())
+	  @return SBUS_SENT, SBUS_QUEUED (needs room on the socket), SCONN_CORKED
+	    (held back by the cork) or -1 on error or when the queue is over its
+	    high watermark (errno ENOBUFS, nothing sent)
+	*/
+	int send(const struct iovec* vec, int veccnt, int total, SSend* done=NULL,
+	  SBuf* head=NULL, SBuf* body=NULL);
+	/**
+	  Sends a frame whose body is a file region without blocking, the body goes
+	  from the page cache to the socket (sendfile()) and whatever the socket
+	  does not take is queued (the file can be closed on return, a dup() is kept);
+	  file frames are never held back by the cork
+	  @param head is the frame header
+	  @param headlen is the frame header length
+	  @param fd is the file holding the body
+	  @param offset is the body start on the file
+	  @param length is the body length (not 0)
+	  @return SBUS_SENT, SBUS_QUEUED (needs room on the socket) or -1 on error
+	    or when the queue is over its high watermark (errno ENOBUFS, nothing sent)
+	*/
+	int sendFile(const char* head, int headlen, int fd, off_t offset, int length);
+	/**
+	  Sends as much of the outbound queue as the socket takes without blocking
+	  @return the bytes still queued or -1 on error
+	*/
+	int flush();
+	/**
+	  Sends big frames without copying them to the kernel (SO_ZEROCOPY)
+	  @param bytes is the frame size from which MSG_ZEROCOPY is used (0 off)
+	  @return 0 on success or -1 if the socket does not support it
+	*/
+	int setZeroCopy(int bytes);
+	/// Tells if the kernel may still be reading buffers of zero-copy sends
+	bool hasZeroCopyPending();
+	/**
+	  Reads the zero-copy completions on the socket error queue, giving back
+	  the buffers the kernel is done with
+	  @return the completions read, or -1 if the socket has a real error
+	*/
+	int reapZeroCopy();
+	/// Tells if the io_uring engine is polling the socket for zero-copy completions
+	bool isZeroCopyArmed();
+	/// Marks (or unmarks) the socket as polled for zero-copy completions
+	void setZeroCopyArmed(bool armed);
+	/// Bytes waiting on the outbound queue
+	int getPending();
+	/// Tells if the poller is watching for room on the socket
+	bool isOutArmed();
+	/// Marks (or unmarks) the poller as watching for room on the socket
+	void setOutArmed(bool armed);
+	/// Refuses any further frame and fails the sends waiting, the connection is being dropped
+	void closeOut();
+};
+
+}
+
+#endif
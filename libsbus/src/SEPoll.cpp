@@ -0,0 +1,168 @@
+/*
+      SBUS library: Simple BUS communications library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+      
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+      
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+      
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/  
+/** SEPoll.cpp
+
+  epoll() based SPoll, same interface but O(1) add/remove and only ready
+  descriptors are returned by getpolls() (Linux only)
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+
+#include <string>
+#include <iostream>
+
+#include <errdefs.h>
+#include <SEPoll.h>
+
+using namespace std;
+using namespace simple;
+
+/**
+  Creates the epoll poller
+ */
+SEPoll::SEPoll() {
+  if((epfd=epoll_create1(EPOLL_CLOEXEC))<0) {
+    throw new string("Could not create epoll instance for SEPoll object\n");
+  }
+  nready=0;
+}
+
+/**
+  Closes the epoll instance
+*/
+SEPoll::~SEPoll() {
+  close(epfd);
+}
+
+/**
+  Adds a file descriptor to the watched list
+
+  @param fd is the file descriptor to watch
+  @param events is the events mask to watch, poll() compatible ('man poll')
+
+  @return 0 on success and -1 on error
+  */
+int SEPoll::add(int fd, short events) {
+  struct epoll_event ev;
+  ASSERT(fd>0);
+  ASSERT(events!=0);
+  bzero(&ev,sizeof(ev));
+  // POLLIN, POLLOUT, POLLERR & POLLHUP share values with their EPOLL* (POLLNVAL has none)
+  ev.events=((unsigned short)events)&(POLLIN|POLLPRI|POLLOUT|POLLERR|POLLHUP);
+  ev.data.fd=fd;
+  if(epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev)<0) {
+    if(errno!=EEXIST) {
+      PERROR("Error epoll_ctl(ADD)");
+      return -1;
+    }
+    RET_ON_PERROR(epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev));
+  }
+  DEBUG("sepoll: fd=%d events=0x%04X",fd,events);
+  return 0;
+}
+
+/**
+  Changes the events watched on an already watched file descriptor
+
+  @param fd is the watched file descriptor
+  @param events is the new events mask to watch, poll() compatible ('man poll')
+
+  @return 0 on success and -1 on error (or if fd is not watched)
+  */
+int SEPoll::modify(int fd, short events) {
+  struct epoll_event ev;
+  ASSERT(fd>0);
+  ASSERT(events!=0);
+  bzero(&ev,sizeof(ev));
+  ev.events=((unsigned short)events)&(POLLIN|POLLPRI|POLLOUT|POLLERR|POLLHUP);
+  ev.data.fd=fd;
+  RET_ON_PERROR(epoll_ctl(epfd,EPOLL_CTL_MOD,fd,&ev));
+  return 0;
+}
+
+/**
+  Removes a file descriptor from the watched list, from the polling thread
+  only, as it edits the ready list that thread goes through
+
+  @param fd is the file descriptor to stop watching
+
+  @return 0 on success and 
+          -1 on error (a not watched fd is not considered a failure)
+  */
+int SEPoll::remove(int fd) {
+  struct epoll_event ev;
+  ASSERT(fd>0);
+  if(epoll_ctl(epfd,EPOLL_CTL_DEL,fd,&ev)<0) {
+    if((errno==ENOENT)||(errno==EBADF)) {
+      return 0;
+    }
+    PERROR("Error epoll_ctl(DEL)");
+    return -1;
+  }
+  // Forget any pending readiness of this fd from the last doPoll()
+  for(int i=0;i<nready;i++) {
+    if(ready[i].fd==fd) {
+      ready[i].revents=0;
+    }
+  }
+  return 0;
+}
+
+/**
+  Waits for events on the watched descriptors
+
+  @param timeout (in milliseconds) is the maximum wait, '<0 = forever'
+
+  @return 0 on timeout (or errno=EINTR), >0 ready descriptors and -1 on error
+*/
+int SEPoll::doPoll(int timeout) {
+  int res;
+  nready=0;
+  res=epoll_wait(epfd,events,SEPOLL_MAX_EVENTS,timeout);
+  if(res<0) {
+    if(errno==EINTR) {
+      return 0;
+    }
+    PERROR("Error epoll_wait()");
+    return -1;
+  }
+  for(nready=0;nready<res;nready++) {
+    ready[nready].fd=events[nready].data.fd;
+    ready[nready].events=0;
+    ready[nready].revents=(short)events[nready].events;
+  }
+  return nready;
+}
+
+/**
+  Gives the descriptors found ready by the last doPoll()
+
+  @param pfds is the pointer to be set to point to the ready list
+
+  @return the ready list size or -1 on error
+*/
+int SEPoll::getpolls(struct pollfd** pfds) {
+  (*pfds)=ready;
+  return nready;
+}
@@ -0,0 +1,104 @@
+/*
+      SBUS library: Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+      
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+      
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+      
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/ 
+/** @file SEPoll.h
+
+  epoll() based SPoll, same interface but O(1) add/remove and only ready
+  descriptors are returned by getpolls() (Linux only)
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sys/poll.h>
+#include <sys/epoll.h>
+
+#ifndef SEPOLL
+#define SEPOLL
+
+/// Maximum ready descriptors reported by a single doPoll()
+#define SEPOLL_MAX_EVENTS 256
+
+namespace simple {
+
+class SEPoll {
+  private:
+	/// epoll instance descriptor
+	int epfd;
+	/// Events returned by the last epoll_wait()
+	struct epoll_event events[SEPOLL_MAX_EVENTS];
+	/// Ready descriptors of the last doPoll(), in poll() format
+	struct pollfd ready[SEPOLL_MAX_EVENTS];
+	/// Number of ready descriptors
+	int nready;
+  public:
+	/// Constructor
+	SEPoll();
+	/// Destructor
+	~SEPoll();
+	/**
+	Adds a file descriptor to the watched list
+	
+	@param fd is the file descriptor to watch
+	@param events is the events mask to watch, poll() compatible ('man poll')
+	
+	@return 0 on success and -1 on error
+	*/
+	int add(int fd, short events);
+	/**
+	Removes a file descriptor from the watched list
+	
+	@param fd is the file descriptor to stop watching
+	
+	@return 0 on success and -1 on error
+	(a not watched fd is not considered a failure)
+	*/
+	int remove(int fd);
+	
+	/**
+	Changes the events watched on an already watched file descriptor
+	
+	@param fd is the watched file descriptor
+	@param events is the new events mask to watch, poll() compatible ('man poll')
+	
+	@return 0 on success and -1 on error (or if fd is not watched)
+	*/
+	int modify(int fd, short events);
+	
+	/**
+	Waits for events on the watched descriptors
+	
+	@param timeout (in milliseconds) is the maximum wait, '<0 = forever'
+	
+	@return 0 on timeout (or errno=EINTR), >0 ready descriptors and -1 on error
+	*/
+	int doPoll(int timeout);
+	
+	/**
+	Gives the descriptors found ready by the last doPoll()
+	
+	@param pfds is the pointer to be set to point to the ready list
+	
+	@return the ready list size or -1 on error
+	*/
+	int getpolls(struct pollfd** pfds);
+};
+
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SIdle.cpp
+   @brief Spin, then yield, then park idle strategy for polling loops
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sched.h>
+
+#include <timing.h>
+#include <SIdle.h>
+
+using namespace simple;
+
+/// Tells the CPU we are spinning (saves power and the pipeline on the way out)
+static inline void cpuRelax() {
+#if defined(__x86_64__)||defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+  Creates an idle strategy
+  @param spinUs is the time to spin before yielding (us)
+  @param yieldUs is the time to yield before parking (us)
+*/
+SIdle::SIdle(int spinUs, int yieldUs) {
+  this->spinUs=spinUs;
+  this->yieldUs=yieldUs;
+  since=0;
+}
+
+/// Some work was done, the next idle() starts spinning again
+void SIdle::reset() {
+  since=0;
+}
+
+/**
+  Nothing to do this time, spins or yields as the idle period goes by
+  @return true when the caller should park (block) instead
+*/
+bool SIdle::idle() {
+  long long int elapsed;
+  if((spinUs<=0)&&(yieldUs<=0)) {
+    return true;
+  }
+  if(since==0) {
+    since=timing_current_micros();
+  }
+  elapsed=timing_current_micros()-since;
+  if(elapsed<spinUs) {
+    cpuRelax();
+    return false;
+  }
+  if(elapsed<spinUs+yieldUs) {
+    sched_yield();
+    return false;
+  }
+  return true;
+}
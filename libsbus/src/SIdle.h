@@ -0,0 +1,64 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SIdle.h
+   @brief Spin, then yield, then park idle strategy for polling loops
+
+  A loop finding nothing to do calls idle(): for the first spinUs
+  microseconds it just spins, then it sched_yield()s for yieldUs more, and
+  from then on it tells the caller to park (block) its own way. reset()
+  is called whenever work was found.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+
+#ifndef SIDLE
+#define SIDLE
+
+namespace simple {
+
+class SIdle {
+  private:
+	/// Spinning time before yielding (us)
+	int spinUs;
+	/// Yielding time before parking (us)
+	int yieldUs;
+	/// When the current idle period started (0 if working)
+	long long int since;
+  public:
+	/**
+	  Creates an idle strategy
+	  @param spinUs is the time to spin before yielding (us)
+	  @param yieldUs is the time to yield before parking (us)
+	*/
+	SIdle(int spinUs, int yieldUs);
+	/// Some work was done, the next idle() starts spinning again
+	void reset();
+	/**
+	  Nothing to do this time, spins or yields as the idle period goes by
+	  @return true when the caller should park (block) instead
+	*/
+	bool idle();
+};
+
+}
+
+#endif
@@ -25,6 +25,8 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <string.h>
 #include <strings.h>
 #include <string>
@@ -34,6 +36,8 @@
 
 #include <stcp.h>
 #include <sudp.h>
+#include <SURing.h>
+#include <SBufPool.h>
 
 using namespace std;
 using namespace simple;
@@ -42,8 +46,9 @@ using namespace simple;
 #define MAX_CONN_TIMEOUT_MS 350
 /// Maximum buffer size (1 page)
 #define MAX_BUF 4096
-/// Header lenght
-#define HDRLEN sizeof(smsg_header)
+
+/// Multicast datagrams from this size on keep their receive buffer instead of being copied
+#define MCAST_HANDOVER 4096
 
 /// Packs a message for sending
 int SMessenger::packhdr(smsg_header* hdr, short msgtag, unsigned short port, int bytes) {
@@ -56,6 +61,37 @@ int SMessenger::packhdr(smsg_header* hdr, short msgtag, unsigned short port, int
   return HDRLEN;
 }
 
+/**
+  Packs a message header and lays it before the body fragments
+  @param vec is where to leave the header and the fragments (MAX_SEND_IOV+1 entries)
+  @param hdr is the header to pack
+  @param msgtag is the message tag/code
+  @param port is the sender port
+  @param iov are the body fragments
+  @param iovcnt is the number of fragments
+  @return the frame length (header included) or -1 if the message is not valid
+*/
+int SMessenger::packv(struct iovec* vec, smsg_header* hdr, short msgtag, unsigned short port,
+  const struct iovec* iov, int iovcnt) {
+  int i;
+  size_t bytes=0;
+  if((iovcnt<0)||(iovcnt>MAX_SEND_IOV)) {
+    ERROR("Bad message fragments count (%d, maximum is %d)",iovcnt,MAX_SEND_IOV);
+    return -1;
+  }
+  for(i=0;i<iovcnt;i++) {
+    if((bytes+=iov[i].iov_len)>MAX_DATALEN) {
+      ERROR("Message too big (%lu bytes>%d bytes)",(unsigned long)bytes,MAX_DATALEN);
+      return -1;
+    }
+    vec[i+1]=iov[i];
+  }
+  packhdr(hdr, msgtag, port, bytes);
+  vec[0].iov_base=hdr;
+  vec[0].iov_len=HDRLEN;
+  return HDRLEN+bytes;
+}
+
 /// Unpacks a received message
 int SMessenger::unpackhdr(smsg_header* hdr, short* pmsgtag, unsigned short* pport) {
   hdr->code=ntohs(hdr->code);
@@ -68,8 +104,13 @@ int SMessenger::unpackhdr(smsg_header* hdr, short* pmsgtag, unsigned short* ppor
 
 /// Inits the TCP server socket for unicast messaging
 int SMessenger::initServer() {
-  RET_ON_ERROR((servsock=stcp_server(ANY_IP_TXT,0)));
+  RET_ON_ERROR((servsock=stcp_serverBacklog(ANY_IP_TXT,0,listenBacklog)));
   stcp_setNonBlocking(servsock);
+  if(uring) {
+    RET_ON_ERROR(armAccept());
+  } else {
+    RET_ON_ERROR(reactors[0]->getPoll()->add(servsock, POLLIN | POLLHUP | POLLERR | POLLNVAL));
+  }
   char txt[IP_ADDR_STR_LENGTH];
   DEBUG("TCP server ServerSocket=%d - %s:%d",
       servsock,
@@ -81,8 +122,13 @@ int SMessenger::initServer() {
 /// Inits the UDP Multicast server socket for multicast messaging
 int SMessenger::initMCast() {
   RET_ON_ERROR((mcsock=sudp_mcast(device, mcip, mcport)));
-  RET_ON_ERROR(spoll.add(mcsock, POLLIN | POLLHUP | POLLERR | POLLNVAL));
+  if(uring) {
+    RET_ON_ERROR(armMCast());
+  } else {
+    RET_ON_ERROR(reactors[0]->getPoll()->add(mcsock, POLLIN | POLLHUP | POLLERR | POLLNVAL));
+  }
   stcp_setNonBlocking(mcsock);
+  setBusyPoll(mcsock);
   DEBUG("MCast MulticastSocket=%d - %s:%d",mcsock,mcip,mcport);
   return 0;
 }
@@ -92,8 +138,45 @@ int SMessenger::initMCast() {
   @param device is the device of the network interface to bind this SMessenger
   @param mcip is the Multicast IP to bind to
   @param port for multicast binding
+  @param options are the SBus creation options (engine...)
 */
-SMessenger::SMessenger(const char* device, const char* mcip, int mcport) {
+SMessenger::SMessenger(const char* device, const char* mcip, int mcport, SBusOptions* options) {
+  int i;
+  pthread_mutex_init(&connsMutex, NULL);
+  pthread_mutex_init(&sendMutex, NULL);
+  pthread_mutex_init(&filterMutex, NULL);
+  memset(tagFilter,0xFF,sizeof(tagFilter));
+  filtering=false;
+  busyPollUs=(options!=NULL)?options->busyPollUs:0;
+  listenBacklog=(options!=NULL)?options->listenBacklog:0;
+  sendHighWatermark=(options!=NULL)?options->sendHighWatermark:0;
+  sendLowWatermark=(options!=NULL)?options->sendLowWatermark:0;
+  // Receive fairness
+  quantumMsgs=(options!=NULL)?options->quantumMsgs:0;
+  quantumBytes=(options!=NULL)?options->quantumBytes:0;
+  // Receive reactors
+  nreactors=(options!=NULL)?options->reactors:1;
+  if(nreactors<1) {
+    nreactors=1;
+  } else if(nreactors>SBUS_MAX_REACTORS) {
+    WARN("%d reactors requested, using %d",nreactors,SBUS_MAX_REACTORS);
+    nreactors=SBUS_MAX_REACTORS;
+  }
+  reactorPolicy=(options!=NULL)?options->reactorPolicy:SBUS_REACTOR_LEAST_LOADED;
+  bzero(reactors,sizeof(reactors));
+  for(i=0;i<nreactors;i++) {
+    reactors[i]=new SReactor(i);
+  }
+  // Transport engine
+  uring=false;
+  sendRing=NULL;
+  bzero(mcbufs,sizeof(mcbufs));
+  if((options!=NULL)&&(options->engine==SBUS_ENGINE_URING)&&(initURing()<0)) {
+    WARN("io_uring engine not available, using poll engine");
+  }
+  if(!uring&&(initMCastBatch()<0)) {
+    throw new string("Could not create multicast receive buffers");
+  }
   // Servidor TCP
   if(initServer()<0) {
     throw new string("Could not init TCP server");
@@ -105,6 +188,14 @@ SMessenger::SMessenger(const char* device, const char* mcip, int mcport) {
   if(initMCast()<0) {
     throw new string("Could not init MultiCast");
   }
+  mcastBatchUs=(options!=NULL)?options->mcastBatchUs:0;
+  zeroCopyBytes=(options!=NULL)?options->zeroCopyBytes:0;
+  corkBytes=(options!=NULL)?options->corkBytes:0;
+  corkUs=(options!=NULL)?options->corkUs:0;
+  if(initFlusher()<0) {
+    throw new string("Could not start the flusher");
+  }
+  initFragments(options);
   // Ids del SBUS
   this->port=stcp_getLocalPort(servsock);
   //DEBUG("port=%d",this->port);
@@ -126,8 +217,31 @@ SMessenger::SMessenger(const char* device, const char* mcip, int mcport) {
 
 /// Cierra y libera los recursos un enlace SBUS
 SMessenger::~SMessenger() {
+  int i;
+  // Coalesced multicast frames go out before the socket is closed
+  closeFlusher();
+  // Closing the rings cancels any operation in flight
+  for(i=0;i<nreactors;i++) {
+    delete(reactors[i]);
+  }
+  delete(sendRing);
+  closeFragments();
   sudp_mclose(mcsock,device,mcip);
   close(servsock);
+  ConnHash::iterator it=conns.begin();
+  for(;it!=conns.end();it++) {
+    close(it->first);
+    it->second->unref();
+  }
+  conns.clear();
+  for(i=0;i<MCAST_BATCH;i++) {
+    if(mcbufs[i]!=NULL) {
+      mcbufs[i]->unref();
+    }
+  }
+  pthread_mutex_destroy(&connsMutex);
+  pthread_mutex_destroy(&sendMutex);
+  pthread_mutex_destroy(&filterMutex);
 }
 
 /// Returns multicast socket being used
@@ -150,6 +264,63 @@ int SMessenger::getServerPort() {
   return port;
 }
 
+/// Returns the number of receive reactors
+int SMessenger::getReactorCount() {
+  return nreactors;
+}
+
+/**
+  Receives messages with this code: from the first subscription on, only
+  the subscribed codes (and the system ones) are received, the rest are
+  dropped as soon as their header is read
+  @param msgtag is the message code (1 to 32767)
+*/
+void SMessenger::subscribe(int msgtag) {
+  if((msgtag<=0)||(msgtag>0x7FFF)) {
+    return;
+  }
+  pthread_mutex_lock(&filterMutex);
+  if(!filtering) {
+    // Word by word, so the receiving threads never see this code dropped
+    for(int i=0;i<TAG_FILTER_WORDS;i++) {
+      __sync_lock_test_and_set(&tagFilter[i],(i==(msgtag>>5))?1U<<(msgtag&31):0U);
+    }
+    filtering=true;
+  } else {
+    __sync_fetch_and_or(&tagFilter[msgtag>>5],1U<<(msgtag&31));
+  }
+  pthread_mutex_unlock(&filterMutex);
+}
+
+/**
+  Stops receiving messages with this code, they are dropped as soon as
+  their header is read
+  @param msgtag is the message code (1 to 32767)
+*/
+void SMessenger::unsubscribe(int msgtag) {
+  if((msgtag<=0)||(msgtag>0x7FFF)) {
+    return;
+  }
+  pthread_mutex_lock(&filterMutex);
+  __sync_fetch_and_and(&tagFilter[msgtag>>5],~(1U<<(msgtag&31)));
+  pthread_mutex_unlock(&filterMutex);
+}
+
+/// Tells if messages with this code are received
+bool SMessenger::isWanted(short msgtag) {
+  return (msgtag<=0)||(tagFilter[msgtag>>5]&(1U<<(msgtag&31)));
+}
+
+/// Tells if a datagram is worth taking, a fragment or a message with a code received
+bool SMessenger::isWantedDatagram(const char* dgram, int len) {
+  smsg_header head;
+  if(len<(int)HDRLEN) {
+    return true;
+  }
+  memcpy(&head,dgram,HDRLEN);
+  return isWanted((short)ntohs(head.code));
+}
+
 /**
   Creates a new point to point connection (TCP)
   @param ip is the remote ip to connect to
@@ -162,21 +333,48 @@ SocketType SMessenger::connect(int ip, unsigned short port) {
   sockaddr_int2ip(ipstr,ip);
   //DEBUG("Connecting to %s:%d...\n",ipstr,port);
   RET_ON_ERROR((fd=stcp_client(ipstr,port,0)));
-  RET_ON_ERROR(stcp_waitConnection(fd,MAX_CONN_TIMEOUT_MS));
+  // Refused or timed out connections are not kept
+  if(stcp_waitConnection(fd,MAX_CONN_TIMEOUT_MS)<0) {
+    DEBUG("Could not connect to %s:%d (%s)",ipstr,port,strerror(errno));
+    close(fd);
+    return -1;
+  }
   //DEBUG("Connected to %s:%d via %d\n",ipstr,port,fd);
   char ip1str[MAX_IP_ADDR_STR],ip2str[MAX_IP_ADDR_STR];
   DEBUG("Connected socket %d <L %s:%d-R %s:%d>"
         ,fd
 	,sockaddr_int2ip(ip1str,stcp_getLocalIP(fd)),stcp_getLocalPort(fd)
 	,sockaddr_int2ip(ip2str,stcp_getIP(fd)),stcp_getPort(fd));
-  RET_ON_ERROR(spoll.add(fd,POLLIN | POLLHUP | POLLERR | POLLNVAL));
+  if(addConn(fd)==NULL) {
+    close(fd);
+    return -1;
+  }
   return fd;
 }
 
+/**
+  Closes a point to point connection made with connect(), from any thread:
+  the socket is shut down, so its reactor finds it ended and drops and
+  closes it on its own thread, the only one touching its poller or ring
+  @param socket2peer is the connection to close
+*/
+void SMessenger::disconnect(SocketType socket2peer) {
+  SConn* conn;
+  DEBUG("Closing connection %d",socket2peer);
+  // Held, so the socket can not be closed (and reused) under the shutdown
+  if((conn=holdConn(socket2peer))==NULL) {
+    return;
+  }
+  if(shutdown(socket2peer,SHUT_RDWR)<0) {
+    PERROR("Error shutdown() on socket %d",socket2peer);
+  }
+  conn->unref();
+}
+
 /**
   Sends a messange header with no data over multicast
   @param msgtag is the message tag/code to be sent within the header
-  @return 0 on success or -1 in case of an error (message was not sent)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the coalescing window) or -1 in case of an error (message was not sent)
 */
 int SMessenger::send(int msgtag) {
   string nil="";
@@ -187,21 +385,40 @@ int SMessenger::send(int msgtag) {
   Sends a message over multicast
   @param msgtag is the message tag/code to be sent within the header
   @param msg is the data or body of the message
-  @return 0 on success or -1 in case of an error (message was not sent)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the coalescing window) or -1 in case of an error (message was not sent)
 */
 int SMessenger::send(int msgtag, string& msg) {
+  struct iovec iov;
+  iov.iov_base=(void*)msg.data();
+  iov.iov_len=msg.size();
+  return send(msgtag,&iov,1);
+}
+
+/**
+  Sends a message over multicast, its body gathered from several fragments
+  @param msgtag is the message tag/code to be sent within the header
+  @param iov are the body fragments
+  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the coalescing window) or -1 in case of an error (message was not sent)
+*/
+int SMessenger::send(int msgtag, const struct iovec* iov, int iovcnt) {
+  smsg_header hdr;
+  struct iovec vec[MAX_SEND_IOV+1];
+  int total2send;
   int sent=0;
-  int bytes=msg.size();
-  if(bytes>MAX_DATALEN) {
-    ERROR("Message too big (%d bytes>%d bytes)",bytes,MAX_DATALEN);
-    return -1;
+  RET_ON_ERROR((total2send=packv(vec, &hdr, msgtag, port, iov, iovcnt)));
+  if(isFragmented(total2send-HDRLEN)) {
+    return sendFragments(msgtag,iov,iovcnt,total2send-HDRLEN);
+  }
+  if(mcastBatchUs>0) {
+    return queueMCast(vec,iovcnt+1,total2send);
   }
-  char* buf=NULL;
-  int total2send=HDRLEN+bytes;
-  RET_ON_ERROR((buf=(char*)alloca(total2send)));
-  packhdr((smsg_header*)buf, msgtag, port, bytes);
-  memcpy(&buf[HDRLEN],msg.data(),bytes);
-  if((sent=sudp_mcsend(mcsock,buf,total2send,mcip,mcport))!=(int)total2send) {
+  if(sendRing!=NULL) {
+    struct sockaddr_in to;
+    sockaddr_set(&to,mcip,mcport);
+    return sendURing(mcsock,vec,iovcnt+1,total2send,&to);
+  }
+  if((sent=sudp_mcsendv(mcsock,vec,iovcnt+1,mcip,mcport))!=total2send) {
     PERROR("Error send()");
     ERROR("Could not send message (sent=%d of %d)",sent,total2send);
     return -1;
@@ -213,7 +430,7 @@ int SMessenger::send(int msgtag, string& msg) {
 /**
   Sends an unicast messange header with no data to a single peer
   @param msgtag is the message tag/code to be sent within the header
-  @return 0 on success or -1 in case of an error (message was not sent)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
 */
 int SMessenger::send(int msgtag, SocketType socket2peer) {
   string nil=string("");
@@ -224,220 +441,885 @@ int SMessenger::send(int msgtag, SocketType socket2peer) {
   Sends an unicast message to a peer
   @param msgtag is the message tag/code to be sent within the header
   @param msg is the data or body of the message
-  @return 0 on success or -1 in case of an error (message was not sent)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
 */
 int SMessenger::send(int msgtag, SocketType socket2peer, string& msg) {
-  int sent=0;
-  char* buf;
-  int bytes=msg.size();
-  if(bytes>MAX_DATALEN) {
-    ERROR("Message too big (%d bytes>%d bytes)",bytes,MAX_DATALEN);
-    return -1;
-  }  
-  int total2send=HDRLEN+bytes;
-  RET_ON_ERROR((buf=(char*)alloca(total2send)));
-  /* Port in TCP (point to point messages) is the TCP sender port, 
+  struct iovec iov;
+  iov.iov_base=(void*)msg.data();
+  iov.iov_len=msg.size();
+  return send(msgtag,socket2peer,&iov,1);
+}
+
+/**
+  Sends an unicast message to a peer, its body gathered from several fragments
+  (header and fragments go out with a single sendmsg(), no copies)
+  @param msgtag is the message tag/code to be sent within the header
+  @param socket2peer is the connection to the peer
+  @param iov are the body fragments
+  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
+*/
+int SMessenger::send(int msgtag, SocketType socket2peer, const struct iovec* iov, int iovcnt) {
+  return send(msgtag,socket2peer,iov,iovcnt,NULL);
+}
+
+/**
+  Sends an unicast message to a peer, its body gathered from several fragments,
+  and completes an asynchronous send once the message is written
+  @param msgtag is the message tag/code to be sent within the header
+  @param socket2peer is the connection to the peer
+  @param iov are the body fragments
+  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+  @param done is the asynchronous send to complete (or NULL)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue, done completes later)
+    or -1 in case of an error (message was not sent)
+*/
+int SMessenger::send(int msgtag, SocketType socket2peer, const struct iovec* iov, int iovcnt,
+  SSend* done) {
+  smsg_header hdr;
+  struct iovec vec[MAX_SEND_IOV+1];
+  int total2send;
+  /* Port in TCP (point to point messages) is the TCP sender port,
     NOT the TCP server port sent along for multicast messages
   */
   int tcpPort=stcp_getLocalPort(socket2peer);
-  packhdr((smsg_header*)buf, msgtag, tcpPort, bytes);
-  memcpy(&buf[HDRLEN],msg.data(),bytes);
-  if((sent=stcp_send(socket2peer,buf,total2send))!=(int)total2send) {
-    if(sent<0) {
-      PERROR("Error send()");
-    } else {
-      ERROR("Sending message (sent=%d of %d)",sent,total2send);
+  if((total2send=packv(vec, &hdr, msgtag, tcpPort, iov, iovcnt))<0) {
+    if(done!=NULL) {
+      done->complete(EMSGSIZE);
     }
     return -1;
   }
-  DEBUG("send sent MSGTAG=%d and %d bytes to %d",msgtag,sent,socket2peer);
-  return 0;
+  return sendFrame(msgtag,socket2peer,vec,iovcnt+1,total2send,NULL,NULL,done);
 }
 
-/// Accepts a TCP connection
-int SMessenger::acceptConn(SocketType servsock) {
-  int fd;
-  //DEBUG("Incoming connection...");
-  RET_ON_ERROR((fd = accept(servsock,NULL,NULL)));
-  DEBUG("Connection %d accepted",fd);
-  // Aade la nueva conexin como fuente de sucesos
-  spoll.add(fd, POLLIN | POLLHUP | POLLERR | POLLNVAL);
-  return 0;
-}
-
-/// Listen incomming connections
-int SMessenger::listenConn() {
+/**
+  Sends an unicast message to a peer, its body kept on a buffer the library
+  can hold, so from SBusOptions.zeroCopyBytes on it is sent with MSG_ZEROCOPY
+  (the buffer is referenced until the kernel is done reading it)
+  @param msgtag is the message tag/code to be sent within the header
+  @param socket2peer is the connection to the peer
+  @param body is the body of the message
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
+*/
+int SMessenger::send(int msgtag, SocketType socket2peer, SBufSlice& body) {
+  struct iovec vec[2];
+  SBuf* head;
   int res;
-  struct pollfd fds;
-  fds.fd=servsock;
-  fds.events=POLLIN|POLLHUP|POLLERR|POLLNVAL;
-  res=poll(&fds,1,0);
-  if(res>0) {
-    // Problems?
-    if((fds.revents&POLLHUP)||(fds.revents&POLLERR)||(fds.revents&POLLNVAL)) {
-      int fd=fds.fd;
-      ERROR("Server socket error detected");
-      close(fd);
-      return initServer();
-    }
-    // Data = Incoming connection
-    if(fds.revents&POLLIN) {
-      return acceptConn(fds.fd);
-    }
+  if((body.size()>MAX_DATALEN)||(body.buffer()==NULL)) {
+    struct iovec iov;
+    iov.iov_base=(void*)body.data();
+    iov.iov_len=body.size();
+    return send(msgtag,socket2peer,&iov,1);
   }
-  return 0;
+  // The header is lent to the kernel too, so it can not live on the stack
+  RET_ON_FALSE(((head=SBufPool::alloc(HDRLEN))!=NULL));
+  packhdr((smsg_header*)head->data(),msgtag,stcp_getLocalPort(socket2peer),body.size());
+  vec[0].iov_base=head->data();
+  vec[0].iov_len=HDRLEN;
+  vec[1].iov_base=(void*)body.data();
+  vec[1].iov_len=body.size();
+  res=sendFrame(msgtag,socket2peer,vec,2,HDRLEN+body.size(),head,body.buffer(),NULL);
+  head->unref();
+  return res;
 }
 
-/// Tries to get the next message in full from a socket
-int SMessenger::nextMsg(int fd, short* pmsgtag, char* data, int *len, struct sockaddr_in* from) {
-  int ready=0;
-  int datasize;
-  smsg_header head;
-  int addrlen;
-  char *buf;
-  unsigned short portFrom;
-  if(*len<=0) {
-    ERROR("Buffer too small (%d bytes)",*len);
+/**
+  Sends an unicast message to a peer, its body a region of a regular file
+  that goes from the page cache to the socket (sendfile()), never through
+  user space (the file can be closed or changed on return, not truncated)
+  @param msgtag is the message tag/code to be sent within the header
+  @param socket2peer is the connection to the peer
+  @param fd is the file holding the body
+  @param offset is the body start on the file
+  @param length is the body length (up to MAX_DATALEN)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
+*/
+int SMessenger::sendFile(int msgtag, SocketType socket2peer, int fd, off_t offset, int length) {
+  smsg_header hdr;
+  struct stat st;
+  SConn* conn;
+  int pending;
+  int res;
+  if((length<0)||(length>MAX_DATALEN)) {
+    ERROR("Message too big (%d bytes>%d bytes)",length,MAX_DATALEN);
+    errno=EMSGSIZE;
     return -1;
   }
-  addrlen=sizeof(struct sockaddr_in);
-  bzero(from,sizeof(struct sockaddr_in));
-  if((ready=recvfrom(fd,&head,HDRLEN,MSG_PEEK,
-      (struct sockaddr*)from,(socklen_t*)&addrlen))<0) {
-    if(errno==EAGAIN) {
-      DEBUG("fd=%d receiving EAGAIN",fd);
-      *len=0;
-      usleep(1); // Evita expera activa
-      return 0;
-    }
-    ERROR("Could not test header reception from %d",fd);
+  // Once the header is out the whole region has to follow
+  RET_ON_PERROR(fstat(fd,&st));
+  if(!S_ISREG(st.st_mode)||(offset<0)||(offset+length>st.st_size)) {
+    ERROR("File region %lld+%d is not on a regular file (%lld bytes)",
+      (long long)offset,length,(long long)st.st_size);
+    errno=EINVAL;
     return -1;
   }
-  if((ready>0)&&(ready<(int)HDRLEN)) {
-    //LOG("header not ready (ready=%d bytes of %d)",ready,HDRLEN);  
-    *len=0;
-    usleep(1); // Evita expera activa
-    return 0;
+  if(length==0) {
+    // Nothing to take from the file
+    return send(msgtag,socket2peer);
+  }
+  packhdr(&hdr,msgtag,stcp_getLocalPort(socket2peer),length);
+  if((conn=holdConn(socket2peer))==NULL) {
+    ERROR("Socket %d is not a peer connection",socket2peer);
+    return -1;
+  }
+  conn->lockOut();
+  if((res=conn->sendFile((const char*)&hdr,HDRLEN,fd,offset,length))==SBUS_QUEUED) {
+    // The reactor sends the rest once the socket has room
+    armOut(conn);
   }
-  if(ready<=0) { // Error o desconexin
-    if(ready<0) {
-      ERROR("Could not receive from %d",fd);
+  pending=conn->getPending();
+  conn->unlockOut();
+  conn->unref();
+  if(res<0) {
+    if(errno==ENOBUFS) {
+      WARN("Peer on socket %d is too slow, message dropped (%d bytes queued)",socket2peer,pending);
     } else {
-      DEBUG("Connection %d dropped",fd);
+      PERROR("Error sendfile()");
     }
     return -1;
   }
-  datasize=unpackhdr(&head,pmsgtag,&portFrom);
-  if(datasize<0) {
-    WARN("Message dropped!");
+  DEBUG("sendFile %s MSGTAG=%d and %d bytes to %d",(res==SBUS_SENT)?"sent":"queued",
+    msgtag,length,socket2peer);
+  return res;
+}
+
+/**
+  Sends a packed frame on a peer connection, or queues it for the reactor
+  @param msgtag is the message tag/code (for the logs)
+  @param socket2peer is the connection to the peer
+  @param vec are the frame fragments, header included
+  @param veccnt is the number of fragments
+  @param total2send is the frame length
+  @param head is the buffer holding the header, if it can be kept (or NULL)
+  @param body is the buffer holding the body, if it can be kept (or NULL)
+  @param done is the asynchronous send to complete (or NULL)
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue, done completes later)
+    or -1 in case of an error (message was not sent)
+*/
+int SMessenger::sendFrame(int msgtag, SocketType socket2peer, struct iovec* vec, int veccnt,
+  int total2send, SBuf* head, SBuf* body, SSend* done) {
+  int pending;
+  int res;
+  bool listed=false;
+  SConn* conn;
+  if((conn=holdConn(socket2peer))==NULL) {
+    ERROR("Socket %d is not a peer connection",socket2peer);
+    if(done!=NULL) {
+      done->complete(ENOTCONN);
+    }
     return -1;
   }
-  if(datasize>(*len)) {
-    WARN("Received message too big for buffer %d > %d",datasize,*len);
-    return -1;
+  conn->lockOut();
+  res=conn->send(vec,veccnt,total2send,done,head,body);
+  if(res==SCONN_CORKED) {
+    // The first frame held back starts the cork deadline
+    listed=!conn->isCorkListed();
+    conn->setCorkListed(true);
+    res=SBUS_QUEUED;
+  } else if(res==SBUS_QUEUED) {
+    // The reactor sends the rest once the socket has room
+    armOut(conn);
   }
-  if((buf=(char*)alloca(HDRLEN+datasize))<0) {
-    ERROR("Could not prepare receiving buffer");
-    return -1;
+  if(uring&&conn->hasZeroCopyPending()) {
+    // Nobody polls the socket errors otherwise
+    armZeroCopy(conn);
   }
-  if((ready=recvfrom(fd,buf,HDRLEN+datasize,MSG_PEEK,
-      (struct sockaddr*)from,(socklen_t*)&addrlen))<0) {
-    if(errno==EAGAIN) {
-      *len=0;
-      return 0;
+  pending=conn->getPending();
+  conn->unlockOut();
+  if(listed) {
+    corkConn(conn);
+  }
+  conn->unref();
+  if(res<0) {
+    int reason=errno;
+    if(reason==ENOBUFS) {
+      WARN("Peer on socket %d is too slow, message dropped (%d bytes queued)",socket2peer,pending);
+    } else {
+      PERROR("Error send()");
+    }
+    if(done!=NULL) {
+      done->complete(reason);
     }
-    ERROR("Could not test frame reception from %d",fd);
     return -1;
   }
-  if(ready<(int)(datasize+HDRLEN)) {
-//    INFO("data not ready (ready=%d bytes)",ready);
-    *len=0;
-    usleep(1); // Evita expera activa
+  if((res==SBUS_SENT)&&(done!=NULL)) {
+    done->complete(0);
+  }
+  DEBUG("send %s MSGTAG=%d and %d bytes to %d",(res==SBUS_SENT)?"sent":"queued",
+    msgtag,total2send,socket2peer);
+  return res;
+}
+
+/**
+  Sends as much of a connection's outbound queue as its socket takes,
+  the poller stops watching for room once the queue is empty
+  @param r is the reactor serving the connection
+  @param conn is the TCP connection state
+  @return the bytes still queued or -1 on error
+*/
+int SMessenger::flushConn(SReactor* r, SConn* conn) {
+  int left;
+  conn->lockOut();
+  left=conn->flush();
+  if(uring) {
+    // io_uring polls are one shot, a queue left over needs another one
+    conn->setOutArmed(false);
+    if((left>0)&&(armOut(conn)<0)) {
+      left=-1;
+    }
+  } else if((left==0)&&conn->isOutArmed()) {
+    r->getPoll()->modify(conn->getSocket(), POLLIN | POLLHUP | POLLERR | POLLNVAL);
+    conn->setOutArmed(false);
+  }
+  conn->unlockOut();
+  return left;
+}
+
+/**
+  Has the poller watch for room on a connection's socket, so its reactor
+  sends the outbound queue (outbound queue locked)
+  @param conn is the TCP connection state
+  @return 0 on success or -1 on error
+*/
+int SMessenger::armOut(SConn* conn) {
+  if(conn->isOutArmed()) {
     return 0;
   }
-  // Llegados aqui extraemos todo del buffer porque ya que esta listo
-  if((ready=recvfrom(fd,buf,HDRLEN+datasize,0,
-      (struct sockaddr*)from,(socklen_t*)&addrlen))<(int)(HDRLEN+datasize)) {
-    if(ready<0) {
-      PERROR("Error recvfrom()");
-    } else {
-      ERROR("Could not extract msg from socket %d buffer\n",fd);
+  if(uring) {
+    RET_ON_ERROR(armSend(conn));
+  } else {
+    RET_ON_ERROR(reactors[conn->getReactor()]->getPoll()->modify(conn->getSocket(),
+      POLLIN | POLLOUT | POLLHUP | POLLERR | POLLNVAL));
+  }
+  conn->setOutArmed(true);
+  return 0;
+}
+
+/**
+  Sends a connection's outbound queue, or leaves it to the reactor if it is
+  already waiting for room on the socket (outbound queue locked)
+  @param conn is the TCP connection state
+  @return SBUS_SENT, SBUS_QUEUED (waits for room on the socket) or -1 on error
+*/
+int SMessenger::flushOut(SConn* conn) {
+  int left;
+  if(conn->isOutArmed()) {
+    return SBUS_QUEUED;
+  }
+  RET_ON_ERROR((left=conn->flush()));
+  if(left==0) {
+    return SBUS_SENT;
+  }
+  RET_ON_ERROR(armOut(conn));
+  return SBUS_QUEUED;
+}
+
+/**
+  Reads the zero-copy completions reported as an error on a peer connection,
+  giving back the buffers the kernel is done with
+  @param fd is the connection socket
+  @return the completions read, or -1 if it is a real socket error
+*/
+int SMessenger::reapZeroCopy(SocketType fd) {
+  SConn* conn;
+  int res;
+  if((conn=holdConn(fd))==NULL) {
+    return -1;
+  }
+  conn->lockOut();
+  res=conn->reapZeroCopy();
+  conn->unlockOut();
+  conn->unref();
+  return res;
+}
+
+/**
+  Accepts every TCP connection waiting on the server socket, so a connection
+  storm is admitted on a single readiness event
+  @param servsock is the (non blocking) TCP server socket
+  @return the number of connections accepted or -1 on error
+*/
+int SMessenger::acceptConn(SocketType servsock) {
+  int fd;
+  int count=0;
+  while(true) {
+#ifdef __linux__
+    fd=accept4(servsock,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+    if((fd=accept(servsock,NULL,NULL))>=0) {
+      stcp_setNonBlocking(fd);
+    }
+#endif
+    if(fd<0) {
+      if((errno==EAGAIN)||(errno==EWOULDBLOCK)) {
+        break;
+      }
+      if((errno==EINTR)||(errno==ECONNABORTED)) {
+        continue;
+      }
+      // i.e. out of descriptors, the rest wait on the listen backlog
+      PERROR("Error accept()");
+      return (count>0)?count:-1;
+    }
+    DEBUG("Connection %d accepted",fd);
+    if(addConn(fd)==NULL) {
+      close(fd);
+      continue;
+    }
+    count++;
+  }
+  return count;
+}
+
+/**
+  Picks the reactor for a new TCP connection, the one serving the fewest
+  connections or one hashed from the peer address and port
+  @param conn is the new TCP connection state
+  @return the reactor chosen
+*/
+SReactor* SMessenger::pickReactor(SConn* conn) {
+  int i;
+  int best=0;
+  if(nreactors==1) {
+    return reactors[0];
+  }
+  if(reactorPolicy==SBUS_REACTOR_HASH) {
+    unsigned int h=((unsigned int)conn->getIP())*2654435761U;
+    h^=((unsigned int)stcp_getPort(conn->getSocket()))*40503U;
+    return reactors[(h>>7)%nreactors];
+  }
+  for(i=1;i<nreactors;i++) {
+    if(reactors[i]->getLoad()<reactors[best]->getLoad()) {
+      best=i;
+    }
+  }
+  return reactors[best];
+}
+
+/**
+  Registers the state for a new TCP connection and starts receiving on it,
+  the connection stays with the same reactor until it is dropped
+  @param fd is the connected socket
+  @return the connection state or NULL on error (the socket is NOT closed)
+*/
+SConn* SMessenger::addConn(SocketType fd) {
+  SConn* conn=NULL;
+  SReactor* r;
+  try {
+    conn=new SConn(fd);
+  } catch(string* s) {
+    ERROR("Could not create connection state for socket %d: %s",fd,s->c_str());
+    delete(s);
+    return NULL;
+  }
+  setBusyPoll(fd);
+  r=pickReactor(conn);
+  conn->setReactor(r->getIndex());
+  conn->setWatermarks(sendHighWatermark,sendLowWatermark);
+  if(corkBytes>0) {
+    conn->setCork(corkBytes);
+  }
+  if(zeroCopyBytes>0) {
+    conn->setZeroCopy(zeroCopyBytes);
+  }
+  r->addLoad(1);
+  pthread_mutex_lock(&connsMutex);
+  conns[fd]=conn;
+  pthread_mutex_unlock(&connsMutex);
+  // Aade la nueva conexin como fuente de sucesos
+  if(uring) {
+    // Only the reactor's own thread submits to its ring
+    if((armRecv(conn)<0)||(wakeURing(r)<0)) {
+      dropConn(fd);
+      return NULL;
+    }
+  } else if(r->getPoll()->add(fd, POLLIN | POLLHUP | POLLERR | POLLNVAL)<0) {
+    dropConn(fd);
+    return NULL;
+  }
+  DEBUG("Connection %d served by reactor %d",fd,r->getIndex());
+  return conn;
+}
+
+/// Asks the kernel to busy poll the device queue on socket reads, if configured
+void SMessenger::setBusyPoll(SocketType fd) {
+#ifdef SO_BUSY_POLL
+  if((busyPollUs>0)&&(setsockopt(fd,SOL_SOCKET,SO_BUSY_POLL,&busyPollUs,sizeof(busyPollUs))<0)) {
+    PERROR("Error setsockopt(SO_BUSY_POLL)");
+    WARN("Socket %d will not busy poll (needs CAP_NET_ADMIN over net.core.busy_read)",fd);
+  }
+#endif
+}
+
+/// Finds the state of a TCP connection
+SConn* SMessenger::findConn(SocketType fd) {
+  SConn* conn=NULL;
+  pthread_mutex_lock(&connsMutex);
+  ConnHash::iterator it=conns.find(fd);
+  if(it!=conns.end()) {
+    conn=it->second;
+  }
+  pthread_mutex_unlock(&connsMutex);
+  return conn;
+}
+
+/**
+  Finds the state of a TCP connection and holds it, so it is not freed
+  while it is used (release it with unref())
+*/
+SConn* SMessenger::holdConn(SocketType fd) {
+  SConn* conn=NULL;
+  pthread_mutex_lock(&connsMutex);
+  ConnHash::iterator it=conns.find(fd);
+  if(it!=conns.end()) {
+    conn=it->second;
+    conn->ref();
+  }
+  pthread_mutex_unlock(&connsMutex);
+  return conn;
+}
+
+/// Forgets and frees the state of a TCP connection
+void SMessenger::dropConn(SocketType fd) {
+  SConn* conn=NULL;
+  pthread_mutex_lock(&connsMutex);
+  ConnHash::iterator it=conns.find(fd);
+  if(it!=conns.end()) {
+    conn=it->second;
+    conns.erase(it);
+  }
+  pthread_mutex_unlock(&connsMutex);
+  if(conn!=NULL) {
+    reactors[conn->getReactor()]->addLoad(-1);
+    // Senders still holding it get no further than here (the socket is to be closed)
+    conn->lockOut();
+    conn->closeOut();
+    conn->unlockOut();
+    conn->unref();
+  }
+}
+
+/**
+  Reads what is available on a connection and parses all complete frames on it,
+  partial frames are kept on the connection buffer until the next read
+  @param r is the reactor serving the connection
+  @param conn is the TCP connection state
+  @return the number of messages parsed, or -1 on error or disconnection
+*/
+int SMessenger::readFrames(SReactor* r, SConn* conn) {
+  int res;
+  if((res=conn->fill())==SOCK_TIMEOUT) {
+    return 0;
+  } else if(res<=0) {
+    if(res==SOCK_DISCONN) {
+      DEBUG("Connection %d dropped",conn->getSocket());
     }
     return -1;
   }
-  memcpy(data,&buf[HDRLEN],datasize);
-  *len=datasize;  
-  from->sin_family=AF_INET;
-  from->sin_port=htons(head.port);
-  // TCP conn. addr info is empty, we have to refill it
-  if(from->sin_addr.s_addr==0) { 
-    from->sin_addr.s_addr=htonl(stcp_getIP(fd));
+  return parseFrames(r,conn);
+}
+
+/**
+  Parses all complete frames on a connection buffer
+  @param r is the reactor serving the connection
+  @param conn is the TCP connection state
+  @return the number of messages parsed, or -1 on a corrupted frame
+*/
+int SMessenger::parseFrames(SReactor* r, SConn* conn) {
+  int count=0;
+  int bytes=0;
+  while(conn->available()>=(int)HDRLEN) {
+    smsg_header head;
+    short msgtag;
+    unsigned short portFrom;
+    int datasize;
+    // Fair share used up, the rest waits for the next cycle
+    if(((quantumMsgs>0)&&(count>=quantumMsgs))||((quantumBytes>0)&&(bytes>=quantumBytes))) {
+      if(!conn->isBacklogged()) {
+        conn->setBacklogged(true);
+        r->addBacklog(conn->getSocket());
+      }
+      return count;
+    }
+    memcpy(&head,conn->data(),HDRLEN);
+    datasize=unpackhdr(&head,&msgtag,&portFrom);
+    if((datasize<0)||(datasize>MAX_DATALEN)) {
+      WARN("Bad frame length %d from socket %d",datasize,conn->getSocket());
+      return -1;
+    }
+    if(conn->available()<(int)(HDRLEN+datasize)) {
+      conn->expect(HDRLEN+datasize);
+      return count;
+    }
+    // Not subscribed, dropped before taking its body
+    if(!isWanted(msgtag)) {
+      conn->consume(HDRLEN+datasize);
+      bytes+=datasize;
+      continue;
+    }
+    SBufSlice body=conn->slice(HDRLEN,datasize);
+    conn->consume(HDRLEN+datasize);
+    DEBUG("Receive MSGTAG=%d from socket %d with %dbytes",msgtag,conn->getSocket(),datasize);
+    r->queue(new SMsg(msgtag, conn->getIP(), portFrom, conn->getSocket(), body));
+    bytes+=datasize;
+    count++;
+  }
+  return count;
+}
+
+/**
+  Parses one more quantum of frames on each connection left with complete
+  frames by the previous cycle, in the order they used up their quantum
+  @param r is the reactor to serve
+  @return the number of messages parsed
+*/
+int SMessenger::serviceBacklog(SReactor* r) {
+  int pending=r->getBacklog();
+  int count=0;
+  int res;
+  while(pending-->0) {
+    SocketType sock=r->popBacklog();
+    SConn* conn=holdConn(sock);
+    if(conn==NULL) { // gone
+      continue;
+    }
+    if(!conn->isBacklogged()) { // socket reused
+      conn->unref();
+      continue;
+    }
+    conn->setBacklogged(false);
+    if((res=parseFrames(r,conn))<0) {
+      socketErrorHandling(sock);
+      r->queue(new SMsg(ERRCODE_PEER_DISCONNECTED, 0, 0, sock));
+    } else {
+      count+=res;
+    }
+    conn->unref();
   }
-  return datasize+HDRLEN;
+  return count;
 }
 
-/// On socket error, drop it and, if it is the multicast one, reget it
+/**
+  Sets the fair share of a connection on each receive cycle, the frames
+  over it wait for the next cycle so other connections get served
+  @param msgs is the maximum messages per connection and cycle (0 unlimited)
+  @param bytes is the maximum bytes per connection and cycle (0 unlimited,
+    a message is always let through)
+*/
+void SMessenger::setQuantum(int msgs, int bytes) {
+  quantumMsgs=msgs;
+  quantumBytes=bytes;
+}
+
+/**
+  On socket error, drop it and, if it is the multicast or the server one, reget it;
+  only the reactor serving the socket calls it (see disconnect() for other threads)
+*/
 int SMessenger::socketErrorHandling(SocketType fd) {
   if(fd==mcsock) {
+    reactors[0]->getPoll()->remove(fd);
     close(fd);
     initMCast();
+  } else if(fd==servsock) {
+    ERROR("Server socket error detected");
+    reactors[0]->getPoll()->remove(fd);
+    close(fd);
+    initServer();
   } else {
-    spoll.remove(fd);
+    SConn* conn=findConn(fd);
+    SReactor* r=reactors[(conn!=NULL)?conn->getReactor():0];
+    if(uring) {
+      cancelURing(r,fd);
+    } else {
+      r->getPoll()->remove(fd);
+    }
+    dropConn(fd);
     close(fd);
   }
   return 0;
 }
 
+/// Prepares the multicast receive buffers
+int SMessenger::initMCastBatch() {
+  int i;
+  for(i=0;i<MCAST_BATCH;i++) {
+    RET_ON_FALSE(((mcbufs[i]=SBufPool::alloc(MAX_DGRAMLEN))!=NULL));
+  }
+#ifdef __linux__
+  bzero(mcvec,sizeof(mcvec));
+  for(i=0;i<MCAST_BATCH;i++) {
+    mciov[i].iov_base=mcbufs[i]->data();
+    mciov[i].iov_len=MAX_DGRAMLEN;
+    mcvec[i].msg_hdr.msg_iov=&mciov[i];
+    mcvec[i].msg_hdr.msg_iovlen=1;
+    mcvec[i].msg_hdr.msg_name=&mcfrom[i];
+  }
+#endif
+  return 0;
+}
+
+/**
+  Validates a multicast datagram and queues its message
+  @param r is the reactor serving the multicast socket
+  @param fd is the multicast socket
+  @param dgram is the datagram, header included
+  @param from is the sender address
+  @return 1 if a message was queued, 0 if the datagram was dropped
+*/
+int SMessenger::parseDatagram(SReactor* r, SocketType fd, SBufSlice& dgram, struct sockaddr_in* from) {
+  smsg_header head;
+  short msgtag;
+  unsigned short portFrom;
+  int datasize;
+  int len=dgram.size();
+  if(len<(int)HDRLEN) {
+    WARN("Message dropped! (%d bytes datagram)",len);
+    return 0;
+  }
+  if(isFragment(dgram.data(),len)) {
+    return takeFragment(r,fd,dgram.data(),len,from);
+  }
+  memcpy(&head,dgram.data(),HDRLEN);
+  datasize=unpackhdr(&head,&msgtag,&portFrom);
+  // A datagram carries exactly one whole frame
+  if(datasize!=(int)(len-HDRLEN)) {
+    WARN("Message dropped!");
+    return 0;
+  }
+  SBufSlice body=dgram.sub(HDRLEN,datasize);
+  DEBUG("Receive MSGTAG=%d from socket %d with %dbytes",msgtag,fd,datasize);
+  r->queue(new SMsg(msgtag, sockaddr_getIP(from), portFrom, fd, body));
+  return 1;
+}
+
+/**
+  Takes a datagram received on a multicast buffer and queues its message;
+  big datagrams keep the receive buffer (a new one takes its place),
+  small ones are copied so they do not hold MAX_DGRAMLEN bytes each
+  @param r is the reactor serving the multicast socket
+  @param fd is the multicast socket
+  @param i is the multicast buffer index
+  @param len is the datagram length
+  @param from is the sender address
+  @return 1 if a message was queued, 0 if the datagram was dropped
+*/
+int SMessenger::takeDatagram(SReactor* r, SocketType fd, int i, int len, struct sockaddr_in* from) {
+  SBufSlice dgram;
+  SBuf* fresh;
+  // Fragments are copied to their message reassembly buffer
+  if(isFragment(mcbufs[i]->data(),len)) {
+    return takeFragment(r,fd,mcbufs[i]->data(),len,from);
+  }
+  // Not subscribed, dropped before copying it
+  if(!isWantedDatagram(mcbufs[i]->data(),len)) {
+    return 0;
+  }
+  if((len>=MCAST_HANDOVER)&&((fresh=SBufPool::alloc(MAX_DGRAMLEN))!=NULL)) {
+    dgram=SBufSlice(mcbufs[i],0,len);
+    mcbufs[i]->unref();
+    mcbufs[i]=fresh;
+#ifdef __linux__
+    mciov[i].iov_base=fresh->data();
+#endif
+  } else if(dgram.copy(mcbufs[i]->data(),len)<0) {
+    return 0;
+  }
+  return parseDatagram(r,fd,dgram,from);
+}
+
+/**
+  Reads a batch of datagrams from the multicast socket into the parsed messages queue
+  @param r is the reactor serving the multicast socket
+  @param fd is the multicast socket
+  @return the number of datagrams read or -1 on error
+*/
+int SMessenger::readMCast(SReactor* r, SocketType fd) {
+#ifdef __linux__
+  int i;
+  int n;
+  for(i=0;i<MCAST_BATCH;i++) {
+    mcvec[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+    mcvec[i].msg_hdr.msg_flags=0;
+  }
+  if((n=recvmmsg(fd,mcvec,MCAST_BATCH,MSG_DONTWAIT,NULL))<0) {
+    if((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)) {
+      return 0;
+    }
+    PERROR("Error recvmmsg()");
+    return -1;
+  }
+  for(i=0;i<n;i++) {
+    if(mcvec[i].msg_hdr.msg_flags&MSG_TRUNC) {
+      WARN("Message dropped! (datagram truncated)");
+      continue;
+    }
+    takeDatagram(r,fd,i,mcvec[i].msg_len,&mcfrom[i]);
+  }
+  return n;
+#else
+  int res;
+  struct sockaddr_in from;
+  int addrlen=sizeof(struct sockaddr_in);
+  if((res=recvfrom(fd,mcbufs[0]->data(),MAX_DGRAMLEN,0,(struct sockaddr*)&from,(socklen_t*)&addrlen))<0) {
+    if((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)) {
+      return 0;
+    }
+    PERROR("Error recvfrom()");
+    return -1;
+  }
+  takeDatagram(r,fd,0,res,&from);
+  return 1;
+#endif
+}
+
+/**
+  Polls once and drains every socket found ready, all complete messages
+  (and disconnection notices) go to the reactor's parsed messages queue
+  @param r is the reactor to poll
+  @param timeout is the maximum time to wait for the sockets
+  @return the number of ready sockets, 0 on timeout or -1 on error
+*/
+int SMessenger::pollReady(SReactor* r, int timeout) {
+  int i;
+  int k;
+  int first;
+  int size;
+  int ready;
+  struct pollfd* fds;
+  deque<SocketType> broken;
+  bool serverBroken=false;
+  if((ready=r->getPoll()->doPoll(timeout))<=0) {
+    return ready;
+  }
+  RET_ON_ERROR((size=r->getPoll()->getpolls(&fds)));
+  // Each cycle starts on a different socket, so none is always served first
+  first=(size>0)?(int)(r->nextRotation()%size):0;
+  for(k=0;k<size;k++) {
+    i=(first+k)%size;
+    if((fds[i].fd==0)||(fds[i].revents==0)) {
+      continue;
+    }
+    // Incoming connections, the whole backlog at once
+    if(fds[i].fd==servsock) {
+      if((fds[i].revents&POLLHUP)||(fds[i].revents&POLLERR)||(fds[i].revents&POLLNVAL)) {
+        serverBroken=true;
+      } else if(fds[i].revents&POLLIN) {
+        acceptConn(servsock);
+      }
+      continue;
+    }
+    // Zero-copy completions are reported as a socket error
+    if(((fds[i].revents&(POLLERR|POLLHUP|POLLNVAL))==POLLERR)&&(fds[i].fd!=mcsock)&&
+       (reapZeroCopy(fds[i].fd)>0)) {
+      fds[i].revents&=~POLLERR;
+      if(fds[i].revents==0) {
+        continue;
+      }
+    }
+    // Problems?
+    if((fds[i].revents&POLLHUP)||(fds[i].revents&POLLERR)||(fds[i].revents&POLLNVAL)) {
+      ERROR("Socket %d error %d (HUP=%d ERR=%d NVAL=%d) detected"
+       ,fds[i].fd,fds[i].revents,POLLHUP,POLLERR,POLLNVAL);
+      broken.push_back(fds[i].fd);
+    } else if(fds[i].fd==mcsock) {
+      if((fds[i].revents&POLLIN)&&(readMCast(r,fds[i].fd)<0)) {
+        DEBUG("Data socket %d error: removing from spoll",fds[i].fd);
+        broken.push_back(fds[i].fd);
+      }
+    } else {
+      SConn* conn=holdConn(fds[i].fd);
+      bool failed=(conn==NULL);
+      // Room for the outbound queue?
+      if(!failed&&(fds[i].revents&POLLOUT)&&(flushConn(r,conn)<0)) {
+        failed=true;
+      }
+      // Data? (a backlogged one is not read until its backlog is served)
+      if(!failed&&(fds[i].revents&POLLIN)&&!conn->isBacklogged()&&(readFrames(r,conn)<0)) {
+        failed=true;
+      }
+      if(failed) {
+        DEBUG("Data socket %d error: removing from spoll",fds[i].fd);
+        broken.push_back(fds[i].fd);
+      }
+      if(conn!=NULL) {
+        conn->unref();
+      }
+    }
+  }
+  // Broken sockets are dropped once the ready list is not used any more
+  while(!broken.empty()) {
+    SocketType sock=broken.front();
+    broken.pop_front();
+    socketErrorHandling(sock);
+    r->queue(new SMsg(ERRCODE_PEER_DISCONNECTED, 0, 0, sock));
+  }
+  if(serverBroken) {
+    socketErrorHandling(servsock);
+  }
+  return ready;
+}
+
 /**
   Receives a message, blocking for it the specified time
   @param timeout is the maximum time to wait for a message
   @return the message received with header information included, an Error SMsg on error or NULL on timeout
 */
 SMsg* SMessenger::recv(int timeout) {
-  RET_NULL_ON_ERROR(this->listenConn());
+  SMsg* msg;
+  if(recvBatch(&msg,1,timeout)<=0) {
+    return NULL;
+  }
+  return msg;
+}
+
+/**
+  Receives all messages already available, blocking for the first one the specified time
+  (with several reactors, this serves only the first one)
+  @param out is where to leave the messages received
+  @param max is the maximum number of messages to return
+  @param timeout is the maximum time to wait for a message
+  @return the number of messages left on out, 0 on timeout or -1 on error
+*/
+int SMessenger::recvBatch(SMsg** out, int max, int timeout) {
+  return recvBatch(0,out,max,timeout);
+}
+
+/**
+  Receives all messages already available on a reactor, blocking for the first one
+  the specified time; each reactor must be served by a single thread
+  @param reactor is the reactor number (0 to getReactorCount()-1)
+  @param out is where to leave the messages received
+  @param max is the maximum number of messages to return
+  @param timeout is the maximum time to wait for a message
+  @return the number of messages left on out, 0 on timeout or -1 on error
+*/
+int SMessenger::recvBatch(int reactor, SMsg** out, int max, int timeout) {
   long long int limit=timing_current_millis()+timeout;
-  while((spoll.doPoll(timeout)>0)&&(timing_current_millis()<limit)) {
-    int i;
-    int size;
-    struct pollfd* fds;
-    RET_NULL_ON_ERROR((size=spoll.getpolls(&fds)));
-    for(i=0;i<size;i++) {
-      if((fds[i].fd!=0)&&(fds[i].revents!=0)) {
-        // Problems?
-	if((fds[i].revents&POLLHUP)||(fds[i].revents&POLLERR)||(fds[i].revents&POLLNVAL)) {
-	  int sock=fds[i].fd;
-          ERROR("Socket %d error %d (HUP=%d ERR=%d NVAL=%d) detected"
-	   ,fds[i].fd,fds[i].revents,POLLHUP,POLLERR,POLLNVAL);
-	  socketErrorHandling(fds[i].fd);
-	  return new SMsg(ERRCODE_PEER_DISCONNECTED, 0, 0, sock);
-        }
-	// Data?
-	if(fds[i].revents&POLLIN) {
-	  int res;
-	  struct sockaddr_in from;
-	  short msgtag=0;
-	  int len=MAX_DATALEN;
-	  char *data=(char*)alloca(MAX_DATALEN);
-	  if((res=nextMsg(fds[i].fd,&msgtag,data,&len,&from))<0) {
-            int sock=fds[i].fd;
-            DEBUG("Data socket %d error: removing from spoll",fds[i].fd);
-            socketErrorHandling(fds[i].fd);
-	    return new SMsg(ERRCODE_PEER_DISCONNECTED, 0, 0, sock);
-          } else if(res>0) {
-	    string msg="";
-	    msg.assign(data,len);
-	    SocketType socket2peer=fds[i].fd;
-	    if(socket2peer>0) {
-              int ip=sockaddr_getIP(&from);
-	      unsigned short port=sockaddr_getPort(&from);
-              DEBUG("Receive MSGTAG=%d from socket %d with %dbytes",msgtag, socket2peer, msg.size());
-	      return new SMsg(msgtag, ip, port, socket2peer, msg);
-	    }
-	  }
-        }
-      }
+  int left=timeout;
+  int n=0;
+  SMsg* msg;
+  SReactor* r;
+  if((reactor<0)||(reactor>=nreactors)) {
+    ERROR("No reactor %d (%d reactors)",reactor,nreactors);
+    return -1;
+  }
+  r=reactors[reactor];
+  // Frames parsed on a previous read go first, otherwise every ready socket is drained
+  while(!r->hasParsed()) {
+    // Connections with complete frames left over do not wait for the network
+    int wait=(r->getBacklog()==0)?left:0;
+    if(uring) {
+      RET_ON_ERROR(waitURing(r,wait));
+    } else {
+      RET_ON_ERROR(pollReady(r,wait));
+    }
+    serviceBacklog(r);
+    if((left=(int)(limit-timing_current_millis()))<=0) {
+      break;
     }
   }
-  return NULL;
+  while((n<max)&&((msg=r->next())!=NULL)) {
+    out[n++]=msg;
+  }
+  return n;
 }
-
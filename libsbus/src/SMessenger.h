@@ -25,14 +25,21 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <deque>
 #include <string>
 #include <iostream>
 
 using namespace std;
 
+#include <hashdefs.h>
+#include <sbusdefs.h>
 #include <stcp.h>
 #include <SMsg.h>
-#include <SPoll.h>
+#include <SConn.h>
+#include <SReactor.h>
 
 /// Maximun message body length in bytes (1MB)
 #define MAX_DATALEN 1*1024*1024
@@ -47,16 +54,103 @@ typedef struct smsg_header {
   int length;
 } smsg_header;
 
+/// Header lenght
+#define HDRLEN sizeof(smsg_header)
+
+/// Maximum body fragments on a scatter-gather send
+#define MAX_SEND_IOV 64
+
+/// Biggest multicast datagram (header included)
+#define MAX_DGRAMLEN 65536
+/// Multicast datagrams pulled per recvmmsg()
+#define MCAST_BATCH 16
+
+/// Message code of the multicast fragments (reassembled, never handed up)
+#define FRAGMENT_TAG -6
+
+/// Multicast fragment header, after the message header
+typedef struct sfrag_header {
+  /// Fragmented message id, unique per sender
+  unsigned int msgid;
+  /// Fragmented message code
+  short msgtag;
+  /// Fragment index
+  unsigned short index;
+  /// Number of fragments
+  unsigned short count;
+  /// Unused
+  unsigned short reserved;
+  /// Fragmented message length
+  int length;
+  /// Fragment bytes offset on the message
+  int offset;
+} sfrag_header;
+
+/// Fragment header length
+#define FRAGHDRLEN sizeof(sfrag_header)
+
+/// Words of the message code subscription bitmap, a bit per code
+#define TAG_FILTER_WORDS (32768/32)
+
+/// Time (ms) a multicast send waits for room on a full socket buffer
+#define MCAST_ROOM_MS 1000
+
+/// Multicast messages reassembled at once, the oldest one is dropped for a new one
+#define MCAST_REASSEMBLY_SLOTS 64
+/// Time (ms) a multicast message waits for its missing fragments
+#define MCAST_REASSEMBLY_MS 1000
+
 #define ERRCODE_PEER_DISCONNECTED -1
 
+struct io_uring_cqe;
+
 namespace simple {
 
+class SURing;
+
+typedef hash_map<SocketType,SConn*> ConnHash;
+
+/// A multicast message being reassembled from its fragments
+typedef struct SFragMsg {
+  /// Sender IP
+  int ip;
+  /// Sender port
+  unsigned short port;
+  /// Message id
+  unsigned int msgid;
+  /// Message code
+  short msgtag;
+  /// Message length
+  int length;
+  /// Number of fragments
+  int count;
+  /// Fragments received
+  int received;
+  /// Received flag per fragment
+  unsigned char* got;
+  /// Reassembly buffer (NULL for a free slot)
+  SBuf* buf;
+  /// When the missing fragments are given up (us)
+  long long int deadline;
+} SFragMsg;
+
+/// A connection holding back outbound bytes
+typedef struct SCorked {
+  /// The connection (a reference is held)
+  SConn* conn;
+  /// When its bytes have to go out
+  long long int deadline;
+} SCorked;
+
 class SMessenger {
   private:
 	/// Packs a message for sending
  static int packhdr(smsg_header* hdr, short msgtag, unsigned short port, int bytes);
 	/// Unpacks a received message
  static int unpackhdr(smsg_header* hdr, short* pmsgtag, unsigned short* pport);
+	/// Packs a message header and lays it before the body fragments
+	static int packv(struct iovec* vec, smsg_header* hdr, short msgtag, unsigned short port,
+	  const struct iovec* iov, int iovcnt);
 	/// Local service access point
 	struct sockaddr sap;
 	/// Multicast IP
@@ -73,19 +167,195 @@ class SMessenger {
 	SocketType mcsock;
 	/// IP local de escucha
 	int ip;
-	/// Vigilancia de conexiones entrantes y salientes
-	SPoll spoll;
+	/// Receive reactors, the first one also serves the server and multicast sockets
+	SReactor* reactors[SBUS_MAX_REACTORS];
+	/// Number of receive reactors
+	int nreactors;
+	/// How connections are spread over the reactors
+	int reactorPolicy;
+	/// TCP connections state, indexed by socket
+	ConnHash conns;
+	/// TCP connections table mutex (connect() runs on the sender's thread)
+	pthread_mutex_t connsMutex;
+	/// Maximum messages parsed per connection and cycle (0 unlimited)
+	int quantumMsgs;
+	/// Maximum bytes parsed per connection and cycle (0 unlimited)
+	int quantumBytes;
+	/// SO_BUSY_POLL time (us) for the sockets (0 off)
+	int busyPollUs;
+	/// TCP server listen backlog (0 for the stcp default)
+	int listenBacklog;
+	/// Outbound queue size per connection that refuses new frames (0 unlimited)
+	int sendHighWatermark;
+	/// Outbound queue size per connection that accepts new frames again
+	int sendLowWatermark;
+	/// io_uring engine is used (each reactor has its own receive ring)
+	bool uring;
+	/// io_uring ring for multicast sends, senders run on the application threads
+	SURing* sendRing;
+	/// Send ring mutex
+	pthread_mutex_t sendMutex;
+	/// Message codes received, a bit per code (system codes always are)
+	unsigned int tagFilter[TAG_FILTER_WORDS];
+	/// Only the subscribed message codes are received (else all but the unsubscribed ones)
+	bool filtering;
+	/// Subscriptions mutex (receivers read the bitmap as it is)
+	pthread_mutex_t filterMutex;
+	/// Multishot recvmsg() setup for the multicast socket
+	struct msghdr mcmsg;
+	/// Multicast receive buffers, MAX_DGRAMLEN bytes each
+	SBuf* mcbufs[MCAST_BATCH];
+	/// Multicast destination address
+	struct sockaddr_in mcaddr;
+	/// Multicast publishes coalescing window (us, 0 off)
+	int mcastBatchUs;
+	/// Multicast frames waiting for the coalescing window to close
+	SBuf* mcout[SBUS_MCAST_SEND_BATCH];
+	/// Multicast frames waiting lengths
+	int mcoutLen[SBUS_MCAST_SEND_BATCH];
+	/// Multicast frames waiting
+	int mcoutCount;
+	/// When the coalescing window of the frames waiting closes
+	long long int mcoutDeadline;
+	/// Biggest multicast datagram sent, bigger messages go in fragments (0 never fragmented)
+	int mcastDatagramBytes;
+	/// Last fragmented multicast message id given
+	unsigned int lastFragMsg;
+	/// Multicast messages being reassembled (multicast receiving thread only)
+	SFragMsg frags[MCAST_REASSEMBLY_SLOTS];
+	/// Unicast frames from this size on, with a body the library can hold, go with MSG_ZEROCOPY (0 off)
+	int zeroCopyBytes;
+	/// Outbound bytes per connection held back to go out together (0 off)
+	int corkBytes;
+	/// Longest time (us) outbound bytes are held back (0 until flushed)
+	int corkUs;
+	/// Connections holding back bytes, in the order their deadlines expire
+	deque<SCorked> corked;
+	/// Multicast frames waiting and corked connections mutex
+	pthread_mutex_t flushMutex;
+	/// Signals the flusher thread a coalescing window was opened (or the shutdown)
+	pthread_cond_t flushCond;
+	/// Flusher thread, closes the coalescing windows and corks nobody else closes
+	pthread_t flusher;
+	/// Flusher thread life's flag
+	bool flusherAlive;
+#ifdef __linux__
+	/// Multicast recvmmsg() headers
+	struct mmsghdr mcvec[MCAST_BATCH];
+	/// Multicast recvmmsg() data vectors
+	struct iovec mciov[MCAST_BATCH];
+	/// Multicast recvmmsg() senders
+	struct sockaddr_in mcfrom[MCAST_BATCH];
+#endif
 	/// Inits the TCP server socket for unicast messaging
 	int initServer();
 	/// Inits the UDP Multicast server socket for multicast messaging
 	int initMCast();
-	/// Accepts a TCP connection
+	/// Accepts every TCP connection waiting on the server socket
 	int acceptConn(SocketType servsock);
-	/// Listen incomming connections
-	int listenConn();
-	/// Tries to get the next message in full from a socket
-	int nextMsg(int fd, short* pmsgtag, char* data, int *len, struct sockaddr_in* from);
-	/// On socket error, drop it and, if it is the multicast one, reget it
+	/// Picks the reactor for a new TCP connection
+	SReactor* pickReactor(SConn* conn);
+	/// Registers the state for a new TCP connection and starts receiving on it
+	SConn* addConn(SocketType fd);
+	/// Finds the state of a TCP connection
+	SConn* findConn(SocketType fd);
+	/// Finds the state of a TCP connection and holds it (release it with unref())
+	SConn* holdConn(SocketType fd);
+	/// Forgets and frees the state of a TCP connection
+	void dropConn(SocketType fd);
+	/// Asks the kernel to busy poll the device queue on socket reads, if configured
+	void setBusyPoll(SocketType fd);
+	/// Reads what is available on a connection and parses all complete frames on it
+	int readFrames(SReactor* r, SConn* conn);
+	/// Parses all complete frames on a connection buffer
+	int parseFrames(SReactor* r, SConn* conn);
+	/// Sends as much of a connection's outbound queue as its socket takes
+	int flushConn(SReactor* r, SConn* conn);
+	/// Parses one more quantum of frames on each backlogged connection
+	int serviceBacklog(SReactor* r);
+	/// Starts the io_uring engine
+	int initURing();
+	/// Arms a multishot accept on the TCP server socket
+	int armAccept();
+	/// Arms a multishot recvmsg on the multicast socket
+	int armMCast();
+	/// Arms a multishot recv on a TCP connection
+	int armRecv(SConn* conn);
+	/// Arms a one shot poll for room on a TCP connection
+	int armSend(SConn* conn);
+	/// Arms a one shot poll for zero-copy completions on a TCP connection
+	int armZeroCopy(SConn* conn);
+	/// Cancels the io_uring operations on a socket (before closing it)
+	int cancelURing(SReactor* r, SocketType fd);
+	/// Arms a multishot poll on a reactor's wakeup eventfd
+	int armWake(SReactor* r);
+	/// Wakes up a receiving thread, so it submits the entries queued by other threads
+	int wakeURing(SReactor* r);
+	/// Processes an io_uring completion
+	int handleCqe(SReactor* r, struct io_uring_cqe* cqe);
+	/// Waits once for io_uring completions and processes all of them
+	int waitURing(SReactor* r, int timeout);
+	/// Sends a packed frame on a peer connection, or queues it for the reactor
+	int sendFrame(int msgtag, SocketType socket2peer, struct iovec* vec, int veccnt,
+	  int total2send, SBuf* head, SBuf* body, SSend* done);
+	/// Reads the zero-copy completions reported as an error on a peer connection
+	int reapZeroCopy(SocketType fd);
+	/// Sends a multicast datagram with the io_uring engine
+	int sendURing(SocketType fd, struct iovec* vec, int veccnt, int total2send,
+	  struct sockaddr_in* to);
+	/// Prepares the multicast receive buffers
+	int initMCastBatch();
+	/// Validates a multicast datagram and queues its message
+	int parseDatagram(SReactor* r, SocketType fd, SBufSlice& dgram, struct sockaddr_in* from);
+	/// Takes a datagram received on a multicast buffer and queues its message
+	int takeDatagram(SReactor* r, SocketType fd, int i, int len, struct sockaddr_in* from);
+	/// Reads a batch of datagrams from the multicast socket into the parsed messages queue
+	int readMCast(SReactor* r, SocketType fd);
+	/// Starts the multicast publishes coalescing and the corks deadlines
+	int initFlusher();
+	/// Stops the multicast publishes coalescing and the corks, sending what is waiting
+	void closeFlusher();
+	/// Sends up to SBUS_MCAST_SEND_BATCH multicast frames (two fragments each) on a single sendmmsg()
+	int sendFrames(struct iovec* vec, int n);
+	/// Waits for room on the multicast socket buffer
+	int waitMCastRoom();
+	/// Copies a multicast frame to the coalescing window, sending it if full
+	int queueMCast(const struct iovec* vec, int veccnt, int total2send);
+	/// Sets up the multicast fragmentation and the reassembly table
+	void initFragments(SBusOptions* options);
+	/// Drops the multicast messages being reassembled
+	void closeFragments();
+	/// Tells if a multicast message body goes in fragments
+	bool isFragmented(int bytes);
+	/// Sends a multicast message in fragments (flushMutex held)
+	int sendFragmentsLocked(int msgtag, const struct iovec* iov, int iovcnt, int bytes);
+	/// Sends a multicast message in fragments
+	int sendFragments(int msgtag, const struct iovec* iov, int iovcnt, int bytes);
+	/// Tells if a datagram is a multicast fragment
+	static bool isFragment(const char* dgram, int len);
+	/// Tells if a datagram is worth taking, a fragment or a message with a code received
+	bool isWantedDatagram(const char* dgram, int len);
+	/// Takes a multicast fragment, queueing its message once complete
+	int takeFragment(SReactor* r, SocketType fd, const char* dgram, int len, struct sockaddr_in* from);
+	/// Frees a reassembly table slot
+	void dropFragMsg(SFragMsg* fmsg);
+	/// Sends the frames on the coalescing window (flushMutex held)
+	int flushMCastLocked();
+	/// Has the poller watch for room on a connection's socket (outbound queue locked)
+	int armOut(SConn* conn);
+	/// Sends a connection's outbound queue, or has the poller do it (outbound queue locked)
+	int flushOut(SConn* conn);
+	/// Puts a connection that started holding back bytes on the corked list
+	void corkConn(SConn* conn);
+	/// Sends what a connection taken from the corked list holds back
+	int uncorkConn(SConn* conn);
+	/// Flusher thread loop
+	void flusherLoop();
+	/// Flusher thread entry point
+	static void* flusherStart(void* arg);
+	/// Polls once and drains every socket found ready
+	int pollReady(SReactor* r, int timeout);
+	/// On socket error, drop it and, if it is the multicast or the server one, reget it (reactor thread only)
 	int socketErrorHandling(SocketType fd);
   public:
 	/**
@@ -93,8 +363,9 @@ class SMessenger {
 	  @param device is the device of the network interface to bind this SMessenger
 	  @param mcip is the Multicast IP to bind to
 	  @param port for multicast binding
+	  @param options are the SBus creation options (engine...)
 	*/
-	SMessenger(const char* device, const char* mcip, int port);
+	SMessenger(const char* device, const char* mcip, int port, SBusOptions* options);
 	/// Cierra y libera los recursos un enlace SBUS
 	~SMessenger();
 	/// Returns multicast socket being used
@@ -112,38 +383,159 @@ class SMessenger {
 	  @return the connected socket, or -1 on error
 	*/
 	SocketType connect(int ip, unsigned short port);
+	/**
+	  Closes a point to point connection made with connect(), from any thread
+	  (its reactor drops and closes it)
+	  @param socket2peer is the connection to close
+	*/
+	void disconnect(SocketType socket2peer);
 	/**
 	  Sends a messange header with no data over multicast
 	  @param msgtag is the message tag/code to be sent within the header
-	  @return 0 on success or -1 in case of an error (message was not sent)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the coalescing window) or -1 in case of an error (message was not sent)
 	*/
 	int send(int msgtag);
 	/**
 	  Sends a message over multicast
 	  @param msgtag is the message tag/code to be sent within the header
 	  @param msg is the data or body of the message
-	  @return 0 on success or -1 in case of an error (message was not sent)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the coalescing window) or -1 in case of an error (message was not sent)
 	*/
 	int send(int msgtag, string& msg);
+	/**
+	  Sends a message over multicast, its body gathered from several fragments
+	  @param msgtag is the message tag/code to be sent within the header
+	  @param iov are the body fragments
+	  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the coalescing window) or -1 in case of an error (message was not sent)
+	*/
+	int send(int msgtag, const struct iovec* iov, int iovcnt);
+	/**
+	  Sends several messages over multicast with a single sendmmsg() per
+	  SBUS_MCAST_SEND_BATCH messages, in order
+	  @param msgs are the messages to send
+	  @param n is the number of messages
+	  @return the number of messages sent (the first ones), or -1 if none could be sent
+	*/
+	int sendBatch(const SBusBatchMsg* msgs, int n);
+	/**
+	  Sends right away the multicast messages waiting on the coalescing window
+	  and the messages held back by every corked connection
+	  @return 0 on success or -1 in case of an error (messages were lost)
+	*/
+	int flush();
+	/**
+	  Sends right away the messages held back by a corked connection
+	  @param socket2peer is the connection to the peer
+	  @return SBUS_SENT, SBUS_QUEUED (waits for room on the socket) or -1 on error
+	*/
+	int flush(SocketType socket2peer);
 	/**
 	  Sends an unicast messange header with no data to a single peer
 	  @param msgtag is the message tag/code to be sent within the header
-	  @return 0 on success or -1 in case of an error (message was not sent)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
 	*/
 	int send(int msgtag, SocketType socket2peer);
 	/**
 	  Sends an unicast message to a peer
 	  @param msgtag is the message tag/code to be sent within the header
 	  @param msg is the data or body of the message
-	  @return 0 on success or -1 in case of an error (message was not sent)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
 	*/
 	int send(int msgtag, SocketType socket2peer, string& msg);
+	/**
+	  Sends an unicast message to a peer, its body gathered from several fragments
+	  (header and fragments go out with a single sendmsg(), no copies)
+	  @param msgtag is the message tag/code to be sent within the header
+	  @param socket2peer is the connection to the peer
+	  @param iov are the body fragments
+	  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
+	*/
+	int send(int msgtag, SocketType socket2peer, const struct iovec* iov, int iovcnt);
+	/**
+	  Sends an unicast message to a peer, its body gathered from several fragments,
+	  and completes an asynchronous send once the message is written
+	  @param msgtag is the message tag/code to be sent within the header
+	  @param socket2peer is the connection to the peer
+	  @param iov are the body fragments
+	  @param iovcnt is the number of fragments (up to MAX_SEND_IOV)
+	  @param done is the asynchronous send to complete (or NULL)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue, done completes later)
+	    or -1 in case of an error (message was not sent)
+	*/
+	int send(int msgtag, SocketType socket2peer, const struct iovec* iov, int iovcnt, SSend* done);
+	/**
+	  Sends an unicast message to a peer, its body kept on a buffer the library
+	  can hold, so from SBusOptions.zeroCopyBytes on it is sent with MSG_ZEROCOPY
+	  (the buffer is referenced until the kernel is done reading it)
+	  @param msgtag is the message tag/code to be sent within the header
+	  @param socket2peer is the connection to the peer
+	  @param body is the body of the message
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
+	*/
+	int send(int msgtag, SocketType socket2peer, SBufSlice& body);
+	/**
+	  Sends an unicast message to a peer, its body a region of a regular file
+	  that goes from the page cache to the socket (sendfile()), never through
+	  user space (the file can be closed or changed on return, not truncated)
+	  @param msgtag is the message tag/code to be sent within the header
+	  @param socket2peer is the connection to the peer
+	  @param fd is the file holding the body
+	  @param offset is the body start on the file
+	  @param length is the body length (up to MAX_DATALEN)
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 in case of an error (message was not sent)
+	*/
+	int sendFile(int msgtag, SocketType socket2peer, int fd, off_t offset, int length);
 	/**
 	  Receives a message, blocking for it the specified time
 	  @param timeout is the maximum time to wait for a message
 	  @return the message recived with header information included or NULL on timeout
 	*/
 	SMsg* recv(int timeout);
+	/**
+	  Receives all messages already available, blocking for the first one the specified time
+	  @param out is where to leave the messages received
+	  @param max is the maximum number of messages to return
+	  @param timeout is the maximum time to wait for a message
+	  @return the number of messages left on out, 0 on timeout or -1 on error
+	*/
+	int recvBatch(SMsg** out, int max, int timeout);
+	/**
+	  Receives all messages already available on a reactor, blocking for the first one
+	  the specified time; each reactor must be served by a single thread
+	  @param reactor is the reactor number (0 to getReactorCount()-1)
+	  @param out is where to leave the messages received
+	  @param max is the maximum number of messages to return
+	  @param timeout is the maximum time to wait for a message
+	  @return the number of messages left on out, 0 on timeout or -1 on error
+	*/
+	int recvBatch(int reactor, SMsg** out, int max, int timeout);
+	/// Returns the number of receive reactors
+	int getReactorCount();
+	/**
+	  Receives messages with this code: from the first subscription on, only
+	  the subscribed codes (and the system ones) are received, the rest are
+	  dropped as soon as their header is read
+	  @param msgtag is the message code (1 to 32767)
+	*/
+	void subscribe(int msgtag);
+	/**
+	  Stops receiving messages with this code, they are dropped as soon as
+	  their header is read
+	  @param msgtag is the message code (1 to 32767)
+	*/
+	void unsubscribe(int msgtag);
+	/// Tells if messages with this code are received
+	bool isWanted(short msgtag);
+	/**
+	  Sets the fair share of a connection on each receive cycle, the frames
+	  over it wait for the next cycle so other connections get served
+	  @param msgs is the maximum messages per connection and cycle (0 unlimited)
+	  @param bytes is the maximum bytes per connection and cycle (0 unlimited,
+	    a message is always let through)
+	*/
+	void setQuantum(int msgs, int bytes);
 };
 
 }
@@ -0,0 +1,393 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SMessengerBatch.cpp
+    @brief SMessenger send batching
+
+  Several multicast frames go out on a single sendmmsg(), either handed over
+  together (sendBatch()) or coalesced from the publishes issued within a short
+  window (SBusOptions.mcastBatchUs). The window is closed by the publish that
+  fills it, by flush() or, if nobody else does, by a flusher thread.
+  Likewise, corked peer connections (SBusOptions.corkBytes) hold back small
+  frames until they fill the cork, flush() is called or corkUs expire.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <string>
+#include <iostream>
+#include <SMessenger.h>
+
+#include <sockaddr.h>
+#include <timing.h>
+#include <SBufPool.h>
+
+using namespace std;
+using namespace simple;
+
+/// Starts the multicast publishes coalescing and the corks deadlines
+int SMessenger::initFlusher() {
+  pthread_condattr_t attr;
+  sockaddr_set(&mcaddr,mcip,mcport);
+  bzero(mcout,sizeof(mcout));
+  mcoutCount=0;
+  mcoutDeadline=0;
+  flusherAlive=false;
+  pthread_mutex_init(&flushMutex, NULL);
+  // Deadlines are taken from the monotonic clock, so is the wait
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&flushCond, &attr);
+  pthread_condattr_destroy(&attr);
+  if((mcastBatchUs<=0)&&((corkBytes<=0)||(corkUs<=0))) {
+    return 0;
+  }
+  flusherAlive=true;
+  if(pthread_create(&flusher,NULL,flusherStart,this)!=0) {
+    flusherAlive=false;
+    PERROR("Error pthread_create()");
+    return -1;
+  }
+  return 0;
+}
+
+/// Stops the multicast publishes coalescing and the corks, sending what is waiting
+void SMessenger::closeFlusher() {
+  pthread_mutex_lock(&flushMutex);
+  bool started=flusherAlive;
+  flusherAlive=false;
+  pthread_cond_signal(&flushCond);
+  pthread_mutex_unlock(&flushMutex);
+  if(started) {
+    pthread_join(flusher,NULL);
+  }
+  flush();
+  pthread_cond_destroy(&flushCond);
+  pthread_mutex_destroy(&flushMutex);
+}
+
+/// Waits up to MCAST_ROOM_MS for room on the multicast socket buffer
+int SMessenger::waitMCastRoom() {
+  struct pollfd pfd;
+  int res;
+  pfd.fd=mcsock;
+  pfd.events=POLLOUT;
+  pfd.revents=0;
+  while(((res=poll(&pfd,1,MCAST_ROOM_MS))<0)&&(errno==EINTR));
+  if(res==0) {
+    errno=EAGAIN;
+  }
+  return res;
+}
+
+/// Sends up to SBUS_MCAST_SEND_BATCH multicast frames (two fragments each) on a single sendmmsg()
+int SMessenger::sendFrames(struct iovec* vec, int n) {
+  int sent=0;
+  int res;
+#ifdef __linux__
+  struct mmsghdr frames[SBUS_MCAST_SEND_BATCH];
+  bzero(frames,n*sizeof(struct mmsghdr));
+  for(int i=0;i<n;i++) {
+    frames[i].msg_hdr.msg_name=&mcaddr;
+    frames[i].msg_hdr.msg_namelen=sizeof(mcaddr);
+    frames[i].msg_hdr.msg_iov=&vec[2*i];
+    frames[i].msg_hdr.msg_iovlen=2;
+  }
+  // The kernel may stop short (i.e. the socket buffer is full), go on from there
+  while(sent<n) {
+    if((res=sendmmsg(mcsock,&frames[sent],n-sent,0))<0) {
+      if(errno==EINTR) {
+        continue;
+      }
+      // A burst (i.e. a big fragmented message) may fill the socket buffer up, wait for room
+      if(((errno==EAGAIN)||(errno==EWOULDBLOCK))&&(waitMCastRoom()>0)) {
+        continue;
+      }
+      PERROR("Error sendmmsg()");
+      break;
+    }
+    sent+=res;
+  }
+#else
+  struct msghdr mh;
+  for(;sent<n;sent++) {
+    bzero(&mh,sizeof(mh));
+    mh.msg_name=&mcaddr;
+    mh.msg_namelen=sizeof(mcaddr);
+    mh.msg_iov=&vec[2*sent];
+    mh.msg_iovlen=2;
+    if((res=sendmsg(mcsock,&mh,0))<0) {
+      if((errno==EINTR)||(((errno==EAGAIN)||(errno==EWOULDBLOCK))&&(waitMCastRoom()>0))) {
+        sent--;
+        continue;
+      }
+      PERROR("Error sendmsg()");
+      break;
+    }
+  }
+#endif
+  return (sent>0)?sent:-1;
+}
+
+/**
+  Sends several messages over multicast with a single sendmmsg() per
+  SBUS_MCAST_SEND_BATCH messages, in order
+  @param msgs are the messages to send
+  @param n is the number of messages
+  @return the number of messages sent (the first ones), or -1 if none could be sent
+*/
+int SMessenger::sendBatch(const SBusBatchMsg* msgs, int n) {
+  smsg_header hdrs[SBUS_MCAST_SEND_BATCH];
+  struct iovec vec[2*SBUS_MCAST_SEND_BATCH];
+  int done=0;
+  int count;
+  int res=0;
+  // Whatever is on the coalescing window was published before
+  pthread_mutex_lock(&flushMutex);
+  if(flushMCastLocked()<0) {
+    pthread_mutex_unlock(&flushMutex);
+    return -1;
+  }
+  while(done<n) {
+    for(count=0;(count<SBUS_MCAST_SEND_BATCH)&&(done+count<n);count++) {
+      const SBusBatchMsg* msg=&msgs[done+count];
+      // Messages that go in fragments are sent on their own
+      if(isFragmented(msg->bytes)) {
+        break;
+      }
+      if((msg->bytes<0)||(msg->bytes+HDRLEN>MAX_DGRAMLEN)) {
+        ERROR("Can not send %d bytes on a multicast message",msg->bytes);
+        break;
+      }
+      packhdr(&hdrs[count],msg->msgtag,port,msg->bytes);
+      vec[2*count].iov_base=&hdrs[count];
+      vec[2*count].iov_len=HDRLEN;
+      vec[2*count+1].iov_base=(void*)msg->data;
+      vec[2*count+1].iov_len=msg->bytes;
+    }
+    if((count==0)&&isFragmented(msgs[done].bytes)) {
+      struct iovec body={(void*)msgs[done].data,(size_t)msgs[done].bytes};
+      if(sendFragmentsLocked(msgs[done].msgtag,&body,1,msgs[done].bytes)<0) {
+        break;
+      }
+      done++;
+      continue;
+    }
+    if((count==0)||((res=sendFrames(vec,count))<0)) {
+      break;
+    }
+    done+=res;
+    if(res<count) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&flushMutex);
+  if(done<n) {
+    ERROR("Could not send multicast batch (sent %d of %d messages)",done,n);
+  }
+  return ((done>0)||(n==0))?done:-1;
+}
+
+/// Copies a multicast frame to the coalescing window, sending it if full
+int SMessenger::queueMCast(const struct iovec* vec, int veccnt, int total2send) {
+  SBuf* frame;
+  int at=0;
+  int res=SBUS_QUEUED;
+  if(total2send>MAX_DGRAMLEN) {
+    ERROR("Can not send %d bytes on a multicast message",total2send);
+    return -1;
+  }
+  RET_ON_FALSE(((frame=SBufPool::alloc(total2send))!=NULL));
+  for(int i=0;i<veccnt;i++) {
+    memcpy(&frame->data()[at],vec[i].iov_base,vec[i].iov_len);
+    at+=vec[i].iov_len;
+  }
+  pthread_mutex_lock(&flushMutex);
+  if(mcoutCount==0) {
+    mcoutDeadline=timing_current_micros()+mcastBatchUs;
+    pthread_cond_signal(&flushCond);
+  }
+  mcout[mcoutCount]=frame;
+  mcoutLen[mcoutCount]=total2send;
+  mcoutCount++;
+  if(mcoutCount==SBUS_MCAST_SEND_BATCH) {
+    res=(flushMCastLocked()<0)?-1:SBUS_SENT;
+  }
+  pthread_mutex_unlock(&flushMutex);
+  return res;
+}
+
+/// Sends the frames on the coalescing window (flushMutex held)
+int SMessenger::flushMCastLocked() {
+  struct iovec vec[2*SBUS_MCAST_SEND_BATCH];
+  int i;
+  int sent;
+  if(mcoutCount==0) {
+    return 0;
+  }
+  for(i=0;i<mcoutCount;i++) {
+    vec[2*i].iov_base=mcout[i]->data();
+    vec[2*i].iov_len=mcoutLen[i];
+    vec[2*i+1].iov_base=NULL;
+    vec[2*i+1].iov_len=0;
+  }
+  sent=sendFrames(vec,mcoutCount);
+  if(sent<mcoutCount) {
+    ERROR("Could not send coalesced multicast messages (sent %d of %d)",
+      (sent<0)?0:sent,mcoutCount);
+  }
+  for(i=0;i<mcoutCount;i++) {
+    mcout[i]->unref();
+    mcout[i]=NULL;
+  }
+  i=mcoutCount;
+  mcoutCount=0;
+  return (sent<i)?-1:0;
+}
+
+/// Puts a connection that started holding back bytes on the corked list
+void SMessenger::corkConn(SConn* conn) {
+  SCorked entry;
+  conn->ref();
+  entry.conn=conn;
+  entry.deadline=timing_current_micros()+corkUs;
+  pthread_mutex_lock(&flushMutex);
+  corked.push_back(entry);
+  // Deadlines come in order, only the first one changes the flusher's wait
+  if(corked.size()==1) {
+    pthread_cond_signal(&flushCond);
+  }
+  pthread_mutex_unlock(&flushMutex);
+}
+
+/**
+  Sends what a connection taken from the corked list holds back, and drops
+  the list's reference
+  @param conn is the TCP connection state
+  @return SBUS_SENT, SBUS_QUEUED (waits for room on the socket) or -1 on error
+*/
+int SMessenger::uncorkConn(SConn* conn) {
+  int res;
+  conn->lockOut();
+  conn->setCorkListed(false);
+  res=flushOut(conn);
+  conn->unlockOut();
+  // A dropped connection just loses what it held back
+  if((res<0)&&(errno!=EPIPE)) {
+    PERROR("Error flushing corked connection");
+  }
+  conn->unref();
+  return res;
+}
+
+/**
+  Sends right away the multicast messages waiting on the coalescing window
+  and the messages held back by every corked connection
+  @return 0 on success or -1 in case of an error (messages were lost)
+*/
+int SMessenger::flush() {
+  deque<SCorked> all;
+  int res;
+  pthread_mutex_lock(&flushMutex);
+  res=flushMCastLocked();
+  all.swap(corked);
+  pthread_mutex_unlock(&flushMutex);
+  for(deque<SCorked>::iterator it=all.begin();it!=all.end();it++) {
+    if(uncorkConn(it->conn)<0) {
+      res=-1;
+    }
+  }
+  return res;
+}
+
+/**
+  Sends right away the messages held back by a corked connection
+  @param socket2peer is the connection to the peer
+  @return SBUS_SENT, SBUS_QUEUED (waits for room on the socket) or -1 on error
+*/
+int SMessenger::flush(SocketType socket2peer) {
+  SConn* conn;
+  int res;
+  if((conn=holdConn(socket2peer))==NULL) {
+    ERROR("Socket %d is not a peer connection",socket2peer);
+    return -1;
+  }
+  // It stays on the corked list, its deadline will find nothing to send
+  conn->lockOut();
+  res=flushOut(conn);
+  conn->unlockOut();
+  conn->unref();
+  return res;
+}
+
+/// Flusher thread loop
+void SMessenger::flusherLoop() {
+  struct timespec until;
+  pthread_mutex_lock(&flushMutex);
+  while(flusherAlive) {
+    long long int next=(mcoutCount>0)?mcoutDeadline:-1;
+    if((corkUs>0)&&!corked.empty()&&((next<0)||(corked.front().deadline<next))) {
+      next=corked.front().deadline;
+    }
+    if(next<0) {
+      pthread_cond_wait(&flushCond,&flushMutex);
+      continue;
+    }
+    long long int now=timing_current_micros();
+    long long int left=next-now;
+    if(left>0) {
+      clock_gettime(CLOCK_MONOTONIC,&until);
+      until.tv_sec+=left/1000000;
+      until.tv_nsec+=(left%1000000)*1000;
+      if(until.tv_nsec>=1000000000) {
+        until.tv_sec++;
+        until.tv_nsec-=1000000000;
+      }
+      pthread_cond_timedwait(&flushCond,&flushMutex,&until);
+      continue;
+    }
+    if((mcoutCount>0)&&(mcoutDeadline<=now)) {
+      flushMCastLocked();
+    }
+    // Connections are flushed out of the lock, senders may be corking meanwhile
+    while((corkUs>0)&&!corked.empty()&&(corked.front().deadline<=now)) {
+      SConn* conn=corked.front().conn;
+      corked.pop_front();
+      pthread_mutex_unlock(&flushMutex);
+      uncorkConn(conn);
+      pthread_mutex_lock(&flushMutex);
+    }
+  }
+  pthread_mutex_unlock(&flushMutex);
+}
+
+/// Flusher thread entry point
+void* SMessenger::flusherStart(void* arg) {
+  ((SMessenger*)arg)->flusherLoop();
+  return NULL;
+}
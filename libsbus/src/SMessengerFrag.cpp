@@ -0,0 +1,298 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SMessengerFrag.cpp
+    @brief SMessenger multicast fragmentation
+
+  Multicast messages bigger than a datagram (SBusOptions.mcastDatagramBytes,
+  i.e. a path MTU, off by default) are sent as several datagrams, each a fragment with
+  the message id, its index and its offset, instead of leaving it to IP
+  fragmentation, where a single lost piece loses the whole datagram and
+  anything over 64KB can not go at all. Receivers reassemble them on a
+  bounded table, giving up on messages whose fragments do not arrive in time.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <iostream>
+#include <SMessenger.h>
+
+#include <sockaddr.h>
+#include <timing.h>
+#include <SBufPool.h>
+
+using namespace std;
+using namespace simple;
+
+/// Smallest multicast datagram fragmented messages are cut to
+#define MIN_FRAGMENT_DGRAM 256
+
+/// Header laid before each fragment bytes
+typedef struct sfrag_frame {
+  /// Message header (FRAGMENT_TAG)
+  smsg_header msg;
+  /// Fragment header
+  sfrag_header frag;
+} sfrag_frame;
+
+/// Sets up the multicast fragmentation and the reassembly table
+void SMessenger::initFragments(SBusOptions* options) {
+  mcastDatagramBytes=(options!=NULL)?options->mcastDatagramBytes:0;
+  if((mcastDatagramBytes>0)&&(mcastDatagramBytes<MIN_FRAGMENT_DGRAM)) {
+    WARN("%d bytes multicast datagrams requested, using %d",mcastDatagramBytes,MIN_FRAGMENT_DGRAM);
+    mcastDatagramBytes=MIN_FRAGMENT_DGRAM;
+  } else if(mcastDatagramBytes>MAX_DGRAMLEN) {
+    mcastDatagramBytes=MAX_DGRAMLEN;
+  }
+  lastFragMsg=0;
+  bzero(frags,sizeof(frags));
+}
+
+/// Drops the multicast messages being reassembled
+void SMessenger::closeFragments() {
+  for(int i=0;i<MCAST_REASSEMBLY_SLOTS;i++) {
+    dropFragMsg(&frags[i]);
+  }
+}
+
+/// Frees a reassembly table slot
+void SMessenger::dropFragMsg(SFragMsg* fmsg) {
+  if(fmsg->buf!=NULL) {
+    fmsg->buf->unref();
+    free(fmsg->got);
+  }
+  bzero(fmsg,sizeof(SFragMsg));
+}
+
+/// Tells if a multicast message body goes in fragments
+bool SMessenger::isFragmented(int bytes) {
+  return (mcastDatagramBytes>0)&&(bytes<=MAX_DATALEN)&&(bytes+(int)HDRLEN>mcastDatagramBytes);
+}
+
+/**
+  Sends a multicast message in fragments, up to SBUS_MCAST_SEND_BATCH of them
+  per sendmmsg() (flushMutex held, so they go after the coalesced frames)
+  @param msgtag is the message tag/code
+  @param iov are the body fragments
+  @param iovcnt is the number of body fragments
+  @param bytes is the body length
+  @return SBUS_SENT or -1 on error
+*/
+int SMessenger::sendFragmentsLocked(int msgtag, const struct iovec* iov, int iovcnt, int bytes) {
+  sfrag_frame heads[SBUS_MCAST_SEND_BATCH];
+  struct iovec vec[2*SBUS_MCAST_SEND_BATCH];
+  int piece=mcastDatagramBytes-sizeof(sfrag_frame);
+  int count=(bytes+piece-1)/piece;
+  unsigned int msgid=__sync_add_and_fetch(&lastFragMsg,1);
+  const char* body;
+  SBuf* gathered=NULL;
+  int index=0;
+  int res=SBUS_SENT;
+  if(count>0xFFFF) {
+    ERROR("Can not send %d bytes on %d bytes multicast fragments",bytes,mcastDatagramBytes);
+    return -1;
+  }
+  // Fragments are cut from a single piece of memory
+  if(iovcnt==1) {
+    body=(const char*)iov[0].iov_base;
+  } else {
+    int at=0;
+    RET_ON_FALSE(((gathered=SBufPool::alloc(bytes))!=NULL));
+    for(int i=0;i<iovcnt;i++) {
+      memcpy(&gathered->data()[at],iov[i].iov_base,iov[i].iov_len);
+      at+=iov[i].iov_len;
+    }
+    body=gathered->data();
+  }
+  while(index<count) {
+    int n;
+    for(n=0;(n<SBUS_MCAST_SEND_BATCH)&&(index+n<count);n++) {
+      int offset=(index+n)*piece;
+      int len=(offset+piece<=bytes)?piece:bytes-offset;
+      packhdr(&heads[n].msg,FRAGMENT_TAG,port,FRAGHDRLEN+len);
+      heads[n].frag.msgid=htonl(msgid);
+      heads[n].frag.msgtag=htons(msgtag);
+      heads[n].frag.index=htons(index+n);
+      heads[n].frag.count=htons(count);
+      heads[n].frag.reserved=0;
+      heads[n].frag.length=htonl(bytes);
+      heads[n].frag.offset=htonl(offset);
+      vec[2*n].iov_base=&heads[n];
+      vec[2*n].iov_len=sizeof(sfrag_frame);
+      vec[2*n+1].iov_base=(void*)&body[offset];
+      vec[2*n+1].iov_len=len;
+    }
+    if(sendFrames(vec,n)!=n) {
+      ERROR("Could not send multicast message fragments (%d of %d sent)",index,count);
+      res=-1;
+      break;
+    }
+    index+=n;
+  }
+  if(gathered!=NULL) {
+    gathered->unref();
+  }
+  DEBUG("mcsendit sent MSGTAG=%d and %d bytes in %d fragments via multicast socket %d",
+    msgtag,bytes,count,mcsock);
+  return res;
+}
+
+/**
+  Sends a multicast message in fragments, after the coalesced frames
+  @param msgtag is the message tag/code
+  @param iov are the body fragments
+  @param iovcnt is the number of body fragments
+  @param bytes is the body length
+  @return SBUS_SENT or -1 on error
+*/
+int SMessenger::sendFragments(int msgtag, const struct iovec* iov, int iovcnt, int bytes) {
+  int res=-1;
+  pthread_mutex_lock(&flushMutex);
+  if(flushMCastLocked()>=0) {
+    res=sendFragmentsLocked(msgtag,iov,iovcnt,bytes);
+  }
+  pthread_mutex_unlock(&flushMutex);
+  return res;
+}
+
+/// Tells if a datagram is a multicast fragment
+bool SMessenger::isFragment(const char* dgram, int len) {
+  smsg_header head;
+  if(len<(int)HDRLEN) {
+    return false;
+  }
+  memcpy(&head,dgram,HDRLEN);
+  return (short)ntohs(head.code)==FRAGMENT_TAG;
+}
+
+/**
+  Takes a multicast fragment, copying it to its message reassembly buffer
+  and queueing the message once all its fragments are in; expired messages
+  are given up and, with the table full, the oldest one makes room
+  @param r is the reactor serving the multicast socket
+  @param fd is the multicast socket
+  @param dgram is the datagram
+  @param len is the datagram length
+  @param from is the sender address
+  @return 1 if a message was queued, 0 otherwise
+*/
+int SMessenger::takeFragment(SReactor* r, SocketType fd, const char* dgram, int len,
+  struct sockaddr_in* from) {
+  smsg_header head;
+  sfrag_header frag;
+  short code;
+  unsigned short portFrom;
+  int datasize;
+  int ipFrom=sockaddr_getIP(from);
+  long long int now=timing_current_micros();
+  SFragMsg* fmsg=NULL;
+  SFragMsg* slot=NULL;
+  SFragMsg* oldest=NULL;
+  if(len<(int)(HDRLEN+FRAGHDRLEN)) {
+    WARN("Fragment dropped! (%d bytes datagram)",len);
+    return 0;
+  }
+  memcpy(&head,dgram,HDRLEN);
+  memcpy(&frag,dgram+HDRLEN,FRAGHDRLEN);
+  datasize=unpackhdr(&head,&code,&portFrom);
+  unsigned int msgid=ntohl(frag.msgid);
+  short msgtag=(short)ntohs(frag.msgtag);
+  int index=ntohs(frag.index);
+  int count=ntohs(frag.count);
+  int length=ntohl(frag.length);
+  int offset=ntohl(frag.offset);
+  int piece=datasize-FRAGHDRLEN;
+  if((datasize!=(int)(len-HDRLEN))||(index>=count)||(length<=0)||(length>MAX_DATALEN)||
+     (offset<0)||(offset>length-piece)) {
+    WARN("Fragment dropped!");
+    return 0;
+  }
+  // Not subscribed, not worth reassembling
+  if(!isWanted(msgtag)) {
+    return 0;
+  }
+  for(int i=0;i<MCAST_REASSEMBLY_SLOTS;i++) {
+    SFragMsg* f=&frags[i];
+    if((f->buf!=NULL)&&(f->deadline<=now)) {
+      DEBUG("Multicast message %u from port %d given up (%d of %d fragments)",
+        f->msgid,f->port,f->received,f->count);
+      dropFragMsg(f);
+    }
+    if(f->buf==NULL) {
+      slot=(slot==NULL)?f:slot;
+    } else if((f->ip==ipFrom)&&(f->port==portFrom)&&(f->msgid==msgid)) {
+      fmsg=f;
+    } else if((oldest==NULL)||(f->deadline<oldest->deadline)) {
+      oldest=f;
+    }
+  }
+  // Same id for another message, the sender restarted
+  if((fmsg!=NULL)&&((fmsg->msgtag!=msgtag)||(fmsg->count!=count)||(fmsg->length!=length))) {
+    dropFragMsg(fmsg);
+    slot=fmsg;
+    fmsg=NULL;
+  }
+  if(fmsg==NULL) {
+    if(slot==NULL) {
+      WARN("Multicast message %u from port %d dropped, too many messages being reassembled",
+        oldest->msgid,oldest->port);
+      dropFragMsg(oldest);
+      slot=oldest;
+    }
+    if((slot->buf=SBufPool::alloc(length))==NULL) {
+      return 0;
+    }
+    if((slot->got=(unsigned char*)calloc(count,1))==NULL) {
+      dropFragMsg(slot);
+      return 0;
+    }
+    slot->ip=ipFrom;
+    slot->port=portFrom;
+    slot->msgid=msgid;
+    slot->msgtag=msgtag;
+    slot->length=length;
+    slot->count=count;
+    slot->received=0;
+    slot->deadline=now+MCAST_REASSEMBLY_MS*1000LL;
+    fmsg=slot;
+  }
+  if(fmsg->got[index]) {
+    return 0;
+  }
+  fmsg->got[index]=1;
+  fmsg->received++;
+  memcpy(&fmsg->buf->data()[offset],dgram+HDRLEN+FRAGHDRLEN,piece);
+  if(fmsg->received<fmsg->count) {
+    return 0;
+  }
+  SBufSlice body(fmsg->buf,0,length);
+  DEBUG("Receive MSGTAG=%d from socket %d with %dbytes in %d fragments",msgtag,fd,length,count);
+  r->queue(new SMsg(msgtag, ipFrom, portFrom, fd, body));
+  dropFragMsg(fmsg);
+  return 1;
+}
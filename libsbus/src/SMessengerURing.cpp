@@ -0,0 +1,498 @@
+/*
+      SBUS library: 
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SMessengerURing.cpp
+    @brief SMessenger io_uring transport engine
+
+  The multicast socket, the TCP server socket and every peer connection get a
+  multishot recvmsg/accept/recv armed once, with the kernel picking receive
+  buffers from provided buffer rings, so no poll()+recv() is needed per message.
+  Each reactor has its own receive ring, submitted only by its own thread.
+  Peer sends take the same path as with the poll engine, a non blocking
+  sendmsg() under the connection's own lock with whatever the socket does not
+  take left on its outbound queue; the reactor ring then polls for room.
+  Multicast datagrams go through their own small ring. Other threads wake a
+  reactor up with a write on its eventfd, polled by the reactor ring.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <iostream>
+
+#include <SMessenger.h>
+
+#include <stcp.h>
+#include <sudp.h>
+#include <SURing.h>
+
+using namespace std;
+using namespace simple;
+
+/// Receive ring size
+#define URING_ENTRIES 256
+/// Multicast send ring size
+#define URING_SEND_ENTRIES 8
+/// Provided buffers group for TCP receives
+#define BGID_TCP 0
+/// TCP receive buffers
+#define TCP_BUFS 64
+/// TCP receive buffer size
+#define TCP_BUFSIZE 16384
+/// Provided buffers group for multicast receives
+#define BGID_MCAST 1
+/// Multicast receive buffers
+#define MCAST_BUFS 16
+/// Multicast receive buffer size (biggest datagram plus recvmsg info)
+#define MCAST_BUFSIZE (MAX_DGRAMLEN+sizeof(struct io_uring_recvmsg_out)+sizeof(struct sockaddr_in))
+
+/// Completion kinds, kept on the top byte of the user_data
+#define URING_ACCEPT 1
+#define URING_MCAST  2
+#define URING_RECV   3
+#define URING_CANCEL 4
+#define URING_WAKE   5
+#define URING_SEND   6
+#define URING_ZEROCOPY 7
+
+/// Packs a completion kind, connection id and socket into an user_data
+#define URING_DATA(kind,id,fd) ((((unsigned long long)(kind))<<56)| \
+  (((unsigned long long)((id)&0xFFFFFF))<<32)|((unsigned int)(fd)))
+/// Completion kind from user_data
+#define URING_KIND(data) ((int)((data)>>56))
+/// Connection id from user_data
+#define URING_ID(data) ((unsigned int)(((data)>>32)&0xFFFFFF))
+/// Socket from user_data
+#define URING_FD(data) ((int)((data)&0xFFFFFFFF))
+
+/// Queues a single submission entry (handed to the kernel on the next submit)
+static int uringQueue(SURing* ring, struct io_uring_sqe* tmpl) {
+  struct io_uring_sqe* sqe;
+  ring->lock();
+  if((sqe=ring->getSqe())==NULL) {
+    ring->unlock();
+    ERROR("io_uring submission queue full");
+    return -1;
+  }
+  memcpy(sqe,tmpl,sizeof(struct io_uring_sqe));
+  ring->unlock();
+  return 0;
+}
+
+/// Starts the io_uring engine
+int SMessenger::initURing() {
+  int i=0;
+  SURing* ring=NULL;
+  try {
+    sendRing=new SURing(URING_SEND_ENTRIES);
+    for(i=0;i<nreactors;i++) {
+      ring=NULL;
+      ring=new SURing(URING_ENTRIES);
+      reactors[i]->setURing(ring);
+      reactors[i]->setWakeFd(eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC));
+      // Provided buffer rings need Linux 5.19, multishot receives come along (6.0)
+      if((reactors[i]->getWakeFd()<0)||(armWake(reactors[i])<0)||
+         (ring->addBuffers(BGID_TCP,TCP_BUFS,TCP_BUFSIZE)<0)||
+         ((i==0)&&(ring->addBuffers(BGID_MCAST,MCAST_BUFS,MCAST_BUFSIZE)<0))) {
+        break;
+      }
+    }
+  } catch(string* s) {
+    WARN("%s",s->c_str());
+    delete(s);
+  }
+  if((sendRing==NULL)||(ring==NULL)||(i<nreactors)) {
+    for(i=0;i<nreactors;i++) {
+      delete(reactors[i]->getURing());
+      reactors[i]->setURing(NULL);
+      reactors[i]->setWakeFd(-1);
+    }
+    delete(sendRing);
+    sendRing=NULL;
+    return -1;
+  }
+  uring=true;
+  bzero(&mcmsg,sizeof(mcmsg));
+  mcmsg.msg_namelen=sizeof(struct sockaddr_in);
+  DEBUG("io_uring engine started");
+  return 0;
+}
+
+/// Arms a multishot accept on the TCP server socket
+int SMessenger::armAccept() {
+  struct io_uring_sqe sqe;
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_ACCEPT;
+  sqe.fd=servsock;
+  sqe.ioprio=IORING_ACCEPT_MULTISHOT;
+  sqe.accept_flags=SOCK_NONBLOCK|SOCK_CLOEXEC;
+  sqe.user_data=URING_DATA(URING_ACCEPT,0,servsock);
+  return uringQueue(reactors[0]->getURing(),&sqe);
+}
+
+/// Arms a multishot recvmsg on the multicast socket
+int SMessenger::armMCast() {
+  struct io_uring_sqe sqe;
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_RECVMSG;
+  sqe.fd=mcsock;
+  sqe.addr=(unsigned long long)&mcmsg;
+  sqe.len=1;
+  sqe.ioprio=IORING_RECV_MULTISHOT;
+  sqe.flags=IOSQE_BUFFER_SELECT;
+  sqe.buf_group=BGID_MCAST;
+  sqe.user_data=URING_DATA(URING_MCAST,0,mcsock);
+  return uringQueue(reactors[0]->getURing(),&sqe);
+}
+
+/// Arms a multishot recv on a TCP connection, on its reactor's ring
+int SMessenger::armRecv(SConn* conn) {
+  struct io_uring_sqe sqe;
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_RECV;
+  sqe.fd=conn->getSocket();
+  sqe.ioprio=IORING_RECV_MULTISHOT;
+  sqe.flags=IOSQE_BUFFER_SELECT;
+  sqe.buf_group=BGID_TCP;
+  sqe.user_data=URING_DATA(URING_RECV,conn->getId(),conn->getSocket());
+  return uringQueue(reactors[conn->getReactor()]->getURing(),&sqe);
+}
+
+/**
+  Arms a one shot poll for room on a TCP connection, on its reactor's ring,
+  its completion sends the connection's outbound queue
+  @param conn is the TCP connection state
+  @return 0 on success or -1 on error
+*/
+int SMessenger::armSend(SConn* conn) {
+  SReactor* r=reactors[conn->getReactor()];
+  struct io_uring_sqe sqe;
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_POLL_ADD;
+  sqe.fd=conn->getSocket();
+  sqe.poll32_events=POLLOUT;
+  sqe.user_data=URING_DATA(URING_SEND,conn->getId(),conn->getSocket());
+  RET_ON_ERROR(uringQueue(r->getURing(),&sqe));
+  // Only the reactor's own thread submits to its ring
+  return wakeURing(r);
+}
+
+/**
+  Arms a one shot poll for the zero-copy completions on a TCP connection,
+  reported as socket errors (outbound queue locked)
+  @param conn is the TCP connection state
+  @return 0 on success or -1 on error
+*/
+int SMessenger::armZeroCopy(SConn* conn) {
+  SReactor* r=reactors[conn->getReactor()];
+  struct io_uring_sqe sqe;
+  if(conn->isZeroCopyArmed()) {
+    return 0;
+  }
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_POLL_ADD;
+  sqe.fd=conn->getSocket();
+  sqe.poll32_events=POLLERR;
+  sqe.user_data=URING_DATA(URING_ZEROCOPY,conn->getId(),conn->getSocket());
+  RET_ON_ERROR(uringQueue(r->getURing(),&sqe));
+  conn->setZeroCopyArmed(true);
+  return wakeURing(r);
+}
+
+/// Cancels the io_uring operations on a socket (before closing it)
+int SMessenger::cancelURing(SReactor* r, SocketType fd) {
+  struct io_uring_sqe sqe;
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_ASYNC_CANCEL;
+  sqe.fd=fd;
+  sqe.cancel_flags=IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+  sqe.user_data=URING_DATA(URING_CANCEL,0,fd);
+  RET_ON_ERROR(uringQueue(r->getURing(),&sqe));
+  // Cancelation is keyed on the socket, so it has to reach the kernel before close()
+  return (r->getURing()->submit(0,0)<0)?-1:0;
+}
+
+/// Arms a multishot poll on a reactor's wakeup eventfd
+int SMessenger::armWake(SReactor* r) {
+  struct io_uring_sqe sqe;
+  bzero(&sqe,sizeof(sqe));
+  sqe.opcode=IORING_OP_POLL_ADD;
+  sqe.fd=r->getWakeFd();
+  sqe.len=IORING_POLL_ADD_MULTI;
+  sqe.poll32_events=POLLIN;
+  sqe.user_data=URING_DATA(URING_WAKE,0,r->getWakeFd());
+  return uringQueue(r->getURing(),&sqe);
+}
+
+/**
+  Wakes up a receiving thread, so it submits the entries queued by other threads;
+  only the receiving thread submits to the receive ring, as completions are
+  delivered through the submitting thread. An eventfd write never blocks, so
+  waking never waits on the senders
+  @param r is the reactor to wake up
+  @return 0 on success or -1 on error
+*/
+int SMessenger::wakeURing(SReactor* r) {
+  eventfd_t one=1;
+  while(write(r->getWakeFd(),&one,sizeof(one))<0) {
+    // Counter saturated (EAGAIN) means a wakeup is already pending
+    if(errno==EAGAIN) {
+      return 0;
+    }
+    if(errno!=EINTR) {
+      PERROR("Error write() on reactor %d wakeup",r->getIndex());
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+  Processes an io_uring completion
+  @param r is the reactor owning the ring
+  @param cqe is the completion
+  @return 0 on success or -1 on error
+*/
+int SMessenger::handleCqe(SReactor* r, struct io_uring_cqe* cqe) {
+  SURing* uring=r->getURing();
+  unsigned long long data=cqe->user_data;
+  int res=cqe->res;
+  int fd=URING_FD(data);
+  bool more=(cqe->flags&IORING_CQE_F_MORE)!=0;
+  int bid=(cqe->flags&IORING_CQE_F_BUFFER)?(int)(cqe->flags>>IORING_CQE_BUFFER_SHIFT):-1;
+  switch(URING_KIND(data)) {
+    case URING_ACCEPT:
+      if(fd!=servsock) { // from an old server socket
+        if(res>=0) {
+          close(res);
+        }
+        return 0;
+      }
+      if(res>=0) {
+        DEBUG("Connection %d accepted",res);
+        if(addConn(res)==NULL) {
+          close(res);
+        }
+      } else {
+        errno=-res;
+        PERROR("Error accept()");
+      }
+      if(!more) {
+        return armAccept();
+      }
+      return 0;
+    case URING_MCAST:
+      if(bid>=0) {
+        char* buf=uring->getBuffer(BGID_MCAST,bid);
+        struct io_uring_recvmsg_out* out=(struct io_uring_recvmsg_out*)buf;
+        struct sockaddr_in* from=(struct sockaddr_in*)(buf+sizeof(struct io_uring_recvmsg_out));
+        char* payload=buf+sizeof(struct io_uring_recvmsg_out)+mcmsg.msg_namelen+mcmsg.msg_controllen;
+        SBufSlice dgram;
+        // Provided buffers go back to the kernel right away, so datagrams are copied
+        if((fd==mcsock)&&(res>0)&&!(out->flags&MSG_TRUNC)&&isWantedDatagram(payload,out->payloadlen)&&
+           (dgram.copy(payload,out->payloadlen)==0)) {
+          parseDatagram(r,fd,dgram,from);
+        }
+        uring->recycleBuffer(BGID_MCAST,bid);
+      }
+      if(fd!=mcsock) {
+        return 0;
+      }
+      if((res<0)&&(res!=-ENOBUFS)) {
+        errno=-res;
+        PERROR("Multicast socket %d error",fd);
+        return socketErrorHandling(fd); // rearmed with the new socket
+      }
+      if(!more) {
+        return armMCast();
+      }
+      return 0;
+    case URING_RECV: {
+      SConn* conn=holdConn(fd);
+      if((conn==NULL)||(conn->getId()!=URING_ID(data))) { // gone, or socket reused
+        if(bid>=0) {
+          uring->recycleBuffer(BGID_TCP,bid);
+        }
+        if(conn!=NULL) {
+          conn->unref();
+        }
+        return 0;
+      }
+      if(bid>=0) {
+        int failed=(res>0)?conn->append(uring->getBuffer(BGID_TCP,bid),res):0;
+        uring->recycleBuffer(BGID_TCP,bid);
+        // A backlogged connection gets its frames parsed when its turn comes
+        if((failed<0)||((res>0)&&!conn->isBacklogged()&&(parseFrames(r,conn)<0))) {
+          res=-EPROTO;
+        }
+      }
+      if((res==0)||((res<0)&&(res!=-ENOBUFS))) {
+        DEBUG("Data socket %d error (%d): removing it",fd,res);
+        socketErrorHandling(fd);
+        r->queue(new SMsg(ERRCODE_PEER_DISCONNECTED, 0, 0, fd));
+        conn->unref();
+        return 0;
+      }
+      res=more?0:armRecv(conn);
+      conn->unref();
+      return res;
+    }
+    case URING_SEND: {
+      SConn* conn=holdConn(fd);
+      if((conn==NULL)||(conn->getId()!=URING_ID(data))) { // gone, or socket reused
+        if(conn!=NULL) {
+          conn->unref();
+        }
+        return 0;
+      }
+      if(res<0) {
+        // The next frame queued arms it again
+        errno=-res;
+        PERROR("Error io_uring poll on socket %d",fd);
+        conn->lockOut();
+        conn->setOutArmed(false);
+        conn->unlockOut();
+      } else if(flushConn(r,conn)<0) {
+        DEBUG("Data socket %d error on send: removing it",fd);
+        socketErrorHandling(fd);
+        r->queue(new SMsg(ERRCODE_PEER_DISCONNECTED, 0, 0, fd));
+      }
+      conn->unref();
+      return 0;
+    }
+    case URING_ZEROCOPY: {
+      SConn* conn=holdConn(fd);
+      if((conn==NULL)||(conn->getId()!=URING_ID(data))) { // gone, or socket reused
+        if(conn!=NULL) {
+          conn->unref();
+        }
+        return 0;
+      }
+      conn->lockOut();
+      conn->setZeroCopyArmed(false);
+      // A real socket error (or hang up) shows up on the receive too
+      if((res>=0)&&(conn->reapZeroCopy()>=0)&&conn->hasZeroCopyPending()) {
+        armZeroCopy(conn);
+      }
+      conn->unlockOut();
+      conn->unref();
+      return 0;
+    }
+    case URING_WAKE: {
+      eventfd_t count;
+      // Resets the counter, the queued entries go with the next submit
+      while((read(fd,&count,sizeof(count))<0)&&(errno==EINTR)) {
+      }
+      if(!more) {
+        return armWake(r);
+      }
+      return 0;
+    }
+    default:
+      return 0;
+  }
+}
+
+/**
+  Waits once for io_uring completions and processes all of them,
+  complete messages go to the reactor's parsed messages queue
+  @param r is the reactor to wait on
+  @param timeout is the maximum time to wait for completions
+  @return the number of completions processed or -1 on error
+*/
+int SMessenger::waitURing(SReactor* r, int timeout) {
+  struct io_uring_cqe* cqe;
+  SURing* uring=r->getURing();
+  int n=0;
+  // Hands pending (re)arms to the kernel and waits for completions
+  RET_ON_ERROR(uring->submit((timeout>0)?1:0,timeout));
+  while((cqe=uring->peekCqe())!=NULL) {
+    handleCqe(r,cqe);
+    uring->seenCqe();
+    n++;
+  }
+  return n;
+}
+
+/**
+  Sends a multicast datagram with the io_uring engine
+  @param fd is the multicast socket
+  @param vec are the already packed header and the body fragments
+  @param veccnt is the number of entries on vec
+  @param total2send is the datagram length
+  @param to is the multicast destination
+  @return 0 on success or -1 in case of an error (message was not sent)
+*/
+int SMessenger::sendURing(SocketType fd, struct iovec* vec, int veccnt, int total2send,
+  struct sockaddr_in* to) {
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  struct msghdr mh;
+  smsg_header* hdr=(smsg_header*)vec[0].iov_base;
+  int sent=0;
+  int failed=0;
+  // Header and body in a single sendmsg(), as a datagram has to
+  bzero(&mh,sizeof(mh));
+  mh.msg_name=to;
+  mh.msg_namelen=sizeof(struct sockaddr_in);
+  mh.msg_iov=vec;
+  mh.msg_iovlen=veccnt;
+  // Datagram sends never wait on a peer, the ring is held just for one
+  pthread_mutex_lock(&sendMutex);
+  if((sqe=sendRing->getSqe())==NULL) {
+    pthread_mutex_unlock(&sendMutex);
+    ERROR("io_uring submission queue full");
+    return -1;
+  }
+  sqe->opcode=IORING_OP_SENDMSG;
+  sqe->fd=fd;
+  sqe->addr=(unsigned long long)&mh;
+  sqe->len=1;
+  if(sendRing->submit(1,-1)<0) {
+    failed=1;
+  } else {
+    while((cqe=sendRing->peekCqe())==NULL) {
+      sendRing->submit(1,-1);
+    }
+    if(cqe->res<0) {
+      errno=-cqe->res;
+      failed=1;
+    } else {
+      sent=cqe->res;
+    }
+    sendRing->seenCqe();
+  }
+  pthread_mutex_unlock(&sendMutex);
+  if(failed||(sent!=total2send)) {
+    PERROR("Error send()");
+    ERROR("Could not send message (sent=%d of %d)",sent,total2send);
+    return -1;
+  }
+  DEBUG("io_uring sent MSGTAG=%d and %d bytes via socket %d",ntohs(hdr->code),sent,fd);
+  return 0;
+}
@@ -34,6 +34,17 @@ SMsg::SMsg(short msgtag, int ip, unsigned short port, SocketType socket, string&
   this->port=port;
   this->socket=socket;
   this->msg=msg;
+  this->body.copy(msg.data(),msg.size());
+  this->error=false;
+}
+
+/// Message over a received buffer (no copies)
+SMsg::SMsg(short msgtag, int ip, unsigned short port, SocketType socket, SBufSlice& body) {
+  this->msgtag=msgtag;
+  this->ip=ip;
+  this->port=port;
+  this->socket=socket;
+  this->body=body;
   this->error=false;
 }
 
@@ -80,9 +91,17 @@ SocketType SMsg::getSocket() {
   return socket;
 }
 
-/// Msg getter
+/// Msg getter (copies the body)
 string& SMsg::getMsg() {
+  if(msg.size()!=(size_t)body.size()) {
+    msg.assign(body.data(),body.size());
+  }
   return msg;
 }
 
+/// Body getter (no copies)
+SBufSlice& SMsg::getBody() {
+  return body;
+}
+
 
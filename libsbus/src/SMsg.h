@@ -28,6 +28,7 @@
 #include <iostream>
 
 #include <stcp.h>
+#include <SBuf.h>
 
 using namespace std;
 
@@ -42,13 +43,17 @@ class SMsg {
 	unsigned short port;
 	/// Socket woth peer
 	SocketType socket;
-	/// Mensaje
+	/// Mensaje (copied from body on the first getMsg())
 	string msg;
+	/// Message body, on a shared received buffer
+	SBufSlice body;
 	/// Error flag
 	bool error;
   public:
   	/// Default Constructor 
 	SMsg(short msgtag, int ip, unsigned short port, SocketType socket, string& msg);
+	/// Message over a received buffer (no copies)
+	SMsg(short msgtag, int ip, unsigned short port, SocketType socket, SBufSlice& body);
 	/// Error message
 	SMsg(short errcode, int ip, unsigned short port, SocketType socket);
 	/// Default Destructor
@@ -65,8 +70,10 @@ class SMsg {
 	int getPort();
 	/// Socket getter
 	SocketType getSocket();
-	/// Msg getter
+	/// Msg getter (copies the body)
 	string& getMsg();
+	/// Body getter (no copies)
+	SBufSlice& getBody();
 };
 
 }
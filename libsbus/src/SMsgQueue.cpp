@@ -0,0 +1,455 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SMsgQueue.cpp
+   @brief Bounded lock-free queue of received messages
+
+  Each lane is a multi producer, multi consumer array queue: a push takes
+  the tail position with a compare and swap once the cell there is free for
+  that turn, fills it and hands it over to the turn of its pop; a pop does
+  the same on the head position and frees the cell for the turn a full lap
+  later.
+  A pop made to drop the oldest message looks at the error mark the push
+  left on the cell before taking the head position, so an error message
+  found there is left in place; the message itself is not touched until
+  the head is taken, a racing pop may have freed it.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <log.h>
+#include <errdefs.h>
+#include <SMsg.h>
+#include <SMsgQueue.h>
+
+using namespace std;
+using namespace simple;
+
+/**
+  Opens a wakeup descriptor, an eventfd on Linux and a pipe elsewhere
+  @param rd is filled with the descriptor to wait on
+  @param wr is filled with the descriptor to write to
+  @return 0 on success or -1 on error
+*/
+static int openWakeup(int* rd, int* wr) {
+#ifdef __linux__
+  *rd=*wr=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+  return (*rd<0)?-1:0;
+#else
+  int fds[2];
+  RET_ON_ERROR(pipe(fds));
+  *rd=fds[0];
+  *wr=fds[1];
+  fcntl(*rd,F_SETFL,fcntl(*rd,F_GETFL)|O_NONBLOCK);
+  fcntl(*wr,F_SETFL,fcntl(*wr,F_GETFL)|O_NONBLOCK);
+  return 0;
+#endif
+}
+
+/// Closes a wakeup descriptor
+static void closeWakeup(int rd, int wr) {
+  close(rd);
+  if(wr!=rd) {
+    close(wr);
+  }
+}
+
+/**
+  Creates a queue
+  @param capacity is the number of messages each lane holds
+  @param capacityBytes is the message bytes each lane holds (0 unlimited, a
+    single message is always taken by an empty lane)
+  @param lanes is the number of lanes
+  @param weights are the messages served in a row from each lane, or NULL
+    to serve them strictly by priority (the first one first)
+*/
+SMsgQueue::SMsgQueue(int capacity, long long int capacityBytes, int lanes, const int* weights) {
+  unsigned long n=2;
+  int i;
+  if(capacity<1) {
+    capacity=1;
+  }
+  while((int)n<capacity) {
+    n<<=1;
+  }
+  nrings=(lanes>0)?lanes:1;
+  if((rings=(SMsgRing*)calloc(nrings,sizeof(SMsgRing)))==NULL) {
+    throw new string("Could not allocate the incoming message's queue");
+  }
+  for(i=0;i<nrings;i++) {
+    if((rings[i].cells=(SMsgCell*)malloc(n*sizeof(SMsgCell)))==NULL) {
+      freeRings();
+      throw new string("Could not allocate the incoming message's queue");
+    }
+    for(unsigned long j=0;j<n;j++) {
+      rings[i].cells[j].turn=j;
+      rings[i].cells[j].msg=NULL;
+      rings[i].cells[j].error=false;
+    }
+    rings[i].mask=n-1;
+    rings[i].weight=((weights!=NULL)&&(weights[i]>0))?weights[i]:1;
+  }
+  weighted=(weights!=NULL);
+  serving=0;
+  served=0;
+  maxMsgs=capacity;
+  maxBytes=(capacityBytes>0)?capacityBytes:0;
+  parked=0;
+  notify=0;
+  signalled=0;
+  roomParked=0;
+  if(openWakeup(&wakefd,&wakewr)<0) {
+    PERROR("Error creating the wakeup descriptor");
+    freeRings();
+    throw new string("Could not create the incoming message's queue wakeup descriptor");
+  }
+  if(openWakeup(&roomfd,&roomwr)<0) {
+    PERROR("Error creating the wakeup descriptor");
+    closeWakeup(wakefd,wakewr);
+    freeRings();
+    throw new string("Could not create the incoming message's queue wakeup descriptor");
+  }
+}
+
+/// Frees the messages not popped and the wakeup descriptor
+SMsgQueue::~SMsgQueue() {
+  SMsg* msg;
+  while((msg=pop())!=NULL) {
+    delete(msg);
+  }
+  freeRings();
+  closeWakeup(wakefd,wakewr);
+  closeWakeup(roomfd,roomwr);
+}
+
+/// Frees the lanes
+void SMsgQueue::freeRings() {
+  for(int i=0;i<nrings;i++) {
+    free(rings[i].cells);
+  }
+  free(rings);
+}
+
+/**
+  Pushes a message, waking a parked consumer up
+  @param msg is the message
+  @param lane is the lane it goes to
+  @return true if pushed or false if the lane is full (messages or bytes)
+*/
+bool SMsgQueue::push(SMsg* msg, int lane) {
+  SMsgRing* ring=&rings[((lane>=0)&&(lane<nrings))?lane:nrings-1];
+  SMsgCell* cell;
+  unsigned long pos=ring->tail;
+  int len=msg->getBody().size();
+  // Limits are checked before taking a cell, pushers racing may go a little over them
+  if(!fitsRing(ring,len)) {
+    return false;
+  }
+  for(;;) {
+    cell=&ring->cells[pos&ring->mask];
+    long diff=(long)(__atomic_load_n(&cell->turn,__ATOMIC_ACQUIRE)-pos);
+    if(diff==0) {
+      if(__atomic_compare_exchange_n(&ring->tail,&pos,pos+1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if(diff<0) {
+      // The cell still holds the message of the previous lap
+      return false;
+    } else {
+      pos=__atomic_load_n(&ring->tail,__ATOMIC_RELAXED);
+    }
+  }
+  cell->msg=msg;
+  cell->error=msg->isError();
+  __sync_add_and_fetch(&ring->bytes,len);
+  __atomic_store_n(&cell->turn,pos+1,__ATOMIC_RELEASE);
+  // Pairs with the barrier of a consumer parking after finding it empty
+  __sync_synchronize();
+  if((parked>0)||notify) {
+    signal();
+  }
+  return true;
+}
+
+/// Tells if a lane takes a message of some bytes
+bool SMsgQueue::fitsRing(SMsgRing* ring, int len) {
+  if((long)(ring->tail-ring->head)>=maxMsgs) {
+    return false;
+  }
+  return (maxBytes==0)||(ring->bytes==0)||(ring->bytes+len<=maxBytes);
+}
+
+/**
+  Pops the oldest message of a lane, unless it is an error and they are kept
+  @param ring is the lane
+  @param keepErrors leaves an error message in place
+  @param kept is set if an error message was left in place (or NULL)
+  @return the message or NULL if the lane is empty or an error was kept
+*/
+SMsg* SMsgQueue::popRing(SMsgRing* ring, bool keepErrors, bool* kept) {
+  SMsgCell* cell;
+  SMsg* msg;
+  unsigned long pos=ring->head;
+  for(;;) {
+    cell=&ring->cells[pos&ring->mask];
+    long diff=(long)(__atomic_load_n(&cell->turn,__ATOMIC_ACQUIRE)-(pos+1));
+    if(diff==0) {
+      // Only the mark is read, the message may be popped and freed meanwhile: the head tells
+      if(keepErrors&&cell->error) {
+        if(__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE)!=pos) {
+          pos=__atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+          continue;
+        }
+        *kept=true;
+        return NULL;
+      }
+      if(__atomic_compare_exchange_n(&ring->head,&pos,pos+1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if(diff<0) {
+      // Nothing pushed (or not completely) on this cell yet
+      return NULL;
+    } else {
+      pos=__atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+    }
+  }
+  msg=cell->msg;
+  __atomic_store_n(&cell->turn,pos+ring->mask+1,__ATOMIC_RELEASE);
+  __sync_sub_and_fetch(&ring->bytes,msg->getBody().size());
+  // Pairs with the barrier of a producer parking after finding it full
+  __sync_synchronize();
+  if(roomParked>0) {
+    post(roomwr);
+  }
+  return msg;
+}
+
+/**
+  Pops the next message: the oldest of the first lane with messages or,
+  weighted, of the lane being served
+  @return the message or NULL if the queue is empty
+*/
+SMsg* SMsgQueue::pop() {
+  SMsg* msg=NULL;
+  int i;
+  if(!weighted) {
+    for(i=0;(i<nrings)&&(msg==NULL);i++) {
+      msg=popRing(&rings[i],false,NULL);
+    }
+  } else {
+    // Consumers racing here may only bend the weights a little
+    int lane=serving;
+    for(i=0;(i<nrings)&&(msg==NULL);i++) {
+      if((msg=popRing(&rings[lane],false,NULL))==NULL) {
+        lane=(lane+1)%nrings;
+        served=0;
+      }
+    }
+    if((msg!=NULL)&&(++served>=rings[lane].weight)) {
+      lane=(lane+1)%nrings;
+      served=0;
+    }
+    serving=lane;
+  }
+  // An event loop is not woken up again for nothing
+  if(signalled&&((msg==NULL)||isEmpty())) {
+    unsignal();
+  }
+  return msg;
+}
+
+/**
+  Pops the oldest message of a lane to drop it, unless it is an error
+  (i.e. a peer disconnection), which is left in place
+  @param lane is the lane
+  @param kept is set to whether the oldest message was an error left in place
+  @return the message or NULL if the lane is empty or its oldest message is an error
+*/
+SMsg* SMsgQueue::popDroppable(int lane, bool* kept) {
+  SMsg* msg;
+  *kept=false;
+  msg=popRing(&rings[((lane>=0)&&(lane<nrings))?lane:nrings-1],true,kept);
+  if(signalled&&isEmpty()) {
+    unsignal();
+  }
+  return msg;
+}
+
+/// Tells if a lane has a message ready to be popped
+bool SMsgQueue::isEmptyRing(SMsgRing* ring) {
+  unsigned long pos=__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&ring->cells[pos&ring->mask].turn,__ATOMIC_ACQUIRE)!=pos+1;
+}
+
+/// Tells if there is a message ready to be popped
+bool SMsgQueue::isEmpty() {
+  for(int i=0;i<nrings;i++) {
+    if(!isEmptyRing(&rings[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Number of messages in the queue
+int SMsgQueue::size() {
+  int n=0;
+  for(int i=0;i<nrings;i++) {
+    unsigned long h=__atomic_load_n(&rings[i].head,__ATOMIC_ACQUIRE);
+    unsigned long t=__atomic_load_n(&rings[i].tail,__ATOMIC_ACQUIRE);
+    n+=(t>h)?(int)(t-h):0;
+  }
+  return n;
+}
+
+/// Message bytes in the queue
+long long int SMsgQueue::getBytes() {
+  long long int n=0;
+  for(int i=0;i<nrings;i++) {
+    n+=rings[i].bytes;
+  }
+  return n;
+}
+
+/// Number of messages each lane holds
+int SMsgQueue::getCapacity() {
+  return maxMsgs;
+}
+
+/// Number of lanes
+int SMsgQueue::getLanes() {
+  return nrings;
+}
+
+/**
+  Parks the calling thread until a message is pushed
+  @param timeout is the longest wait (ms, -1 forever)
+  @return true if there are messages, false on timeout
+*/
+bool SMsgQueue::wait(int timeout) {
+  struct pollfd pfd;
+  __sync_add_and_fetch(&parked,1);
+  // A push from now on sees us parked, one before is seen here
+  if(isEmpty()&&signalled) {
+    unsignal();
+  }
+  if(isEmpty()) {
+    pfd.fd=wakefd;
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    poll(&pfd,1,timeout);
+  }
+  __sync_sub_and_fetch(&parked,1);
+  return !isEmpty();
+}
+
+/**
+  Parks the calling thread until a lane has room for a message
+  @param msg is the message to push
+  @param lane is the lane it goes to
+  @param timeout is the longest wait (ms, -1 forever)
+  @return true if there is room, false on timeout
+*/
+bool SMsgQueue::waitRoom(SMsg* msg, int lane, int timeout) {
+  SMsgRing* ring=&rings[((lane>=0)&&(lane<nrings))?lane:nrings-1];
+  int len=msg->getBody().size();
+  struct pollfd pfd;
+  __sync_add_and_fetch(&roomParked,1);
+  // A pop from now on sees us parked, one before is seen here
+  __sync_synchronize();
+  drain(roomfd);
+  if(!fitsRing(ring,len)) {
+    pfd.fd=roomfd;
+    pfd.events=POLLIN;
+    pfd.revents=0;
+    poll(&pfd,1,timeout);
+  }
+  __sync_sub_and_fetch(&roomParked,1);
+  return fitsRing(ring,len);
+}
+
+/**
+  Gives the wakeup descriptor to be watched by an event loop, readable from
+  then on whenever there are messages
+  @return the descriptor (not to be read nor closed)
+*/
+int SMsgQueue::getNotifyFd() {
+  notify=1;
+  __sync_synchronize();
+  if(!isEmpty()) {
+    signal();
+  }
+  return wakefd;
+}
+
+/// Makes the wakeup descriptor readable
+void SMsgQueue::signal() {
+  if(signalled||!__sync_bool_compare_and_swap(&signalled,0,1)) {
+    return;
+  }
+  post(wakewr);
+}
+
+/// Writes to a wakeup descriptor
+void SMsgQueue::post(int fd) {
+#ifdef __linux__
+  unsigned long long one=1;
+  while((write(fd,&one,sizeof(one))<0)&&(errno==EINTR));
+#else
+  char one=1;
+  // A full pipe is readable anyway
+  while((write(fd,&one,1)<0)&&(errno==EINTR));
+#endif
+}
+
+/// Makes the wakeup descriptor not readable, unless a message was pushed meanwhile
+void SMsgQueue::unsignal() {
+  if(!__sync_bool_compare_and_swap(&signalled,1,0)) {
+    return;
+  }
+  drain(wakefd);
+  // A push that found it still signalled did not signal it again, and the
+  // write of one that did may have just been drained
+  __sync_synchronize();
+  if(!isEmpty()) {
+    signalled=1;
+    post(wakewr);
+  }
+}
+
+/// Reads a wakeup descriptor until it is not readable
+void SMsgQueue::drain(int fd) {
+  char buf[64];
+  int res;
+  do {
+    res=read(fd,buf,sizeof(buf));
+  } while((res>0)||((res<0)&&(errno==EINTR)));
+}
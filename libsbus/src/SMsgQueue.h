@@ -0,0 +1,198 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SMsgQueue.h
+   @brief Bounded lock-free queue of received messages
+
+  The receiving threads (one per reactor) push the messages they parse and
+  the application threads pop them, with no lock on either side: each cell
+  carries the turn it is ready for, so pushers and poppers only race for
+  the indexes (a compare and swap each), which live on cache lines of their
+  own. Messages go on several lanes (rings), served strictly by priority or
+  by weight, all sharing the wakeup. A consumer finding it empty may park on a wakeup descriptor (an
+  eventfd on Linux, a pipe elsewhere) that pushers only signal when
+  somebody is parked or, once it was handed out to an event loop, always:
+  it is then readable for as long as the queue is not empty. Likewise, a
+  producer finding its lane full may park on a second descriptor, that
+  poppers signal while somebody is parked there.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+
+#ifndef SMSGQUEUE
+#define SMSGQUEUE
+
+namespace simple {
+
+class SMsg;
+
+/// Cache line size the queue indexes are kept apart by
+#define SMSGQUEUE_CACHELINE 64
+
+/// A queue cell
+typedef struct SMsgCell {
+  /// Position the cell is ready for: pos to be pushed, pos+1 to be popped
+  volatile unsigned long turn;
+  /// The message
+  SMsg* msg;
+  /// The message is an error (i.e. a peer disconnection), read without touching it
+  bool error;
+} SMsgCell;
+
+/// A lane of the queue, a ring of cells
+typedef struct SMsgRing {
+  /// Cells, a power of two of them
+  SMsgCell* cells;
+  /// Number of cells minus one
+  unsigned long mask;
+  /// Messages served in a row when weighted
+  int weight;
+  char pad0[SMSGQUEUE_CACHELINE];
+  /// Next position to push
+  volatile unsigned long tail;
+  char pad1[SMSGQUEUE_CACHELINE];
+  /// Next position to pop
+  volatile unsigned long head;
+  char pad2[SMSGQUEUE_CACHELINE];
+  /// Message bytes in the lane
+  volatile long long int bytes;
+  char pad3[SMSGQUEUE_CACHELINE];
+} SMsgRing;
+
+class SMsgQueue {
+  private:
+	/// Lanes, the first one first
+	SMsgRing* rings;
+	/// Number of lanes
+	int nrings;
+	/// Lanes are served by weight instead of strictly by priority
+	bool weighted;
+	/// Lane being served (weighted)
+	volatile int serving;
+	/// Messages served in a row from that lane (weighted)
+	volatile int served;
+	/// Messages each lane holds
+	int maxMsgs;
+	/// Message bytes each lane holds (0 unlimited)
+	long long int maxBytes;
+	/// Consumers parked for messages
+	volatile int parked;
+	/// The wakeup descriptor is watched by an event loop, it is kept readable while not empty
+	volatile int notify;
+	/// The wakeup descriptor is readable
+	volatile int signalled;
+	/// Wakeup descriptor parked consumers wait on (eventfd or pipe read end)
+	int wakefd;
+	/// Wakeup descriptor written to (the eventfd itself or the pipe write end)
+	int wakewr;
+	/// Producers parked for room
+	volatile int roomParked;
+	/// Descriptor parked producers wait on (eventfd or pipe read end)
+	int roomfd;
+	/// Descriptor written to when there is room (the eventfd itself or the pipe write end)
+	int roomwr;
+	/// Makes the wakeup descriptor readable
+	void signal();
+	/// Makes the wakeup descriptor not readable, unless a message was pushed meanwhile
+	void unsignal();
+	/// Writes to a wakeup descriptor
+	void post(int fd);
+	/// Reads a wakeup descriptor until it is not readable
+	void drain(int fd);
+	/// Frees the lanes
+	void freeRings();
+	/// Pops the oldest message of a lane, unless it is an error and they are kept
+	SMsg* popRing(SMsgRing* ring, bool keepErrors, bool* kept);
+	/// Tells if a lane takes a message of some bytes
+	bool fitsRing(SMsgRing* ring, int len);
+	/// Tells if a lane has a message ready to be popped
+	bool isEmptyRing(SMsgRing* ring);
+  public:
+	/**
+	  Creates a queue
+	  @param capacity is the number of messages each lane holds
+	  @param capacityBytes is the message bytes each lane holds (0 unlimited, a
+	    single message is always taken by an empty lane)
+	  @param lanes is the number of lanes
+	  @param weights are the messages served in a row from each lane, or NULL
+	    to serve them strictly by priority (the first one first)
+	*/
+	SMsgQueue(int capacity, long long int capacityBytes, int lanes, const int* weights);
+	/// Frees the messages not popped and the wakeup descriptor
+	~SMsgQueue();
+	/**
+	  Pushes a message, waking a parked consumer up
+	  @param msg is the message
+	  @param lane is the lane it goes to
+	  @return true if pushed or false if the lane is full (messages or bytes)
+	*/
+	bool push(SMsg* msg, int lane);
+	/**
+	  Pops the next message: the oldest of the first lane with messages or,
+	  weighted, of the lane being served
+	  @return the message or NULL if the queue is empty
+	*/
+	SMsg* pop();
+	/**
+	  Pops the oldest message of a lane to drop it, unless it is an error
+	  (i.e. a peer disconnection), which is left in place
+	  @param lane is the lane
+	  @param kept is set to whether the oldest message was an error left in place
+	  @return the message or NULL if the lane is empty or its oldest message is an error
+	*/
+	SMsg* popDroppable(int lane, bool* kept);
+	/// Tells if there is a message ready to be popped
+	bool isEmpty();
+	/// Number of messages in the queue
+	int size();
+	/// Message bytes in the queue
+	long long int getBytes();
+	/// Number of messages each lane holds
+	int getCapacity();
+	/// Number of lanes
+	int getLanes();
+	/**
+	  Parks the calling thread until a message is pushed
+	  @param timeout is the longest wait (ms, -1 forever)
+	  @return true if there are messages, false on timeout
+	*/
+	bool wait(int timeout);
+	/**
+	  Parks the calling thread until a lane has room for a message
+	  @param msg is the message to push
+	  @param lane is the lane it goes to
+	  @param timeout is the longest wait (ms, -1 forever)
+	  @return true if there is room, false on timeout
+	*/
+	bool waitRoom(SMsg* msg, int lane, int timeout);
+	/**
+	  Gives the wakeup descriptor to be watched by an event loop, readable from
+	  then on whenever there are messages
+	  @return the descriptor (not to be read nor closed)
+	*/
+	int getNotifyFd();
+};
+
+}
+
+using namespace simple;
+
+#endif
@@ -26,6 +26,7 @@
 #include <timing.h>
 #include <sockaddr.h>
 #include <SPeerInfo.h>
+#include <SStream.h>
 
 using namespace std;
 using namespace simple;
@@ -42,6 +43,7 @@ SPeerInfo::SPeerInfo(SBusPeer peer, SocketType socket, int ip, unsigned short po
 
 /// Default Destructor
 SPeerInfo::~SPeerInfo() {
+  dropStreams();
 }
 
 /// IP & port to addr name
@@ -95,3 +97,33 @@ int SPeerInfo::getLastActivity() {
   return lastActivity;
 }
 
+/// Finds a stream being received from the peer (NULL if none)
+SStream* SPeerInfo::findStream(unsigned int stream) {
+  StreamHash::iterator it=streams.find(stream);
+  return (it!=streams.end())?it->second:NULL;
+}
+
+/// Adds a stream being received from the peer
+void SPeerInfo::addStream(unsigned int stream, SStream* sstream) {
+  dropStream(stream);
+  streams[stream]=sstream;
+}
+
+/// Drops a stream being received from the peer
+void SPeerInfo::dropStream(unsigned int stream) {
+  StreamHash::iterator it=streams.find(stream);
+  if(it!=streams.end()) {
+    delete(it->second);
+    streams.erase(it);
+  }
+}
+
+/// Drops every stream being received from the peer (i.e. it disconnected)
+void SPeerInfo::dropStreams() {
+  StreamHash::iterator it;
+  for(it=streams.begin();it!=streams.end();it++) {
+    delete(it->second);
+  }
+  streams.clear();
+}
+
@@ -27,6 +27,7 @@
 #include <iostream>
 
 #include <stcp.h>
+#include <hashdefs.h>
 
 typedef int SBusPeer;
 
@@ -34,6 +35,10 @@ using namespace std;
 
 namespace simple {
 
+class SStream;
+
+typedef hash_map<unsigned int,SStream*> StreamHash;
+
 class SPeerInfo {
   private:
         /// Unique ID for this PeerInfo object
@@ -48,6 +53,8 @@ class SPeerInfo {
 	string name;
 	/// Last Activity
 	int lastActivity;
+	/// Streamed messages being received from the peer, by stream id
+	StreamHash streams;
   public:
 	/// Default Constructor
 	SPeerInfo(SBusPeer peer, SocketType socket, int ip, unsigned short port, string& name);
@@ -69,6 +76,14 @@ static string& ipnport2addr(int ip, unsigned short port);
         string& getAddr();
 	/// Last Activity getter
 	int getLastActivity();
+	/// Finds a stream being received from the peer (NULL if none)
+	SStream* findStream(unsigned int stream);
+	/// Adds a stream being received from the peer
+	void addStream(unsigned int stream, SStream* sstream);
+	/// Drops a stream being received from the peer
+	void dropStream(unsigned int stream);
+	/// Drops every stream being received from the peer (i.e. it disconnected)
+	void dropStreams();
 };
 
 }
@@ -173,6 +173,29 @@ int SPoll::remove(int fd) {
   return 0;
 }
 
+/**
+  Cambia los sucesos vigilados de un file descriptor ya 'bajo vigilancia'
+
+  @param fd es el file descriptor o descriptor de fichero vigilado
+  @param events es la nueva mscara de sucesos a vigilar, compatible com poll() ('man poll')
+
+  @return 0 si todo fue bien y -1 en caso de error o si el fd no se encuentra
+  */
+int SPoll::modify(int fd, short events) {
+  int i;
+  ASSERT(fds!=NULL);
+  ASSERT(fd>0);
+  ASSERT(events!=0);
+  for(i=0;i<capacity;i++) {
+    if(fds[i].fd==fd) {
+      fds[i].events=events;
+      return 0;
+    }
+  }
+  ERROR("fd=%d is not being watched",fd);
+  return -1;
+}
+
 /**
   Realiza el sondeo de sucesos programados
 
@@ -207,8 +230,6 @@ int SPoll::getpolls(struct pollfd** pfds) {
   ASSERT(size>=0);
   ASSERT(capacity>=size);      
   (*pfds)=fds;
-  ERROR(const_cast<char*>("hola"));
-  log_error(const_cast<char*>("hola"));
   return size;
 }
 
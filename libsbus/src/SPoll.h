@@ -67,6 +67,16 @@ class SPoll {
 	*/
 	int remove(int fd);
 	
+	/**
+	Cambia los sucesos vigilados de un file descriptor ya 'bajo vigilancia'
+	
+	@param fd es el file descriptor o descriptor de fichero vigilado
+	@param events es la nueva mscara de sucesos a vigilar, compatible com poll() ('man poll')
+	
+	@return 0 si todo fue bien y -1 en caso de error o si el fd no se encuentra
+	*/
+	int modify(int fd, short events);
+	
 	/**
 	Realiza el sondeo de sucesos programados
 	
@@ -0,0 +1,139 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SReactor.cpp
+   @brief Receive state of one SMessenger reactor (receiving thread)
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <unistd.h>
+
+#include <SMsg.h>
+#include <SReactor.h>
+#include <SURing.h>
+
+using namespace simple;
+
+/// Creates the reactor number index
+SReactor::SReactor(int index) {
+  this->index=index;
+  rotation=0;
+  load=0;
+  uring=NULL;
+  wakeFd=-1;
+}
+
+/// Frees the messages not taken and the ring
+SReactor::~SReactor() {
+  // Closing the ring cancels any operation in flight
+  delete(uring);
+  if(wakeFd>=0) {
+    close(wakeFd);
+  }
+  while(!parsed.empty()) {
+    delete(parsed.front());
+    parsed.pop_front();
+  }
+}
+
+/// Reactor number
+int SReactor::getIndex() {
+  return index;
+}
+
+/// Poller of this reactor's sockets
+SPollType* SReactor::getPoll() {
+  return &spoll;
+}
+
+/// io_uring receive ring (NULL when the poll engine is used)
+SURing* SReactor::getURing() {
+  return uring;
+}
+
+/// Sets the io_uring receive ring (owned by the reactor from then on)
+void SReactor::setURing(SURing* uring) {
+  this->uring=uring;
+}
+
+/// io_uring engine wakeup eventfd (-1 when the poll engine is used)
+int SReactor::getWakeFd() {
+  return wakeFd;
+}
+
+/// Sets the io_uring engine wakeup eventfd (closed by the reactor from then on)
+void SReactor::setWakeFd(int fd) {
+  if(wakeFd>=0) {
+    close(wakeFd);
+  }
+  wakeFd=fd;
+}
+
+/// Queues a parsed message
+void SReactor::queue(SMsg* msg) {
+  parsed.push_back(msg);
+}
+
+/// Pops the next parsed message, if any
+SMsg* SReactor::next() {
+  SMsg* msg=NULL;
+  if(!parsed.empty()) {
+    msg=parsed.front();
+    parsed.pop_front();
+  }
+  return msg;
+}
+
+/// Tells if there are parsed messages waiting
+bool SReactor::hasParsed() {
+  return !parsed.empty();
+}
+
+/// Queues a connection left with complete frames
+void SReactor::addBacklog(SocketType fd) {
+  backlog.push_back(fd);
+}
+
+/// Number of connections on the backlog
+int SReactor::getBacklog() {
+  return backlog.size();
+}
+
+/// Pops the first connection on the backlog
+SocketType SReactor::popBacklog() {
+  SocketType fd=backlog.front();
+  backlog.pop_front();
+  return fd;
+}
+
+/// Ready list start for the next cycle
+unsigned int SReactor::nextRotation() {
+  return rotation++;
+}
+
+/// Connections served
+int SReactor::getLoad() {
+  return load;
+}
+
+/// Counts connections coming (+1) or going (-1)
+void SReactor::addLoad(int delta) {
+  __sync_add_and_fetch(&load,delta);
+}
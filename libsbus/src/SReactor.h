@@ -0,0 +1,113 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SReactor.h
+   @brief Receive state of one SMessenger reactor (receiving thread)
+
+  Each reactor polls its own share of the peer connections and keeps the
+  messages parsed from them until its thread takes them; the first one
+  also serves the TCP server and multicast sockets. A connection belongs
+  to a single reactor for life, so its messages keep their order.
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <deque>
+
+#include <stcp.h>
+#include <SPoll.h>
+#include <SEPoll.h>
+
+#ifndef SREACTOR
+#define SREACTOR
+
+using namespace std;
+
+namespace simple {
+
+class SMsg;
+class SURing;
+
+#ifdef __linux__
+/// epoll() based poller on Linux
+typedef SEPoll SPollType;
+#else
+/// Portable poll() based poller elsewhere
+typedef SPoll SPollType;
+#endif
+
+class SReactor {
+  private:
+	/// Reactor number
+	int index;
+	/// Vigilancia de las conexiones de este reactor
+	SPollType spoll;
+	/// Messages already parsed from the connection buffers, not returned yet
+	deque<SMsg*> parsed;
+	/// Connections left with complete frames after using up their quantum
+	deque<SocketType> backlog;
+	/// Ready list start rotation
+	unsigned int rotation;
+	/// Connections served
+	volatile int load;
+	/// io_uring engine receive ring (NULL when the poll engine is used)
+	SURing* uring;
+	/// io_uring engine wakeup eventfd (-1 when the poll engine is used)
+	int wakeFd;
+  public:
+	/// Creates the reactor number index
+	SReactor(int index);
+	/// Frees the messages not taken and the ring
+	~SReactor();
+	/// Reactor number
+	int getIndex();
+	/// Poller of this reactor's sockets
+	SPollType* getPoll();
+	/// io_uring receive ring (NULL when the poll engine is used)
+	SURing* getURing();
+	/// Sets the io_uring receive ring (owned by the reactor from then on)
+	void setURing(SURing* uring);
+	/// io_uring engine wakeup eventfd (-1 when the poll engine is used)
+	int getWakeFd();
+	/// Sets the io_uring engine wakeup eventfd (closed by the reactor from then on)
+	void setWakeFd(int fd);
+	/// Queues a parsed message
+	void queue(SMsg* msg);
+	/// Pops the next parsed message, if any
+	SMsg* next();
+	/// Tells if there are parsed messages waiting
+	bool hasParsed();
+	/// Queues a connection left with complete frames
+	void addBacklog(SocketType fd);
+	/// Number of connections on the backlog
+	int getBacklog();
+	/// Pops the first connection on the backlog
+	SocketType popBacklog();
+	/// Ready list start for the next cycle
+	unsigned int nextRotation();
+	/// Connections served
+	int getLoad();
+	/// Counts connections coming (+1) or going (-1)
+	void addLoad(int delta);
+};
+
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SSend.cpp
+   @brief Asynchronous send handle, completes once the message is fully
+   written to the peer connection or fails with a reason
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include <sock.h>
+#include <SBufPool.h>
+#include <SSend.h>
+
+using namespace std;
+using namespace simple;
+
+/**
+  Creates the handle for an asynchronous send, copying the message body
+  @param msgtag is the message code to send
+  @param peer is the destination peer
+  @param iov are the message fragments
+  @param iovcnt is the number of fragments
+*/
+SSend::SSend(int msgtag, int peer, const struct iovec* iov, int iovcnt) {
+  pthread_condattr_t attr;
+  int i;
+  int at=0;
+  this->msgtag=msgtag;
+  this->peer=peer;
+  bytes=0;
+  for(i=0;i<iovcnt;i++) {
+    bytes+=iov[i].iov_len;
+  }
+  if((body=SBufPool::alloc((bytes>0)?bytes:1))==NULL) {
+    throw new string("Could not copy the message body for SSend object");
+  }
+  for(i=0;i<iovcnt;i++) {
+    memcpy(&body->data()[at],iov[i].iov_base,iov[i].iov_len);
+    at+=iov[i].iov_len;
+  }
+  refs=1;
+  done=false;
+  error=0;
+  pthread_mutex_init(&mutex, NULL);
+  // Timeouts are taken from the monotonic clock
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/// Frees the body copy
+SSend::~SSend() {
+  body->unref();
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+/// Takes one more reference
+void SSend::ref() {
+  __sync_add_and_fetch(&refs,1);
+}
+
+/// Drops a reference, the last one frees the handle
+void SSend::unref() {
+  if(__sync_sub_and_fetch(&refs,1)==0) {
+    delete(this);
+  }
+}
+
+/// Message code getter
+int SSend::getMsgTag() {
+  return msgtag;
+}
+
+/// Destination peer getter
+int SSend::getPeer() {
+  return peer;
+}
+
+/// Gets the message body as a single fragment
+void SSend::getBody(struct iovec* iov) {
+  iov->iov_base=body->data();
+  iov->iov_len=bytes;
+}
+
+/**
+  Completes the send, waking up whoever waits for it (only the first call counts)
+  @param error is 0 if the message was written or the failure reason (errno value)
+*/
+void SSend::complete(int error) {
+  pthread_mutex_lock(&mutex);
+  if(!done) {
+    done=true;
+    this->error=error;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+/// Tells if the send was completed
+bool SSend::isDone() {
+  return done;
+}
+
+/// Failure reason (errno value), 0 if the message was written or it is still in progress
+int SSend::getError() {
+  return error;
+}
+
+/**
+  Waits for the send to complete
+  @param timeout is the maximum time to wait in ms (negative waits forever)
+  @return 0 if the message was written, -1 if it failed (errno is set to the
+    reason) or SOCK_TIMEOUT if it is still in progress
+*/
+int SSend::wait(int timeout) {
+  struct timespec until;
+  int res=0;
+  if(timeout>0) {
+    clock_gettime(CLOCK_MONOTONIC,&until);
+    until.tv_sec+=timeout/1000;
+    until.tv_nsec+=(timeout%1000)*1000000;
+    if(until.tv_nsec>=1000000000) {
+      until.tv_sec++;
+      until.tv_nsec-=1000000000;
+    }
+  }
+  pthread_mutex_lock(&mutex);
+  while(!done&&(timeout!=0)&&(res!=ETIMEDOUT)) {
+    if(timeout<0) {
+      pthread_cond_wait(&cond,&mutex);
+    } else {
+      res=pthread_cond_timedwait(&cond,&mutex,&until);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  if(!done) {
+    return SOCK_TIMEOUT;
+  }
+  if(error!=0) {
+    errno=error;
+    return -1;
+  }
+  return 0;
+}
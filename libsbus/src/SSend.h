@@ -0,0 +1,100 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SSend.h
+   @brief Asynchronous send handle, completes once the message is fully
+   written to the peer connection or fails with a reason
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include <sbusdefs.h>
+#include <SBuf.h>
+
+#ifndef SSEND
+#define SSEND
+
+namespace simple {
+
+class SSend {
+  private:
+	/// References held (the application, the sender thread and the connection)
+	volatile int refs;
+	/// Message code
+	int msgtag;
+	/// Destination peer
+	int peer;
+	/// Message body (a copy, the caller does not have to keep it)
+	SBuf* body;
+	/// Message body length
+	int bytes;
+	/// The message was written or failed
+	bool done;
+	/// Failure reason (errno value), 0 if written
+	int error;
+	/// Completion mutex
+	pthread_mutex_t mutex;
+	/// Signals the completion
+	pthread_cond_t cond;
+  public:
+	/**
+	  Creates the handle for an asynchronous send, copying the message body
+	  @param msgtag is the message code to send
+	  @param peer is the destination peer
+	  @param iov are the message fragments
+	  @param iovcnt is the number of fragments
+	*/
+	SSend(int msgtag, int peer, const struct iovec* iov, int iovcnt);
+	/// Frees the body copy
+	~SSend();
+	/// Takes one more reference
+	void ref();
+	/// Drops a reference, the last one frees the handle
+	void unref();
+	/// Message code getter
+	int getMsgTag();
+	/// Destination peer getter
+	int getPeer();
+	/// Gets the message body as a single fragment
+	void getBody(struct iovec* iov);
+	/**
+	  Completes the send, waking up whoever waits for it (only the first call counts)
+	  @param error is 0 if the message was written or the failure reason (errno value)
+	*/
+	void complete(int error);
+	/// Tells if the send was completed
+	bool isDone();
+	/// Failure reason (errno value), 0 if the message was written or it is still in progress
+	int getError();
+	/**
+	  Waits for the send to complete
+	  @param timeout is the maximum time to wait in ms (negative waits forever)
+	  @return 0 if the message was written, -1 if it failed (errno is set to the
+	    reason) or SOCK_TIMEOUT if it is still in progress
+	*/
+	int wait(int timeout);
+};
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SStream.cpp
+   @brief Streamed messages: bodies of any size sent as a begin frame, bounded
+   chunk frames and an end frame, and their state on the receiving side
+   (reassembled into a pooled buffer or handed to the application in parts)
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <string>
+
+#include <errdefs.h>
+#include <sbusdefs.h>
+#include <SBufPool.h>
+#include <SStream.h>
+
+using namespace std;
+using namespace simple;
+
+/**
+  Packs a stream frame header
+  @param hdr is the header to fill
+  @param stream is the stream id
+  @param msgtag is the message code of the streamed message
+  @param value is the frame value (see sstream_header)
+*/
+void SStream::pack(sstream_header* hdr, unsigned int stream, int msgtag, long long int value) {
+  hdr->stream=htonl(stream);
+  hdr->msgtag=htonl((unsigned int)msgtag);
+  hdr->valueHi=htonl((unsigned int)((unsigned long long)value>>32));
+  hdr->valueLo=htonl((unsigned int)value);
+}
+
+/**
+  Unpacks a stream frame
+  @param frame is the frame body
+  @param pstream is filled with the stream id
+  @param pmsgtag is filled with the message code of the streamed message
+  @param pvalue is filled with the frame value (see sstream_header)
+  @param chunk is left referencing the chunk bytes
+  @return 0 on success or -1 if the frame is too short
+*/
+int SStream::unpack(SBufSlice& frame, unsigned int* pstream, int* pmsgtag,
+  long long int* pvalue, SBufSlice& chunk) {
+  sstream_header hdr;
+  if(frame.size()<(int)SSTREAM_HDRLEN) {
+    return -1;
+  }
+  // Chunks start anywhere on the receive buffer, the header may be unaligned
+  memcpy(&hdr,frame.data(),SSTREAM_HDRLEN);
+  *pstream=ntohl(hdr.stream);
+  *pmsgtag=(int)ntohl(hdr.msgtag);
+  *pvalue=(long long int)(((unsigned long long)ntohl(hdr.valueHi)<<32)|ntohl(hdr.valueLo));
+  chunk=frame.sub(SSTREAM_HDRLEN,frame.size()-SSTREAM_HDRLEN);
+  return 0;
+}
+
+/**
+  Creates the receiving state of a stream
+  @param msgtag is the message code of the streamed message
+  @param total is the message length announced by the sender (-1 unknown)
+  @param reassembleBytes is the biggest message reassembled, bigger ones
+    are handed in parts (0 hands them all in parts)
+*/
+SStream::SStream(int msgtag, long long int total, int reassembleBytes) {
+  this->msgtag=msgtag;
+  this->total=total;
+  received=0;
+  limit=reassembleBytes;
+  buf=NULL;
+  capacity=0;
+  if((reassembleBytes<=0)||(total>reassembleBytes)) {
+    return;
+  }
+  // Known lengths take a single buffer, unknown ones grow as chunks arrive
+  capacity=(total>=0)?(int)total:
+    ((reassembleBytes<SBUS_STREAM_CHUNK_BYTES)?reassembleBytes:SBUS_STREAM_CHUNK_BYTES);
+  if((buf=SBufPool::alloc((capacity>0)?capacity:1))==NULL) {
+    throw new string("Could not create reassembly buffer for SStream object");
+  }
+  capacity=buf->getCapacity();
+}
+
+/// Drops the reassembly buffer
+SStream::~SStream() {
+  if(buf!=NULL) {
+    buf->unref();
+  }
+}
+
+/// Message code getter
+int SStream::getMsgTag() {
+  return msgtag;
+}
+
+/// Message length announced by the sender (-1 unknown)
+long long int SStream::getTotal() {
+  return total;
+}
+
+/// Bytes received so far
+long long int SStream::getReceived() {
+  return received;
+}
+
+/// Tells if the message is reassembled (or handed in parts)
+bool SStream::isReassembled() {
+  return buf!=NULL;
+}
+
+/// Moves the reassembled bytes to a bigger buffer
+int SStream::grow(long long int size) {
+  long long int needed=(size>2*(long long int)capacity)?size:2*(long long int)capacity;
+  SBuf* newbuf;
+  if(size>limit) {
+    errno=EMSGSIZE;
+    return -1;
+  }
+  if(needed>limit) {
+    needed=limit;
+  }
+  RET_ON_FALSE(((newbuf=SBufPool::alloc((int)needed))!=NULL));
+  memcpy(newbuf->data(),buf->data(),received);
+  buf->unref();
+  buf=newbuf;
+  capacity=buf->getCapacity();
+  return 0;
+}
+
+/**
+  Takes a chunk, copying it to the reassembly buffer if reassembled
+  @return 0 on success or -1 if the message gets longer than announced
+    or than the reassembly limit (errno EMSGSIZE)
+*/
+int SStream::add(SBufSlice& chunk) {
+  long long int size=received+chunk.size();
+  if((total>=0)&&(size>total)) {
+    errno=EMSGSIZE;
+    return -1;
+  }
+  if(buf!=NULL) {
+    if((size>capacity)&&(grow(size)<0)) {
+      return -1;
+    }
+    memcpy(&buf->data()[received],chunk.data(),chunk.size());
+  }
+  received=size;
+  return 0;
+}
+
+/// The reassembled message, sharing the reassembly buffer
+SBufSlice SStream::take() {
+  if(buf==NULL) {
+    return SBufSlice();
+  }
+  return SBufSlice(buf,0,(int)received);
+}
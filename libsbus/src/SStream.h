@@ -0,0 +1,125 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SStream.h
+   @brief Streamed messages: bodies of any size sent as a begin frame, bounded
+   chunk frames and an end frame, and their state on the receiving side
+   (reassembled into a pooled buffer or handed to the application in parts)
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <SBuf.h>
+
+#ifndef SSTREAM
+#define SSTREAM
+
+/// System message tag of a stream begin frame
+#define SSTREAM_BEGIN -3
+/// System message tag of a stream chunk frame
+#define SSTREAM_CHUNK -4
+/// System message tag of a stream end frame
+#define SSTREAM_END   -5
+
+/// Stream frames header, laid before the chunk bytes
+typedef struct sstream_header {
+  /// Stream id, unique per sender
+  unsigned int stream;
+  /// Message code of the streamed message
+  int msgtag;
+  /// Frame value high half: begin, the message length (-1 unknown);
+  /// chunk, its offset on the message; end, the bytes sent (-1 cancelled)
+  unsigned int valueHi;
+  /// Frame value low half
+  unsigned int valueLo;
+} sstream_header;
+
+/// Stream frames header length
+#define SSTREAM_HDRLEN sizeof(sstream_header)
+
+namespace simple {
+
+class SStream {
+  private:
+	/// Message code of the streamed message
+	int msgtag;
+	/// Message length announced by the sender (-1 unknown)
+	long long int total;
+	/// Bytes received so far
+	long long int received;
+	/// Biggest message reassembled
+	int limit;
+	/// Reassembly buffer (NULL if the message is handed in parts)
+	SBuf* buf;
+	/// Reassembly buffer capacity
+	int capacity;
+	/// Moves the reassembled bytes to a bigger buffer
+	int grow(long long int size);
+  public:
+	/**
+	  Packs a stream frame header
+	  @param hdr is the header to fill
+	  @param stream is the stream id
+	  @param msgtag is the message code of the streamed message
+	  @param value is the frame value (see sstream_header)
+	*/
+	static void pack(sstream_header* hdr, unsigned int stream, int msgtag, long long int value);
+	/**
+	  Unpacks a stream frame
+	  @param frame is the frame body
+	  @param pstream is filled with the stream id
+	  @param pmsgtag is filled with the message code of the streamed message
+	  @param pvalue is filled with the frame value (see sstream_header)
+	  @param chunk is left referencing the chunk bytes
+	  @return 0 on success or -1 if the frame is too short
+	*/
+	static int unpack(SBufSlice& frame, unsigned int* pstream, int* pmsgtag,
+	  long long int* pvalue, SBufSlice& chunk);
+	/**
+	  Creates the receiving state of a stream
+	  @param msgtag is the message code of the streamed message
+	  @param total is the message length announced by the sender (-1 unknown)
+	  @param reassembleBytes is the biggest message reassembled, bigger ones
+	    are handed in parts (0 hands them all in parts)
+	*/
+	SStream(int msgtag, long long int total, int reassembleBytes);
+	/// Drops the reassembly buffer
+	~SStream();
+	/// Message code getter
+	int getMsgTag();
+	/// Message length announced by the sender (-1 unknown)
+	long long int getTotal();
+	/// Bytes received so far
+	long long int getReceived();
+	/// Tells if the message is reassembled (or handed in parts)
+	bool isReassembled();
+	/**
+	  Takes a chunk, copying it to the reassembly buffer if reassembled
+	  @return 0 on success or -1 if the message gets longer than announced
+	    or than the reassembly limit (errno EMSGSIZE)
+	*/
+	int add(SBufSlice& chunk);
+	/// The reassembled message, sharing the reassembly buffer
+	SBufSlice take();
+};
+
+}
+
+#endif
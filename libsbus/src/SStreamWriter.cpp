@@ -0,0 +1,159 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SStreamWriter.cpp
+   @brief Sending side of a streamed message: pushes a body of any size to a
+   peer as bounded chunks, with a few of them in flight at most
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <errno.h>
+
+#include <string>
+
+#include <errdefs.h>
+#include <sbusdefs.h>
+#include <SMessenger.h>
+#include <SStreamWriter.h>
+
+using namespace std;
+using namespace simple;
+
+/**
+  Begins a streamed message, sending its begin frame
+  @param smessenger is the messager sending the frames
+  @param socket is the connection to the peer
+  @param stream is the stream id
+  @param msgtag is the message code of the streamed message
+  @param total is the message length, if known (-1 unknown)
+*/
+SStreamWriter::SStreamWriter(SMessenger* smessenger, SocketType socket, unsigned int stream,
+  int msgtag, long long int total) {
+  this->smessenger=smessenger;
+  this->socket=socket;
+  this->stream=stream;
+  this->msgtag=msgtag;
+  this->total=(total>=0)?total:-1;
+  written=0;
+  closed=false;
+  if(sendFrame(SSTREAM_BEGIN,this->total,NULL,0,NULL)<0) {
+    throw new string("Could not send the begin frame for SStreamWriter object");
+  }
+}
+
+/// Cancels the stream, if not closed
+SStreamWriter::~SStreamWriter() {
+  if(!closed) {
+    sendFrame(SSTREAM_END,-1,NULL,0,NULL);
+  }
+  while(!window.empty()) {
+    window.front()->unref();
+    window.pop_front();
+  }
+}
+
+/// Stream id getter
+unsigned int SStreamWriter::getStream() {
+  return stream;
+}
+
+/// Bytes written so far
+long long int SStreamWriter::getWritten() {
+  return written;
+}
+
+/// Sends a stream frame
+int SStreamWriter::sendFrame(int frametag, long long int value, const char* data, int bytes,
+  SSend* done) {
+  sstream_header hdr;
+  struct iovec iov[2];
+  SStream::pack(&hdr,stream,msgtag,value);
+  iov[0].iov_base=&hdr;
+  iov[0].iov_len=SSTREAM_HDRLEN;
+  iov[1].iov_base=(void*)data;
+  iov[1].iov_len=bytes;
+  return smessenger->send(frametag,socket,iov,(bytes>0)?2:1,done);
+}
+
+/// Waits until no more than max chunks are in flight
+int SStreamWriter::waitWindow(unsigned int max) {
+  int res;
+  while(window.size()>max) {
+    res=window.front()->wait(-1);
+    window.front()->unref();
+    window.pop_front();
+    if(res<0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+  Writes more of the message, in chunks of up to SBUS_STREAM_CHUNK_BYTES;
+  it blocks while SBUS_STREAM_WINDOW chunks wait on the connection
+  @param data are the bytes to write (they can be reused on return)
+  @param bytes is the number of bytes
+  @return 0 on success or -1 on error (errno EMSGSIZE if longer than announced)
+*/
+int SStreamWriter::write(const char* data, long long int bytes) {
+  SSend* done;
+  int chunk;
+  if(closed) {
+    errno=EPIPE;
+    return -1;
+  }
+  if((total>=0)&&(written+bytes>total)) {
+    ERROR("Stream %u longer than announced (%lld bytes)",stream,total);
+    errno=EMSGSIZE;
+    return -1;
+  }
+  while(bytes>0) {
+    chunk=(bytes>SBUS_STREAM_CHUNK_BYTES)?SBUS_STREAM_CHUNK_BYTES:(int)bytes;
+    // Chunks in flight are bounded, so the peer sets the pace and not the high watermark
+    RET_ON_ERROR(waitWindow(SBUS_STREAM_WINDOW-1));
+    try {
+      done=new SSend(SSTREAM_CHUNK,-1,NULL,0);
+    } catch(string* s) {
+      ERROR("Could not write stream %u: %s",stream,s->c_str());
+      delete(s);
+      return -1;
+    }
+    window.push_back(done);
+    RET_ON_ERROR(sendFrame(SSTREAM_CHUNK,written,data,chunk,done));
+    written+=chunk;
+    data+=chunk;
+    bytes-=chunk;
+  }
+  return 0;
+}
+
+/**
+  Ends the stream, sending its end frame
+  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 on error
+*/
+int SStreamWriter::close() {
+  if(closed) {
+    return SBUS_SENT;
+  }
+  closed=true;
+  return sendFrame(SSTREAM_END,written,NULL,0,NULL);
+}
@@ -0,0 +1,99 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SStreamWriter.h
+   @brief Sending side of a streamed message: pushes a body of any size to a
+   peer as bounded chunks, with a few of them in flight at most
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <deque>
+
+#include <stcp.h>
+#include <SSend.h>
+#include <SStream.h>
+
+#ifndef SSTREAMWRITER
+#define SSTREAMWRITER
+
+using namespace std;
+
+namespace simple {
+
+class SMessenger;
+
+class SStreamWriter {
+  private:
+	/// The messager sending the frames
+	SMessenger* smessenger;
+	/// Connection to the peer
+	SocketType socket;
+	/// Stream id
+	unsigned int stream;
+	/// Message code of the streamed message
+	int msgtag;
+	/// Message length announced (-1 unknown)
+	long long int total;
+	/// Bytes written so far
+	long long int written;
+	/// The end frame was sent
+	bool closed;
+	/// Chunks not written to the connection yet, oldest first
+	deque<SSend*> window;
+	/// Sends a stream frame
+	int sendFrame(int frametag, long long int value, const char* data, int bytes, SSend* done);
+	/// Waits until no more than max chunks are in flight
+	int waitWindow(unsigned int max);
+  public:
+	/**
+	  Begins a streamed message, sending its begin frame
+	  @param smessenger is the messager sending the frames
+	  @param socket is the connection to the peer
+	  @param stream is the stream id
+	  @param msgtag is the message code of the streamed message
+	  @param total is the message length, if known (-1 unknown)
+	*/
+	SStreamWriter(SMessenger* smessenger, SocketType socket, unsigned int stream,
+	  int msgtag, long long int total);
+	/// Cancels the stream, if not closed
+	~SStreamWriter();
+	/// Stream id getter
+	unsigned int getStream();
+	/// Bytes written so far
+	long long int getWritten();
+	/**
+	  Writes more of the message, in chunks of up to SBUS_STREAM_CHUNK_BYTES;
+	  it blocks while SBUS_STREAM_WINDOW chunks wait on the connection
+	  @param data are the bytes to write (they can be reused on return)
+	  @param bytes is the number of bytes
+	  @return 0 on success or -1 on error (errno EMSGSIZE if longer than announced)
+	*/
+	int write(const char* data, long long int bytes);
+	/**
+	  Ends the stream, sending its end frame
+	  @return SBUS_SENT, SBUS_QUEUED (waits on the peer outbound queue) or -1 on error
+	*/
+	int close();
+};
+
+}
+
+#endif
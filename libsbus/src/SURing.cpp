@@ -0,0 +1,280 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** SURing.cpp
+   @brief Minimal io_uring wrapper (raw syscalls, no liburing needed)
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <string>
+
+#include <errdefs.h>
+#include <timing.h>
+#include <SURing.h>
+
+using namespace std;
+using namespace simple;
+
+/// io_uring_setup() syscall
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+/// io_uring_enter() syscall
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete,
+  unsigned flags, void* arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argsz);
+}
+
+/// io_uring_register() syscall
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/**
+  Creates an io_uring
+  @param entries is the submission queue size
+  (throws a string* exception if io_uring is not available)
+*/
+SURing::SURing(unsigned entries) {
+  struct io_uring_params p;
+  bzero(&p,sizeof(p));
+  bzero(groups,sizeof(groups));
+  sqPtr=cqPtr=MAP_FAILED;
+  sqes=(struct io_uring_sqe*)MAP_FAILED;
+  if((ringfd=sys_io_uring_setup(entries,&p))<0) {
+    throw new string("io_uring_setup() failed");
+  }
+  // Timed waits and a single mapping for both rings are required
+  if(!(p.features&IORING_FEAT_EXT_ARG)||!(p.features&IORING_FEAT_SINGLE_MMAP)) {
+    close(ringfd);
+    throw new string("io_uring lacks needed features");
+  }
+  sqSize=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  cqSize=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if(cqSize>sqSize) {
+    sqSize=cqSize;
+  }
+  cqSize=sqSize;
+  sqPtr=mmap(0,sqSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringfd,IORING_OFF_SQ_RING);
+  sqesSize=p.sq_entries*sizeof(struct io_uring_sqe);
+  sqes=(struct io_uring_sqe*)mmap(0,sqesSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+    ringfd,IORING_OFF_SQES);
+  if((sqPtr==MAP_FAILED)||(sqes==MAP_FAILED)) {
+    if(sqPtr!=MAP_FAILED) munmap(sqPtr,sqSize);
+    if(sqes!=MAP_FAILED) munmap(sqes,sqesSize);
+    close(ringfd);
+    throw new string("io_uring mmap() failed");
+  }
+  cqPtr=sqPtr;
+  sqHead=(unsigned*)((char*)sqPtr+p.sq_off.head);
+  sqTail=(unsigned*)((char*)sqPtr+p.sq_off.tail);
+  sqMask=(unsigned*)((char*)sqPtr+p.sq_off.ring_mask);
+  sqArray=(unsigned*)((char*)sqPtr+p.sq_off.array);
+  cqHead=(unsigned*)((char*)cqPtr+p.cq_off.head);
+  cqTail=(unsigned*)((char*)cqPtr+p.cq_off.tail);
+  cqMask=(unsigned*)((char*)cqPtr+p.cq_off.ring_mask);
+  cqes=(struct io_uring_cqe*)((char*)cqPtr+p.cq_off.cqes);
+  sqLocalTail=*sqTail;
+  pthread_mutex_init(&sqMutex,NULL);
+  DEBUG("suring: fd=%d sq=%d cq=%d entries",ringfd,p.sq_entries,p.cq_entries);
+}
+
+/// Unregisters buffers and closes the ring
+SURing::~SURing() {
+  int i;
+  for(i=0;i<SURING_MAX_GROUPS;i++) {
+    if(groups[i].ring!=NULL) {
+      struct io_uring_buf_reg reg;
+      bzero(&reg,sizeof(reg));
+      reg.bgid=i;
+      sys_io_uring_register(ringfd,IORING_UNREGISTER_PBUF_RING,&reg,1);
+      free(groups[i].ring);
+      free(groups[i].base);
+    }
+  }
+  munmap(sqes,sqesSize);
+  munmap(sqPtr,sqSize);
+  close(ringfd);
+  pthread_mutex_destroy(&sqMutex);
+}
+
+/// Locks the submission queue (needed when several threads submit)
+void SURing::lock() {
+  pthread_mutex_lock(&sqMutex);
+}
+
+/// Unlocks the submission queue
+void SURing::unlock() {
+  pthread_mutex_unlock(&sqMutex);
+}
+
+/// Ring descriptor (i.e. for IORING_OP_MSG_RING)
+int SURing::getFd() {
+  return ringfd;
+}
+
+/**
+  Gets a clean submission entry
+  @return the entry or NULL if the submission queue is full
+*/
+struct io_uring_sqe* SURing::getSqe() {
+  unsigned head=__atomic_load_n(sqHead,__ATOMIC_ACQUIRE);
+  if(sqLocalTail-head>=(*sqMask)+1) {
+    return NULL;
+  }
+  unsigned idx=sqLocalTail&(*sqMask);
+  struct io_uring_sqe* sqe=&sqes[idx];
+  bzero(sqe,sizeof(struct io_uring_sqe));
+  sqArray[idx]=idx;
+  sqLocalTail++;
+  return sqe;
+}
+
+/**
+  Hands the prepared entries to the kernel and optionally waits for completions
+  @param waitNr is the number of completions to wait for
+  @param timeout is the maximum wait in ms (<0 forever)
+  @return the number of entries submitted, 0 on timeout or -1 on error
+*/
+int SURing::submit(unsigned waitNr, int timeout) {
+  int res;
+  unsigned flags=0;
+  unsigned toSubmit;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  pthread_mutex_lock(&sqMutex);
+  toSubmit=sqLocalTail-*sqTail;
+  __atomic_store_n(sqTail,sqLocalTail,__ATOMIC_RELEASE);
+  pthread_mutex_unlock(&sqMutex);
+  bzero(&arg,sizeof(arg));
+  if(waitNr>0) {
+    flags|=IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+    if(timeout>=0) {
+      ts.tv_sec=timeout/1000;
+      ts.tv_nsec=(timeout%1000)*1000000LL;
+      arg.ts=(unsigned long long)&ts;
+    }
+  }
+  if((res=sys_io_uring_enter(ringfd,toSubmit,waitNr,flags,
+      (flags&IORING_ENTER_EXT_ARG)?&arg:NULL,sizeof(arg)))<0) {
+    if((errno==ETIME)||(errno==EINTR)||(errno==EAGAIN)||(errno==EBUSY)) {
+      return 0;
+    }
+    PERROR("Error io_uring_enter()");
+    return -1;
+  }
+  return res;
+}
+
+/**
+  Gives the next completion, if any
+  @return the completion entry or NULL if none is ready
+*/
+struct io_uring_cqe* SURing::peekCqe() {
+  unsigned head=*cqHead;
+  if(head==__atomic_load_n(cqTail,__ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &cqes[head&(*cqMask)];
+}
+
+/// Marks the completion returned by peekCqe() as consumed
+void SURing::seenCqe() {
+  __atomic_store_n(cqHead,(*cqHead)+1,__ATOMIC_RELEASE);
+}
+
+/**
+  Registers a provided buffer group
+  @param bgid is the group id (0..SURING_MAX_GROUPS-1)
+  @param count is the number of buffers (power of 2)
+  @param size is each buffer size
+  @return 0 on success or -1 on error
+*/
+int SURing::addBuffers(int bgid, int count, int size) {
+  struct io_uring_buf_reg reg;
+  SURingBufGroup* g;
+  int i;
+  ASSERT((bgid>=0)&&(bgid<SURING_MAX_GROUPS));
+  ASSERT((count>0)&&((count&(count-1))==0));
+  g=&groups[bgid];
+  RET_ON_FALSE((posix_memalign((void**)&g->ring,getpagesize(),
+    count*sizeof(struct io_uring_buf))==0));
+  if((g->base=(char*)malloc((size_t)count*size))==NULL) {
+    free(g->ring);
+    g->ring=NULL;
+    return -1;
+  }
+  bzero(g->ring,count*sizeof(struct io_uring_buf));
+  bzero(&reg,sizeof(reg));
+  reg.ring_addr=(unsigned long long)g->ring;
+  reg.ring_entries=count;
+  reg.bgid=bgid;
+  if(sys_io_uring_register(ringfd,IORING_REGISTER_PBUF_RING,&reg,1)<0) {
+    PERROR("Error io_uring_register(PBUF_RING)");
+    free(g->ring);
+    free(g->base);
+    g->ring=NULL;
+    g->base=NULL;
+    return -1;
+  }
+  g->size=size;
+  g->count=count;
+  g->tail=0;
+  for(i=0;i<count;i++) {
+    struct io_uring_buf* buf=&SURING_BUFS(g->ring)[i];
+    buf->addr=(unsigned long long)&g->base[(size_t)i*size];
+    buf->len=size;
+    buf->bid=i;
+  }
+  g->tail=count;
+  __atomic_store_n(&g->ring->tail,g->tail,__ATOMIC_RELEASE);
+  return 0;
+}
+
+/// Gives the buffer memory for a buffer id of a group
+char* SURing::getBuffer(int bgid, int bid) {
+  return &groups[bgid].base[(size_t)bid*groups[bgid].size];
+}
+
+/// Gives the buffer size of a group
+int SURing::getBufferSize(int bgid) {
+  return groups[bgid].size;
+}
+
+/// Returns a buffer to its group once its data was consumed
+void SURing::recycleBuffer(int bgid, int bid) {
+  SURingBufGroup* g=&groups[bgid];
+  struct io_uring_buf* buf=&SURING_BUFS(g->ring)[g->tail&(g->count-1)];
+  buf->addr=(unsigned long long)getBuffer(bgid,bid);
+  buf->len=g->size;
+  buf->bid=bid;
+  g->tail++;
+  __atomic_store_n(&g->ring->tail,g->tail,__ATOMIC_RELEASE);
+}
@@ -0,0 +1,141 @@
+/*
+      SBUS library:
+      Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** @file SURing.h
+   @brief Minimal io_uring wrapper (raw syscalls, no liburing needed)
+
+   Submission/completion rings plus provided buffer rings, just what SMessenger's
+   io_uring engine needs (Linux only)<p>
+
+  Jos Luis Vzquez Gonzlez <josvazg@terra.es><br>
+  LGPL
+*/
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#ifndef SURING
+#define SURING
+
+/// Maximum provided buffer groups per ring
+#define SURING_MAX_GROUPS 4
+
+namespace simple {
+
+/**
+  Buffer ring entries; the ring tail overlays the first entry, but the header
+  flexible array gets a bogus offset when compiled as C++ (empty struct)
+*/
+#define SURING_BUFS(ring) ((struct io_uring_buf*)(ring))
+
+/// A provided buffer group (kernel picks a buffer from it on each receive)
+typedef struct SURingBufGroup {
+	/// Buffer ring shared with the kernel
+	struct io_uring_buf_ring* ring;
+	/// Buffers memory
+	char* base;
+	/// Size of each buffer
+	int size;
+	/// Number of buffers (power of 2)
+	int count;
+	/// Local copy of the ring tail
+	unsigned short tail;
+} SURingBufGroup;
+
+class SURing {
+  private:
+	/// io_uring descriptor
+	int ringfd;
+	/// Submission queue mapping
+	void* sqPtr;
+	/// Submission queue mapping size
+	size_t sqSize;
+	/// Completion queue mapping (may be the same as sqPtr)
+	void* cqPtr;
+	/// Completion queue mapping size
+	size_t cqSize;
+	/// Submission entries
+	struct io_uring_sqe* sqes;
+	/// Submission entries mapping size
+	size_t sqesSize;
+	/// Submission queue head, tail, mask and index array
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	/// Submission entries prepared but not handed to the kernel yet
+	unsigned sqLocalTail;
+	/// Completion queue head, tail and mask
+	unsigned *cqHead, *cqTail, *cqMask;
+	/// Completion entries
+	struct io_uring_cqe* cqes;
+	/// Provided buffer groups
+	SURingBufGroup groups[SURING_MAX_GROUPS];
+	/// Serializes submission queue producers
+	pthread_mutex_t sqMutex;
+  public:
+	/**
+	  Creates an io_uring
+	  @param entries is the submission queue size
+	  (throws a string* exception if io_uring is not available)
+	*/
+	SURing(unsigned entries);
+	/// Unregisters buffers and closes the ring
+	~SURing();
+	/// Locks the submission queue (needed when several threads submit)
+	void lock();
+	/// Unlocks the submission queue
+	void unlock();
+	/// Ring descriptor (i.e. for IORING_OP_MSG_RING)
+	int getFd();
+	/**
+	  Gets a clean submission entry
+	  @return the entry or NULL if the submission queue is full
+	*/
+	struct io_uring_sqe* getSqe();
+	/**
+	  Hands the prepared entries to the kernel and optionally waits for completions
+	  @param waitNr is the number of completions to wait for
+	  @param timeout is the maximum wait in ms (<0 forever)
+	  @return the number of entries submitted, 0 on timeout or -1 on error
+	*/
+	int submit(unsigned waitNr, int timeout);
+	/**
+	  Gives the next completion, if any
+	  @return the completion entry or NULL if none is ready
+	*/
+	struct io_uring_cqe* peekCqe();
+	/// Marks the completion returned by peekCqe() as consumed
+	void seenCqe();
+	/**
+	  Registers a provided buffer group
+	  @param bgid is the group id (0..SURING_MAX_GROUPS-1)
+	  @param count is the number of buffers (power of 2)
+	  @param size is each buffer size
+	  @return 0 on success or -1 on error
+	*/
+	int addBuffers(int bgid, int count, int size);
+	/// Gives the buffer memory for a buffer id of a group
+	char* getBuffer(int bgid, int bid);
+	/// Gives the buffer size of a group
+	int getBufferSize(int bgid);
+	/// Returns a buffer to its group once its data was consumed
+	void recycleBuffer(int bgid, int bid);
+};
+
+}
+
+#endif
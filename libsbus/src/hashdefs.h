@@ -26,6 +26,9 @@
 
 using namespace std;
 
+#ifndef HASHDEFS
+#define HASHDEFS
+
 /// Soporte de strings como claves de Hashmaps de STL
 #define STL_HASHMAP_SUPPORT_STRING_KEYS_GCC3 \
 namespace __gnu_cxx { \
@@ -48,3 +51,5 @@ template<> struct hash<string> { \
   #include <hash_map>
   STL_HASHMAP_SUPPORT_STRING_KEYS_GCC29X;
 #endif
+
+#endif
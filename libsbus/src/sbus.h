@@ -26,6 +26,9 @@
   LGPL
 */
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 /// Tamao mximo del nombre
 #define MAX_NAME_SIZE 512
 /// IP Multicast por defecto
@@ -58,6 +61,12 @@ extern "C" {
 /// Definicin de tipo opaca
 typedef struct SBusTypedef *SBusType;
 
+/// Envo asncrono, definicin de tipo opaca
+typedef struct SBusSendTypedef *SBusSendType;
+
+/// Mensaje enviado por trozos, definicin de tipo opaca
+typedef struct SBusStreamTypedef *SBusStreamType;
+
 /// Backward compatibility
 typedef int SBusChType;
 
@@ -73,6 +82,25 @@ typedef int SBusChType;
  */
 SBusType sbus_create(char *device, char* mcip, int mcport);
 
+/**
+ Fills the default SBus creation options
+
+ @param options is the options struct to fill
+*/
+void sbus_defaultOptions(SBusOptions* options);
+
+/**
+ Creates a SBus binding with custom options
+
+ @param device is the net interface to work on
+ @param mcip is the SBus multicast IP to bind to
+ @param mcport is the SBus multicast port to bind to
+ @param options are the creation options (start from sbus_defaultOptions())
+
+ @return the SBus binding or NULL on error
+ */
+SBusType sbus_createWith(char *device, char* mcip, int mcport, SBusOptions* options);
+
 /**
  Envia datos por SBUS Multicast
 
@@ -81,10 +109,49 @@ SBusType sbus_create(char *device, char* mcip, int mcport);
  @param data son los datos del mensaje
  @param bytes es el tamao de data
 
- @return el nmero de bytes enviados en caso de xito o -1 en caso de error
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si espera en la ventana de
+   agrupamiento (ver SBusOptions.mcastBatchUs) o -1 en caso de error; solo un
+   valor negativo es un error
 */
 int sbus_mcsend(SBusType sbus, int msgtag, char *data, int bytes);
 
+/**
+ Enva datos por SBUS Multicast tomndolos de varios fragmentos, sin copiarlos
+
+ @param sbus es el enlace SBUS
+ @param msgtag es un cdigo identificativo del tipo de mensaje enviado
+ @param iov son los fragmentos del mensaje
+ @param iovcnt es el nmero de fragmentos
+
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si espera en la ventana de
+   agrupamiento (ver SBusOptions.mcastBatchUs) o -1 en caso de error; solo un
+   valor negativo es un error
+*/
+int sbus_mcsendv(SBusType sbus, int msgtag, const struct iovec* iov, int iovcnt);
+
+/**
+ Enva varios mensajes por SBUS Multicast de una vez, con una sola llamada
+ al sistema (sendmmsg) cada SBUS_MCAST_SEND_BATCH mensajes
+
+ @param sbus es el enlace SBUS
+ @param msgs son los mensajes a enviar, en orden
+ @param n es el nmero de mensajes
+
+ @return el nmero de mensajes enviados (los primeros) o -1 en caso de error
+*/
+int sbus_mcsend_many(SBusType sbus, const SBusBatchMsg* msgs, int n);
+
+/**
+ Enva ya los mensajes Multicast que esperan en la ventana de agrupamiento
+ (ver SBusOptions.mcastBatchUs) y los retenidos para cada receptor en modo
+ cork (ver SBusOptions.corkBytes)
+
+ @param sbus es el enlace SBUS
+
+ @return 0 en caso de xito o -1 en caso de error (se perdieron mensajes)
+*/
+int sbus_mcflush(SBusType sbus);
+
 /**
  Envia datos directamente a otro SBUS (sin multicast, punto a punto, directo)
 
@@ -94,29 +161,238 @@ int sbus_mcsend(SBusType sbus, int msgtag, char *data, int bytes);
  @param data son los datos del mensaje
  @param bytes es el tamao de data
 
- @return el nmero de bytes enviados en caso de xito o -1 en caso de error
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si espera en la cola de salida
+   hacia el receptor o -1 en caso de error; solo un valor negativo es un error
 */
 int sbus_send(SBusType sbus, int msgtag, int ch2peer, char *data, int bytes);
 
 /**
- Recepcin Temporizada (en ms) de datos de SBUS a travs de este enlace
+ Enva datos directamente a otro SBUS tomndolos de varios fragmentos, sin copiarlos
+ (por ejemplo una cabecera propia y los datos, cada uno en su sitio)
+
+ @param sbus es el enlace SBUS
+ @param msgtag es un cdigo identificativo del tipo de mensaje enviado
+ @param peerid es el identificativo del receptor
+ @param iov son los fragmentos del mensaje
+ @param iovcnt es el nmero de fragmentos
+
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si espera en la cola de salida
+   hacia el receptor o -1 en caso de error; solo un valor negativo es un error
+*/
+int sbus_sendv(SBusType sbus, int msgtag, int peerid, const struct iovec* iov, int iovcnt);
+
+/**
+ Enva directamente a otro SBUS un trozo de un fichero normal como mensaje; los
+ datos pasan de la cach de pginas a la conexin (sendfile()) sin leerlos ni
+ copiarlos en el proceso
+
+ @param sbus es el enlace SBUS
+ @param msgtag es un cdigo identificativo del tipo de mensaje enviado
+ @param peerid es el identificativo del receptor
+ @param fd es el fichero con los datos (puede cerrarse al volver)
+ @param offset es el comienzo de los datos en el fichero
+ @param bytes es el tamao de los datos; el fichero no debe acortarse
+   hasta que se hayan enviado
+
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si espera en la cola de salida
+   hacia el receptor o -1 en caso de error; solo un valor negativo es un error
+*/
+int sbus_sendFile(SBusType sbus, int msgtag, int peerid, int fd, off_t offset, int bytes);
+
+/**
+ Enva ya los mensajes retenidos para otro SBUS en modo cork
+ (ver SBusOptions.corkBytes)
+
+ @param sbus es el enlace SBUS
+ @param peerid es el identificativo del receptor
+
+ @return SBUS_SENT (0) si se enviaron, SBUS_QUEUED (1) si esperan sitio en la
+   conexin hacia el receptor o -1 en caso de error; solo un valor negativo
+   es un error
+*/
+int sbus_flush(SBusType sbus, int peerid);
+
+/**
+ Enva datos directamente a otro SBUS de forma asncrona: vuelve en seguida y
+ una hebra de envo conecta con el receptor (si hace falta) y escribe el mensaje
+
+ @param sbus es el enlace SBUS
+ @param msgtag es un cdigo identificativo del tipo de mensaje enviado
+ @param peerid es el identificativo del receptor
+ @param data son los datos del mensaje (se copian, pueden reutilizarse en seguida)
+ @param bytes es el tamao de data
+
+ @return el envo en curso (ver sbus_sendWait(), liberarlo con sbus_sendRelease())
+   o NULL en caso de error
+*/
+SBusSendType sbus_sendAsync(SBusType sbus, int msgtag, int peerid, char *data, int bytes);
+
+/**
+ Espera a que termine un envo asncrono
+
+ @param send es el envo en curso
+ @param timeout es el tiempo mximo de espera en ms (negativo espera indefinidamente)
+
+ @return 0 si el mensaje se escribi, -1 si fall (errno indica el motivo) o
+   -2 (SOCK_TIMEOUT) si sigue en curso
+*/
+int sbus_sendWait(SBusSendType send, int timeout);
+
+/**
+ Libera un envo asncrono (el mensaje se enva igualmente si sigue en curso)
+
+ @param send es el envo a liberar
+*/
+void sbus_sendRelease(SBusSendType send);
+
+/**
+ Enva a otro SBUS un mensaje de cualquier tamao, por trozos de hasta
+ SBUS_STREAM_CHUNK_BYTES (se bloquea mientras haya SBUS_STREAM_WINDOW trozos
+ esperando en la conexin); el receptor lo recibe entero o trozo a trozo
+ (ver sbus_recvStream())
+
+ @param sbus es el enlace SBUS
+ @param msgtag es un cdigo identificativo del tipo de mensaje enviado
+ @param peerid es el identificativo del receptor
+ @param data son los datos del mensaje
+ @param bytes es el tamao de los datos
+
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si su final espera en la
+   cola de salida hacia el receptor o -1 en caso de error; solo un valor
+   negativo es un error
+*/
+int sbus_sendStream(SBusType sbus, int msgtag, int peerid, const char* data, long long bytes);
+
+/**
+ Empieza un mensaje por trozos hacia otro SBUS, para escribirlo por partes
+
+ @param sbus es el enlace SBUS
+ @param msgtag es un cdigo identificativo del tipo de mensaje enviado
+ @param peerid es el identificativo del receptor
+ @param total es el tamao del mensaje, si se conoce (-1 si no)
+
+ @return el mensaje en curso (para sbus_streamWrite() y sbus_streamClose())
+   o NULL en caso de error
+*/
+SBusStreamType sbus_streamOpen(SBusType sbus, int msgtag, int peerid, long long total);
+
+/**
+ Escribe ms datos de un mensaje por trozos
+
+ @param stream es el mensaje en curso
+ @param data son los datos (pueden reutilizarse al volver)
+ @param bytes es el tamao de los datos
+
+ @return 0 si todo fue bien o -1 en caso de error
+*/
+int sbus_streamWrite(SBusStreamType stream, const char* data, long long bytes);
+
+/**
+ Termina un mensaje por trozos y lo libera
+
+ @param stream es el mensaje en curso
+
+ @return SBUS_SENT (0) si se envi, SBUS_QUEUED (1) si su final espera en la
+   cola de salida hacia el receptor o -1 en caso de error; solo un valor
+   negativo es un error
+*/
+int sbus_streamClose(SBusStreamType stream);
+
+/**
+ Recepcin de datos de SBUS a travs de este enlace, esperando lo que haga falta
+ (los mensajes por trozos mayores de SBusOptions.streamReassembleBytes
+ necesitan sbus_recvStream(), aqu se descartan sus trozos)
+ (ver sbus_trecv())
 
  @param sbus es el enlace SBUS
  @param msgtag contendr el cdigo identificativo del tipo de mensaje enviado
  @param peerid contendr el canal al enviante del mensaje
  @param data son los datos del mensaje
+ @param bytes es el tamao mximo de data
 
- @return 0 en caso de timeout, el nmero de bytes recibidos o -1 en caso de error
+ @return el nmero de bytes recibidos o -1 en caso de error
 */
 int sbus_recv(SBusType sbus, int* pmsgtag, int* pch2peer, char *data, int bytes);
 
+/**
+ Recepcin Temporizada (en ms) de datos de SBUS a travs de este enlace
+ (los mensajes por trozos mayores de SBusOptions.streamReassembleBytes
+ necesitan sbus_recvStream(), aqu se descartan sus trozos)
+
+ @param sbus es el enlace SBUS
+ @param msgtag contendr el cdigo identificativo del tipo de mensaje enviado
+ @param peerid contendr el canal al enviante del mensaje (-1 en caso de timeout)
+ @param data son los datos del mensaje
+ @param bytes es el tamao mximo de data
+ @param timeout es la espera mxima en ms (0 no espera, -1 sin lmite)
+
+ @return 0 en caso de timeout, el nmero de bytes recibidos o -1 en caso de error
+*/
+int sbus_trecv(SBusType sbus, int* pmsgtag, int* pch2peer, char *data, int bytes, int timeout);
+
+/**
+ Da un descriptor para vigilar desde un bucle de eventos (poll, epoll...), que
+ se puede leer siempre que haya mensajes pendientes, a recibir con
+ sbus_trecv() y timeout 0 hasta que devuelva 0
+
+ @param sbus es el enlace SBUS
+
+ @return el descriptor (no se debe leer ni cerrar)
+*/
+int sbus_getfd(SBusType sbus);
+
+/**
+ Da los contadores de desbordamiento de la cola de entrada
+
+ @param sbus es el enlace SBUS
+ @param stats se rellena con los contadores
+*/
+void sbus_getInQueueStats(SBusType sbus, SBusInQueueStats* stats);
+
+/**
+ Recibe los mensajes con este cdigo: desde la primera suscripcin, slo se
+ reciben los cdigos suscritos (y los del sistema), el resto se descartan nada
+ ms leer su cabecera, sin copiarlos ni encolarlos
+
+ @param sbus es el enlace SBUS
+ @param msgtag es el cdigo de mensaje (1 a 32767)
+*/
+void sbus_subscribe(SBusType sbus, int msgtag);
+
+/**
+ Deja de recibir los mensajes con este cdigo, que se descartan nada ms leer
+ su cabecera, sin copiarlos ni encolarlos
+
+ @param sbus es el enlace SBUS
+ @param msgtag es el cdigo de mensaje (1 a 32767)
+*/
+void sbus_unsubscribe(SBusType sbus, int msgtag);
+
+/**
+ Recibe datos de SBUS indicando su posicin en el mensaje por trozos al que
+ pertenecen: los de hasta SBusOptions.streamReassembleBytes llegan enteros,
+ los mayores como un comienzo, sus trozos en orden y un final
+
+ @param sbus es el enlace SBUS
+ @param msgtag contendr el cdigo identificativo del tipo de mensaje enviado
+ @param peerid contendr el identificativo del enviante del mensaje
+ @param data son los datos del mensaje (o del trozo)
+ @param bytes es el tamao mximo de data
+ @param part contendr la posicin en el mensaje por trozos (ver SBusStreamPart)
+
+ @return bytes recibidos o -1 en caso de error
+*/
+int sbus_recvStream(SBusType sbus, int* pmsgtag, int* peerid, char *data, int bytes,
+  SBusStreamPart* part);
+
 /**
  Registers this Sbus with a (hopefully) unique name
 
  @param sbus this SBus binding object reference
  @param name to register this Sbus with
  
- @return 0 on success, -1 on error
+ @return SBUS_SENT (0) or SBUS_QUEUED (1) on success (the name goes out as a
+   multicast message), -1 on error
 */
 int sbus_setName(SBusType sbus, char* name);
 
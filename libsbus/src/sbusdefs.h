@@ -26,6 +26,9 @@
   LGPL
 */
 
+#ifndef SBUSDEFS
+#define SBUSDEFS
+
 #define SBUS_VERSION "0.2.0"
 
 /// System message tag "Ma'Name Is"
@@ -33,3 +36,180 @@
 
 /// System message tag "Name was taken"
 #define SBUS_NAMETAKEN -2
+
+/// poll() based transport engine (epoll on Linux)
+#define SBUS_ENGINE_POLL  0
+/// io_uring based transport engine (falls back to SBUS_ENGINE_POLL if not available)
+#define SBUS_ENGINE_URING 1
+
+/// Default maximum messages taken from a peer connection per receive cycle
+#define SBUS_QUANTUM_MSGS 64
+/// Default maximum bytes taken from a peer connection per receive cycle
+#define SBUS_QUANTUM_BYTES (256*1024)
+
+/// Default TCP server listen backlog (the kernel caps it to net.core.somaxconn)
+#define SBUS_LISTEN_BACKLOG 1024
+
+/// Send result: the message was handed to the kernel
+#define SBUS_SENT   0
+/// Send result: the peer is slow, the message waits on its outbound queue
+#define SBUS_QUEUED 1
+
+/// Default outbound queue size per peer that refuses new messages
+#define SBUS_SEND_HIGH_WATERMARK (4*1024*1024)
+/// Default outbound queue size per peer that accepts new messages again
+#define SBUS_SEND_LOW_WATERMARK  (1024*1024)
+
+/// Default received messages waiting for the application
+#define SBUS_IN_QUEUE_MSGS 65536
+/// Default received message bytes waiting for the application
+#define SBUS_IN_QUEUE_BYTES (256*1024*1024)
+/// Full incoming queue: the receiving threads wait for room, so do the peers (TCP backpressure)
+#define SBUS_IN_QUEUE_BLOCK       0
+/// Full incoming queue: the message arriving is dropped
+#define SBUS_IN_QUEUE_DROP_NEWEST 1
+/// Full incoming queue: the oldest message waiting is dropped (the arriving one if that is a peer disconnection)
+#define SBUS_IN_QUEUE_DROP_OLDEST 2
+/// Full incoming queue: multicast messages arriving are dropped, peer messages wait for room
+#define SBUS_IN_QUEUE_DROP_MCAST  3
+
+/// Maximum incoming queue priority lanes (besides the default one, last of all)
+#define SBUS_MAX_LANES 8
+/// Incoming queue lanes are served strictly by priority, the first one first
+#define SBUS_LANES_STRICT   0
+/// Incoming queue lanes are served by weight, that many messages in a row each
+#define SBUS_LANES_WEIGHTED 1
+
+/// An incoming queue priority lane, taking the messages with codes in a range
+typedef struct SBusLane {
+  /// Lowest message code taken
+  int fromTag;
+  /// Highest message code taken
+  int toTag;
+  /// Messages served in a row (SBUS_LANES_WEIGHTED, the default lane weighs 1)
+  int weight;
+} SBusLane;
+
+/// Incoming queue overflow counters (see sbus_getInQueueStats())
+typedef struct SBusInQueueStats {
+  /// Messages dropped on arrival (SBUS_IN_QUEUE_DROP_NEWEST, or DROP_OLDEST behind a peer disconnection)
+  long long int droppedNewest;
+  /// Messages dropped from the queue head (SBUS_IN_QUEUE_DROP_OLDEST)
+  long long int droppedOldest;
+  /// Multicast messages dropped on arrival (SBUS_IN_QUEUE_DROP_MCAST)
+  long long int droppedMCast;
+  /// Times a receiving thread had to wait for room
+  long long int blocked;
+} SBusInQueueStats;
+
+/// Maximum receive threads (reactors)
+#define SBUS_MAX_REACTORS 64
+/// Peer connections go to the receive thread serving the fewest of them
+#define SBUS_REACTOR_LEAST_LOADED 0
+/// Peer connections go to a receive thread picked hashing the peer address and port
+#define SBUS_REACTOR_HASH 1
+
+/// Maximum messages coalesced into a single multicast sendmmsg()
+#define SBUS_MCAST_SEND_BATCH 64
+
+/**
+  Suggested biggest multicast datagram, an Ethernet MTU (bigger messages go in
+  fragments); fragmentation is off by default, as receivers older than it can
+  not reassemble the fragments
+*/
+#define SBUS_MCAST_DATAGRAM_BYTES 1472
+
+/// A message of a multicast batch (see sbus_mcsend_many())
+typedef struct SBusBatchMsg {
+  /// Message code
+  int msgtag;
+  /// Message body
+  const char* data;
+  /// Message body length
+  int bytes;
+} SBusBatchMsg;
+
+/// Streamed messages are sent in chunks of up to these bytes
+#define SBUS_STREAM_CHUNK_BYTES (256*1024)
+/// Streamed message chunks waiting on the peer connection before the writer blocks
+#define SBUS_STREAM_WINDOW 8
+/// Default biggest streamed message reassembled by the receiver
+#define SBUS_STREAM_REASSEMBLE_BYTES (64*1024*1024)
+
+/// A whole message, not streamed or already reassembled
+#define SBUS_STREAM_NONE  0
+/// A streamed message begins (no bytes yet)
+#define SBUS_STREAM_BEGIN 1
+/// A chunk of a streamed message
+#define SBUS_STREAM_CHUNK 2
+/// A streamed message ends (no bytes), complete if offset equals total
+#define SBUS_STREAM_END   3
+
+/// Where a received message stands on its stream (see sbus_recvStream())
+typedef struct SBusStreamPart {
+  /// SBUS_STREAM_NONE, SBUS_STREAM_BEGIN, SBUS_STREAM_CHUNK or SBUS_STREAM_END
+  int kind;
+  /// Stream id, unique per sender (0 if not streamed)
+  unsigned int stream;
+  /// Offset of the received bytes on the message (on the end, the bytes received)
+  long long int offset;
+  /// Message length (-1 unknown; on the end, the bytes sent or -1 if cancelled)
+  long long int total;
+} SBusStreamPart;
+
+/// SBus creation options (get the defaults with sbus_defaultOptions())
+typedef struct SBusOptions {
+  /// Transport engine (SBUS_ENGINE_POLL or SBUS_ENGINE_URING)
+  int engine;
+  /// Maximum messages taken from a peer connection per receive cycle (0 unlimited)
+  int quantumMsgs;
+  /// Maximum bytes taken from a peer connection per receive cycle (0 unlimited)
+  int quantumBytes;
+  /// Low latency mode: time (us) to busy-poll/spin when idle before yielding (0 = block right away)
+  int spinUs;
+  /// Low latency mode: time (us) to sched_yield() after spinning before blocking
+  int yieldUs;
+  /// SO_BUSY_POLL time (us) for the sockets (0 off; raising it may need CAP_NET_ADMIN)
+  int busyPollUs;
+  /// Receive threads (reactors) the peer connections are spread over (1 to SBUS_MAX_REACTORS)
+  int reactors;
+  /// How peer connections are spread (SBUS_REACTOR_LEAST_LOADED or SBUS_REACTOR_HASH)
+  int reactorPolicy;
+  /// TCP server listen backlog, pending connections the kernel keeps for us
+  int listenBacklog;
+  /// Outbound queue size per peer that refuses new messages (0 unlimited)
+  int sendHighWatermark;
+  /// Outbound queue size per peer that accepts new messages again
+  int sendLowWatermark;
+  /// Multicast publishes issued within this time (us) go out together on one sendmmsg() (0 off)
+  int mcastBatchUs;
+  /// Biggest multicast datagram sent, bigger messages go in fragments reassembled by receivers (0, the default, never fragmented; every receiver must support it, see SBUS_MCAST_DATAGRAM_BYTES)
+  int mcastDatagramBytes;
+  /// Corked mode: unicast messages to a peer are held back until they add up to these bytes (0 off)
+  int corkBytes;
+  /// Corked mode: longest time (us) a message is held back (0 until flushed or the cork fills up)
+  int corkUs;
+  /// Unicast messages from this size on, sent from a SBufSlice, go with MSG_ZEROCOPY (0 off)
+  int zeroCopyBytes;
+  /// Streamed messages up to these bytes are reassembled, bigger ones are handed in parts (0 all in parts);
+  /// those of unknown length are reassembled, and dropped if they outgrow it
+  int streamReassembleBytes;
+  /// Received messages waiting for the application the incoming queue holds
+  int inQueueMsgs;
+  /// Received message bytes waiting for the application the incoming queue holds (0 unlimited)
+  long long int inQueueBytes;
+  /// What is done with a full incoming queue (SBUS_IN_QUEUE_BLOCK, SBUS_IN_QUEUE_DROP_...);
+  /// peer disconnections always wait for room
+  int inQueuePolicy;
+  /// Incoming queue priority lanes (0 to SBUS_MAX_LANES), each with its own capacity; messages
+  /// in none of them go to a default lane, last of all, and so do the peer disconnections
+  /// (0, the default, a single lane in arrival order; a lane for SBUS_NAMETAKEN to 0 puts
+  /// the system messages first)
+  int lanes;
+  /// Message codes of each priority lane, the first ones taking precedence
+  SBusLane lane[SBUS_MAX_LANES];
+  /// How lanes are served (SBUS_LANES_STRICT or SBUS_LANES_WEIGHTED)
+  int laneDequeue;
+} SBusOptions;
+
+#endif
@@ -67,6 +67,19 @@ int stcp_setNonBlocking(int fd) {
   @return -1 en caso de error o el socket servidor creado (nmero positivo)
 */
 int stcp_server(const char* ip, int port) {
+  return stcp_serverBacklog(ip,port,LISTEN_QUEUE_SIZE);
+}
+
+/**
+  Crea un socket servidor con una cola listen a medida
+
+  @param ip es la IP local de escucha del servidor TCP ("0.0.0.0","127.0.0.1",...)
+  @param port es el puerto de conexin del servidor TCP
+  @param backlog es la longitud de la cola de conexiones pendientes de accept()
+
+  @return -1 en caso de error o el socket servidor creado (nmero positivo)
+*/
+int stcp_serverBacklog(const char* ip, int port, int backlog) {
   struct sockaddr_in addr;
   int sockfd;
   int reuseaddr=1;
@@ -78,7 +91,7 @@ int stcp_server(const char* ip, int port) {
   sockaddr_set(&addr,ip,port);
   RET_ON_PERROR(bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)));
   // LISTEN
-  RET_ON_PERROR(listen(sockfd,LISTEN_QUEUE_SIZE));
+  RET_ON_PERROR(listen(sockfd,(backlog>0)?backlog:LISTEN_QUEUE_SIZE));
   return sockfd;
 }
 
@@ -118,9 +131,21 @@ int stcp_client(const char *ip, int port, int blocking) {
 */
 int stcp_waitConnection(int sockfd, int timeout) {
   struct pollfd fds;  
+  int res;
   fds.fd=sockfd;
   fds.events=POLLOUT | POLLERR | POLLHUP | POLLNVAL;
-  RET_ON_PERROR(poll(&fds,1,timeout));
+  RET_ON_PERROR((res=poll(&fds,1,timeout)));
+  if(res==0) {
+    errno=ETIMEDOUT;
+    return -1;
+  }
+  // Refused (or failed) connections come back ready too
+  if((res=stcp_soerror(sockfd))!=0) {
+    if(res>0) {
+      errno=res;
+    }
+    return -1;
+  }
   return 0;
 }
 
@@ -177,6 +202,67 @@ int stcp_send(int sockfd, char *data, int len) {
   return send(sockfd,data,len,0);
 }
 
+/**
+  @brief Enva por la conexin dada los datos de varios fragmentos, sin copiarlos,
+  esperando lo necesario (hasta timeout ms) si la conexin no admite ms datos
+
+  @param sockfd es la conexin TCP
+  @param iov son los fragmentos a enviar, se modifican segn avanza el envo
+  @param iovcnt es el nmero de fragmentos
+  @param timeout es el mximo tiempo en ms que se espera a poder seguir enviando
+
+  @return el nmero de bytes enviados, o -1 en caso de error (errno ETIMEDOUT si venci el tiempo)
+ */
+int stcp_sendv(int sockfd, struct iovec* iov, int iovcnt, int timeout) {
+  struct msghdr mh;
+  struct pollfd fds;
+  int total=0;
+  int sent;
+  int res;
+  memset(&mh,0,sizeof(mh));
+  // Fragmentos vacos fuera
+  while((iovcnt>0)&&(iov->iov_len==0)) {
+    iov++;
+    iovcnt--;
+  }
+  while(iovcnt>0) {
+    mh.msg_iov=iov;
+    mh.msg_iovlen=iovcnt;
+    if((sent=sendmsg(sockfd,&mh,MSG_NOSIGNAL))<0) {
+      if(errno==EINTR) {
+        continue;
+      }
+      if((errno!=EAGAIN)&&(errno!=EWOULDBLOCK)) {
+        return -1;
+      }
+      // Socket no bloqueante lleno, se espera a que haya sitio
+      fds.fd=sockfd;
+      fds.events=POLLOUT;
+      if((res=poll(&fds,1,timeout))<0) {
+        if(errno!=EINTR) {
+          return -1;
+        }
+      } else if(res==0) {
+        errno=ETIMEDOUT;
+        return -1;
+      }
+      continue;
+    }
+    total+=sent;
+    // Avance sobre los fragmentos enviados (envo parcial)
+    while((iovcnt>0)&&(sent>=(int)iov->iov_len)) {
+      sent-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt>0) {
+      iov->iov_base=((char*)iov->iov_base)+sent;
+      iov->iov_len-=sent;
+    }
+  }
+  return total;
+}
+
 /**
   @brief Recibe datos de la conexin dada
 
@@ -7,6 +7,8 @@
   LGPL
 */
 
+#include <sys/uio.h>
+
 #include <sock.h>
 #include <sockaddr.h>
 
@@ -41,6 +43,17 @@ int stcp_setNonBlocking(int fd);
 */
 int stcp_server(const char* ip, int port);
 
+/**
+  Crea un socket servidor con una cola listen a medida
+
+  @param ip es la IP local de escucha del servidor TCP ("0.0.0.0","127.0.0.1",...)
+  @param port es el puerto de conexin del servidor TCP
+  @param backlog es la longitud de la cola de conexiones pendientes de accept()
+
+  @return -1 en caso de error o el socket servidor creado (nmero positivo)
+*/
+int stcp_serverBacklog(const char* ip, int port, int backlog);
+
 /**
   Crea un socket cliente conectado
 
@@ -53,6 +66,8 @@ int stcp_client(const char *ip, int port, int blocking);
 
 /**
   Espera un tiempo determinado a que se complete la conexin
+
+  @return 0 si se complet o -1 si fue rechazada o no lleg a tiempo (errno indica el motivo)
 */
 int stcp_waitConnection(int sockfd, int timeout);
 
@@ -81,6 +96,19 @@ int stcp_isAlive(int sockfd);
  */
 int stcp_send(int sockfd, char *data, int len);
 
+/**
+  @brief Enva por la conexin dada los datos de varios fragmentos, sin copiarlos,
+  esperando lo necesario (hasta timeout ms) si la conexin no admite ms datos
+
+  @param sockfd es la conexin TCP
+  @param iov son los fragmentos a enviar, se modifican segn avanza el envo
+  @param iovcnt es el nmero de fragmentos
+  @param timeout es el mximo tiempo en ms que se espera a poder seguir enviando
+
+  @return el nmero de bytes enviados, o -1 en caso de error (errno ETIMEDOUT si venci el tiempo)
+ */
+int stcp_sendv(int sockfd, struct iovec* iov, int iovcnt, int timeout);
+
 /**
   @brief Recibe datos de la conexin dada
 
@@ -107,6 +107,29 @@ int sudp_mcsend(int sockfd, char* data, int len, const char* mcip, int port) {
   return sendto(sockfd,data,len,0,(struct sockaddr*)&addr,sizeof(addr));
 }
 
+/**
+  Enva al socket Multicast un datagrama formado por varios fragmentos, sin copiarlos
+
+  @param sockfd es el socket multicast
+  @param iov son los fragmentos del datagrama
+  @param iovcnt es el nmero de fragmentos
+  @param mcip es la direccin ip de multicast
+  @param port es el puerto de escucha/envio de Multicast
+
+  @return el nmero de bytes enviados o -1 en caso de error
+*/
+int sudp_mcsendv(int sockfd, const struct iovec* iov, int iovcnt, const char* mcip, int port) {
+  struct sockaddr_in addr;
+  struct msghdr mh;
+  sockaddr_set(&addr,mcip,port);
+  memset(&mh,0,sizeof(mh));
+  mh.msg_name=&addr;
+  mh.msg_namelen=sizeof(addr);
+  mh.msg_iov=(struct iovec*)iov;
+  mh.msg_iovlen=iovcnt;
+  return sendmsg(sockfd,&mh,0);
+}
+
 /**
   Cierra el socket multicast dejando tambin el grupo
 
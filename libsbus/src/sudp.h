@@ -8,6 +8,8 @@
 */
 
 
+#include <sys/uio.h>
+
 #ifndef SUDP
 #define SUDP
 
@@ -49,6 +51,19 @@ int sudp_mcast(const char *device, const char* mcip, int port);
 */
 int sudp_mcsend(int sockfd, char* data, int len, const char* mcip, int port);
 
+/**
+  Enva al socket Multicast un datagrama formado por varios fragmentos, sin copiarlos
+
+  @param sockfd es el socket multicast
+  @param iov son los fragmentos del datagrama
+  @param iovcnt es el nmero de fragmentos
+  @param mcip es la direccin ip de multicast
+  @param port es el puerto de escucha/envio de Multicast
+
+  @return el nmero de bytes enviados o -1 en caso de error
+*/
+int sudp_mcsendv(int sockfd, const struct iovec* iov, int iovcnt, const char* mcip, int port);
+
 /**
   Cierra el socket multicast dejando tambin el grupo
 
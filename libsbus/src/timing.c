@@ -39,6 +39,21 @@ long long int timing_current_millis() {
   return (long long int)((long long int)tv.tv_sec*(long long int)1000)+(long long int)(tv.tv_usec/1000);
 }
 
+/**
+
+  Devuelve el tiempo en microsegundos de un reloj monotono
+  (solo vale para medir intervalos)
+
+  @return el tiempo transcurrido en microsegundos
+ */
+long long int timing_current_micros() {
+  struct timespec ts;
+  if(clock_gettime(CLOCK_MONOTONIC,&ts)!=0) {
+    return -1;
+  }
+  return (long long int)ts.tv_sec*1000000LL+(long long int)(ts.tv_nsec/1000);
+}
+
 /**
   Calcula la diferencia de tiempo en milisegundos
   (Solo sirve para tiempos pequeos, puede estar desborado si es muy grande)
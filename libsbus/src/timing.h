@@ -29,6 +29,15 @@ int timing_current_seconds();
  */
 long long int timing_current_millis();
 
+/**
+
+  Devuelve el tiempo en microsegundos de un reloj monotono
+  (solo vale para medir intervalos)
+
+  @return el tiempo transcurrido en microsegundos
+ */
+long long int timing_current_micros();
+
 /**
   Calcula la diferencia de tiempo en milisegundos
   (Solo sirve para tiempos pequeos, puede estar desborado si es muy grande)
@@ -0,0 +1,669 @@
+/*
+      SBUS library: Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** sbusloop.c
+
+  Pruebas en bucle local del Simple-BUS desde el API C: varios SBUS en esta
+  mquina, una prueba por caracterstica (las que necesitan el interior de
+  la librera estn en testcpp/sbusloop.cpp)
+
+*/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+
+#include <errdefs.h>
+#include <sbus.h>
+#include <log.h>
+
+/// Puerto multicast base, cada prueba usa el suyo
+#define LOOP_PORT 10920
+
+/// Cdigo de mensaje ms bajo de las pruebas, se saltan los menores
+#define LOOP_MSGCODE 100
+
+/// Espera (ms) por un mensaje que debe llegar
+#define LOOP_WAIT_MS 2000
+
+/// Espera (ms) por un mensaje que no debe llegar
+#define LOOP_QUIET_MS 300
+
+/// Mayor mensaje de las pruebas
+#define LOOP_MAX_BYTES 300000
+
+/// Motor de transporte de las pruebas
+int engine=SBUS_ENGINE_POLL;
+
+/// Buffers de envo y recepcin
+char data[LOOP_MAX_BYTES], msg[LOOP_MAX_BYTES];
+
+/// Rellena un mensaje de prueba con un patrn que depende de la semilla
+void sbusloop_body(char* body, int bytes, int seed) {
+  int i;
+  for(i=0;i<bytes;i++) {
+    body[i]=(char)((i*7+seed+(i>>12))&0xff);
+  }
+}
+
+/// Crea un SBUS de prueba en el puerto dado con sus opciones
+SBusType sbusloop_create(int port, SBusOptions* options) {
+  options->engine=engine;
+  return sbus_createWith(NULL,DEFAULT_MCIP,port,options);
+}
+
+/// Siguiente mensaje de prueba (salta los del sistema), peerid -1 si no llega
+int sbusloop_next(SBusType sbus, int* msgtag, int* peerid, int timeout) {
+  int res, waited;
+  for(waited=0;waited<timeout;waited+=10) {
+    res=sbus_trecv(sbus,msgtag,peerid,msg,LOOP_MAX_BYTES,10);
+    if((*peerid>=0)&&(*msgtag>=LOOP_MSGCODE)) {
+      return res;
+    }
+  }
+  *peerid=-1;
+  return 0;
+}
+
+/// Siguiente mensaje de prueba o trozo (salta los del sistema), -2 si no llega
+int sbusloop_nextPart(SBusType sbus, int* msgtag, SBusStreamPart* part) {
+  struct pollfd pfd;
+  int res, peerid;
+  pfd.fd=sbus_getfd(sbus);
+  pfd.events=POLLIN;
+  while(poll(&pfd,1,LOOP_WAIT_MS)>0) {
+    res=sbus_recvStream(sbus,msgtag,&peerid,msg,LOOP_MAX_BYTES,part);
+    if(*msgtag>=LOOP_MSGCODE) {
+      return res;
+    }
+  }
+  return -2;
+}
+
+/// Descarta lo que espere en el SBUS
+void sbusloop_drain(SBusType sbus) {
+  int msgtag, peerid;
+  while((sbus_trecv(sbus,&msgtag,&peerid,msg,LOOP_MAX_BYTES,LOOP_QUIET_MS)>0)||(peerid>=0));
+}
+
+/// Identificativo con que to ve a from
+int sbusloop_peer(SBusType from, SBusType to) {
+  int msgtag, peerid;
+  sbus_mcsend(from,LOOP_MSGCODE,"hi",2);
+  sbusloop_next(to,&msgtag,&peerid,LOOP_WAIT_MS);
+  return peerid;
+}
+
+/// Mensajes por trozos enteros o por partes, sbus_trecv() slo toma los enteros
+int sbusloop_streams() {
+  SBusOptions options, partsOptions;
+  SBusStreamPart part;
+  SBusType a, b, c;
+  int msgtag, peerid, pa, pc, res=-1;
+  long long int offset=0;
+  sbus_defaultOptions(&options);
+  partsOptions=options;
+  partsOptions.streamReassembleBytes=64*1024;
+  a=sbusloop_create(LOOP_PORT+1,&options);
+  b=sbusloop_create(LOOP_PORT+1,&options);
+  c=sbusloop_create(LOOP_PORT+1,&partsOptions);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL)&&(c!=NULL));
+  // con nombre, para que b no confunda a a con c
+  sbus_setName(a,"loopa");
+  sbus_setName(b,"loopb");
+  sbus_setName(c,"loopc");
+  usleep(100000);
+  sbusloop_drain(b);
+  pa=sbusloop_peer(a,b);
+  sbusloop_drain(b);
+  pc=sbusloop_peer(c,b);
+  sbusloop_drain(a);
+  sbusloop_drain(c);
+  sbusloop_body(data,LOOP_MAX_BYTES,4);
+  if((pa<0)||(pc<0)) {
+    ERROR("streams: peers not found");
+    goto end;
+  }
+  // reensamblado
+  sbus_sendStream(b,LOOP_MSGCODE+1,pa,data,LOOP_MAX_BYTES);
+  if((sbusloop_nextPart(a,&msgtag,&part)!=LOOP_MAX_BYTES)||(msgtag!=LOOP_MSGCODE+1)||
+     (part.kind!=SBUS_STREAM_NONE)||memcmp(msg,data,LOOP_MAX_BYTES)) {
+    ERROR("streams: not reassembled (code %d, kind %d)",msgtag,part.kind);
+    goto end;
+  }
+  // por partes
+  sbus_sendStream(b,LOOP_MSGCODE+2,pc,data,LOOP_MAX_BYTES);
+  sbusloop_nextPart(c,&msgtag,&part);
+  if((msgtag!=LOOP_MSGCODE+2)||(part.kind!=SBUS_STREAM_BEGIN)||(part.total!=LOOP_MAX_BYTES)) {
+    ERROR("streams: no begin (code %d, kind %d)",msgtag,part.kind);
+    goto end;
+  }
+  while(1) {
+    int bytes=sbusloop_nextPart(c,&msgtag,&part);
+    if(bytes<0) {
+      ERROR("streams: part lost at %lld",offset);
+      goto end;
+    }
+    if(part.kind==SBUS_STREAM_END) {
+      break;
+    }
+    if((part.kind!=SBUS_STREAM_CHUNK)||(part.offset!=offset)||memcmp(msg,data+offset,bytes)) {
+      ERROR("streams: wrong chunk at %lld",offset);
+      goto end;
+    }
+    offset+=bytes;
+  }
+  if((offset!=LOOP_MAX_BYTES)||(part.total!=LOOP_MAX_BYTES)) {
+    ERROR("streams: wrong end (%lld bytes, total %lld)",offset,part.total);
+    goto end;
+  }
+  // sbus_trecv() descarta las partes
+  sbus_sendStream(b,LOOP_MSGCODE+3,pc,data,LOOP_MAX_BYTES);
+  sbus_send(b,LOOP_MSGCODE+4,pc,"small",5);
+  if((sbusloop_next(c,&msgtag,&peerid,LOOP_WAIT_MS)!=5)||(msgtag!=LOOP_MSGCODE+4)) {
+    ERROR("streams: sbus_trecv() took a part (code %d)",msgtag);
+    goto end;
+  }
+  res=0;
+end:
+  sbus_dispose(a);
+  sbus_dispose(b);
+  sbus_dispose(c);
+  return res;
+}
+
+/// Los mensajes multicast grandes van en fragmentos y se reensamblan
+int sbusloop_fragments() {
+  SBusOptions options;
+  SBusType a, b;
+  int msgtag, peerid, res=0, bytes=20000;
+  sbus_defaultOptions(&options);
+  options.mcastDatagramBytes=SBUS_MCAST_DATAGRAM_BYTES;
+  a=sbusloop_create(LOOP_PORT,&options);
+  b=sbusloop_create(LOOP_PORT,&options);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(b);
+  sbusloop_body(data,bytes,1);
+  sbus_mcsend(a,LOOP_MSGCODE,data,bytes);
+  res=sbusloop_next(b,&msgtag,&peerid,LOOP_WAIT_MS);
+  if((peerid<0)||(res!=bytes)||memcmp(msg,data,bytes)) {
+    ERROR("fragments: %d bytes message not reassembled (got %d bytes)",bytes,res);
+    res=-1;
+  } else {
+    res=0;
+  }
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return res;
+}
+
+/// Llena la cola de entrada con una poltica, da los mensajes recibidos (y sus valores primero y ltimo)
+int sbusloop_overflowRun(int policy, int* first, int* last, SBusInQueueStats* stats) {
+  SBusOptions options, fullOptions;
+  SBusType a, b;
+  char value[8];
+  int i, msgtag, peerid, got=0;
+  sbus_defaultOptions(&options);
+  fullOptions=options;
+  fullOptions.inQueueMsgs=10;
+  fullOptions.inQueuePolicy=policy;
+  a=sbusloop_create(LOOP_PORT+2,&options);
+  b=sbusloop_create(LOOP_PORT+2,&fullOptions);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(b);
+  for(i=0;i<50;i++) {
+    memset(value,' ',sizeof(value));
+    sprintf(value,"%d",i);
+    sbus_mcsend(a,LOOP_MSGCODE,value,sizeof(value));
+    usleep(500);
+  }
+  usleep(100000);
+  sbus_getInQueueStats(b,stats);
+  *first=-1;
+  while(sbusloop_next(b,&msgtag,&peerid,LOOP_QUIET_MS)>0) {
+    if(*first<0) {
+      *first=atoi(msg);
+    }
+    *last=atoi(msg);
+    got++;
+  }
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return got;
+}
+
+/// Polticas de la cola de entrada llena y sus contadores
+int sbusloop_overflow() {
+  SBusInQueueStats stats;
+  int first, last, got;
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_DROP_NEWEST,&first,&last,&stats);
+  if((got!=10)||(first!=0)||(last!=9)||(stats.droppedNewest!=40)) {
+    ERROR("overflow: drop newest got %d (%d to %d), dropped %lld",got,first,last,stats.droppedNewest);
+    return -1;
+  }
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_DROP_OLDEST,&first,&last,&stats);
+  if((got!=10)||(first!=40)||(last!=49)||(stats.droppedOldest!=40)) {
+    ERROR("overflow: drop oldest got %d (%d to %d), dropped %lld",got,first,last,stats.droppedOldest);
+    return -1;
+  }
+  return 0;
+}
+
+/// Los mensajes de un carril prioritario se toman antes que los del carril por defecto
+int sbusloop_lanes() {
+  SBusOptions options, laneOptions;
+  SBusType a, b;
+  char order[16];
+  int i, msgtag, peerid, got=0;
+  sbus_defaultOptions(&options);
+  laneOptions=options;
+  laneOptions.lanes=1;
+  laneOptions.lane[0].fromTag=LOOP_MSGCODE+1;
+  laneOptions.lane[0].toTag=LOOP_MSGCODE+1;
+  laneOptions.lane[0].weight=1;
+  laneOptions.laneDequeue=SBUS_LANES_STRICT;
+  a=sbusloop_create(LOOP_PORT+3,&options);
+  b=sbusloop_create(LOOP_PORT+3,&laneOptions);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(b);
+  for(i=0;i<6;i++) {
+    sbus_mcsend(a,LOOP_MSGCODE,"b",1);
+    usleep(300);
+  }
+  for(i=0;i<4;i++) {
+    sbus_mcsend(a,LOOP_MSGCODE+1,"c",1);
+    usleep(300);
+  }
+  usleep(100000);
+  while((got<(int)sizeof(order)-1)&&(sbusloop_next(b,&msgtag,&peerid,LOOP_QUIET_MS)>0)) {
+    order[got++]=msg[0];
+  }
+  order[got]='\0';
+  sbus_dispose(a);
+  sbus_dispose(b);
+  if(strcmp(order,"ccccbbbbbb")!=0) {
+    ERROR("lanes: strict order %s",order);
+    return -1;
+  }
+  return 0;
+}
+
+/// Cdigos de los mensajes de prueba que esperan, separados por espacios
+void sbusloop_tagsGot(SBusType sbus, char* got) {
+  int msgtag, peerid;
+  got[0]='\0';
+  while((sbusloop_next(sbus,&msgtag,&peerid,LOOP_QUIET_MS)>0)||(peerid>=0)) {
+    sprintf(got+strlen(got),"%d ",msgtag-LOOP_MSGCODE);
+  }
+}
+
+/// Los cdigos dados de baja, y al suscribir los no suscritos, se descartan
+int sbusloop_tags() {
+  SBusOptions options;
+  SBusType a, b;
+  char got[64];
+  int res=-1;
+  sbus_defaultOptions(&options);
+  a=sbusloop_create(LOOP_PORT+4,&options);
+  b=sbusloop_create(LOOP_PORT+4,&options);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(b);
+  sbus_unsubscribe(b,LOOP_MSGCODE+1);
+  sbus_mcsend(a,LOOP_MSGCODE+1,"s",1);
+  sbus_mcsend(a,LOOP_MSGCODE+2,"s",1);
+  sbusloop_tagsGot(b,got);
+  if(strcmp(got,"2 ")!=0) {
+    ERROR("tags: unsubscribed got %s",got);
+    goto end;
+  }
+  sbus_subscribe(b,LOOP_MSGCODE+3);
+  sbus_mcsend(a,LOOP_MSGCODE+1,"s",1);
+  sbus_mcsend(a,LOOP_MSGCODE+2,"s",1);
+  sbus_mcsend(a,LOOP_MSGCODE+3,"s",1);
+  sbusloop_tagsGot(b,got);
+  if(strcmp(got,"3 ")!=0) {
+    ERROR("tags: subscribed got %s",got);
+    goto end;
+  }
+  res=0;
+end:
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return res;
+}
+
+/// Las conexiones repartidas entre varios reactores mantienen el orden de cada emisor
+int sbusloop_reactors() {
+  SBusOptions options, multiOptions;
+  SBusType r, s[2];
+  int toR[2], next[2];
+  int i, n, sender, msgtag, peerid, got=0, res=0;
+  sbus_defaultOptions(&options);
+  multiOptions=options;
+  multiOptions.reactors=2;
+  multiOptions.reactorPolicy=SBUS_REACTOR_LEAST_LOADED;
+  r=sbusloop_create(LOOP_PORT+5,&multiOptions);
+  s[0]=sbusloop_create(LOOP_PORT+5,&options);
+  s[1]=sbusloop_create(LOOP_PORT+5,&options);
+  RET_ON_FALSE((r!=NULL)&&(s[0]!=NULL)&&(s[1]!=NULL));
+  usleep(100000);
+  sbus_mcsend(r,LOOP_MSGCODE,"hi",2);
+  for(i=0;i<2;i++) {
+    sbusloop_next(s[i],&msgtag,&toR[i],LOOP_WAIT_MS);
+    next[i]=0;
+    if(toR[i]<0) {
+      ERROR("reactors: sender %d did not find the receiver",i);
+      res=-1;
+    }
+  }
+  for(n=0;(res==0)&&(n<200);n++) {
+    for(i=0;i<2;i++) {
+      sprintf(data,"%d:%d",i,n);
+      if(sbus_send(s[i],LOOP_MSGCODE+1,toR[i],data,strlen(data)+1)<0) {
+        ERROR("reactors: sender %d send %d failed",i,n);
+        res=-1;
+      }
+    }
+  }
+  while((res==0)&&(got<400)&&(sbusloop_next(r,&msgtag,&peerid,LOOP_WAIT_MS)>0)) {
+    if((msgtag!=LOOP_MSGCODE+1)||(sscanf(msg,"%d:%d",&sender,&n)!=2)) {
+      continue;
+    }
+    if((sender<0)||(sender>1)||(n!=next[sender])) {
+      ERROR("reactors: sender %d message %d out of order",sender,n);
+      res=-1;
+    } else {
+      next[sender]++;
+      got++;
+    }
+  }
+  if((res==0)&&(got!=400)) {
+    ERROR("reactors: got %d of 400 messages",got);
+    res=-1;
+  }
+  sbus_dispose(r);
+  sbus_dispose(s[0]);
+  sbus_dispose(s[1]);
+  return res;
+}
+
+/// Los mensajes retenidos (cork) esperan a sbus_flush() y llegan en orden
+int sbusloop_cork() {
+  SBusOptions options, corkOptions;
+  SBusType a, b;
+  int i, msgtag, peerid, pb, res=-1;
+  sbus_defaultOptions(&options);
+  corkOptions=options;
+  corkOptions.corkBytes=16*1024;
+  corkOptions.corkUs=0;
+  a=sbusloop_create(LOOP_PORT+6,&corkOptions);
+  b=sbusloop_create(LOOP_PORT+6,&options);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(a);
+  pb=sbusloop_peer(b,a);
+  sbusloop_drain(b);
+  if(pb<0) {
+    ERROR("cork: peer not found");
+    goto end;
+  }
+  for(i=0;i<5;i++) {
+    sbusloop_body(data,10+i,i);
+    if(sbus_send(a,LOOP_MSGCODE+i,pb,data,10+i)!=SBUS_QUEUED) {
+      ERROR("cork: message %d not held back",i);
+      goto end;
+    }
+  }
+  sbusloop_next(b,&msgtag,&peerid,LOOP_QUIET_MS);
+  if(peerid>=0) {
+    ERROR("cork: message %d delivered before the flush",msgtag-LOOP_MSGCODE);
+    goto end;
+  }
+  if(sbus_flush(a,pb)<0) {
+    ERROR("cork: flush failed");
+    goto end;
+  }
+  for(i=0;i<5;i++) {
+    sbusloop_body(data,10+i,i);
+    if((sbusloop_next(b,&msgtag,&peerid,LOOP_WAIT_MS)!=10+i)||(msgtag!=LOOP_MSGCODE+i)||
+       memcmp(msg,data,10+i)) {
+      ERROR("cork: message %d not delivered after the flush (code %d)",i,msgtag);
+      goto end;
+    }
+  }
+  res=0;
+end:
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return res;
+}
+
+/// Los envos asncronos terminan una vez escritos, en orden; los dirigidos a un SBUS cerrado fallan
+int sbusloop_async() {
+  SBusOptions options;
+  SBusType a, b, c;
+  SBusSendType gone=NULL, last=NULL, send;
+  int i, msgtag, peerid, pb, pc, res=-1;
+  sbus_defaultOptions(&options);
+  a=sbusloop_create(LOOP_PORT+7,&options);
+  b=sbusloop_create(LOOP_PORT+7,&options);
+  c=sbusloop_create(LOOP_PORT+7,&options);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL)&&(c!=NULL));
+  sbus_setName(a,"loopa");
+  sbus_setName(b,"loopb");
+  sbus_setName(c,"loopc");
+  usleep(100000);
+  sbusloop_drain(a);
+  pb=sbusloop_peer(b,a);
+  sbusloop_drain(a);
+  pc=sbusloop_peer(c,a);
+  sbus_dispose(c);
+  sbusloop_drain(b);
+  if((pb<0)||(pc<0)) {
+    ERROR("async: peers not found");
+    goto end;
+  }
+  // el que ya no est no se puede conectar, y no retiene a los dems
+  gone=sbus_sendAsync(a,LOOP_MSGCODE,pc,"gone",4);
+  for(i=0;i<100;i++) {
+    sprintf(data,"%d",i);
+    send=sbus_sendAsync(a,LOOP_MSGCODE+1,pb,data,strlen(data)+1);
+    if(send==NULL) {
+      ERROR("async: send %d not taken",i);
+      goto end;
+    }
+    if(last!=NULL) {
+      sbus_sendRelease(last);
+    }
+    last=send;
+  }
+  if(sbus_sendWait(last,LOOP_WAIT_MS)!=0) {
+    ERROR("async: last send not completed");
+    goto end;
+  }
+  if(sbus_sendWait(gone,LOOP_WAIT_MS)!=-1) {
+    ERROR("async: send to a gone peer did not fail");
+    goto end;
+  }
+  for(i=0;i<100;i++) {
+    sbusloop_next(b,&msgtag,&peerid,LOOP_WAIT_MS);
+    if((peerid<0)||(msgtag!=LOOP_MSGCODE+1)||(atoi(msg)!=i)) {
+      ERROR("async: message %d lost or out of order",i);
+      goto end;
+    }
+  }
+  res=0;
+end:
+  if(last!=NULL) {
+    sbus_sendRelease(last);
+  }
+  if(gone!=NULL) {
+    sbus_sendRelease(gone);
+  }
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return res;
+}
+
+/// Los trozos de un fichero llegan como el cuerpo del mensaje; los que se salen de l se rechazan
+int sbusloop_sendFile() {
+  SBusOptions options;
+  SBusType a, b;
+  char path[]="/tmp/sbusloopXXXXXX";
+  int offsets[]={0,5,1000};
+  int lengths[]={0,1000,200000};
+  int i, fd, msgtag, peerid, pa, res=-1;
+  if((fd=mkstemp(path))<0) {
+    ERROR("sendFile: no temporary file");
+    return -1;
+  }
+  unlink(path);
+  sbusloop_body(data,LOOP_MAX_BYTES,6);
+  if(write(fd,data,LOOP_MAX_BYTES)!=LOOP_MAX_BYTES) {
+    ERROR("sendFile: temporary file not written");
+    close(fd);
+    return -1;
+  }
+  sbus_defaultOptions(&options);
+  a=sbusloop_create(LOOP_PORT+8,&options);
+  b=sbusloop_create(LOOP_PORT+8,&options);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(b);
+  pa=sbusloop_peer(a,b);
+  sbusloop_drain(a);
+  if(pa<0) {
+    ERROR("sendFile: peer not found");
+    goto end;
+  }
+  for(i=0;i<3;i++) {
+    if(sbus_sendFile(b,LOOP_MSGCODE+i,pa,fd,offsets[i],lengths[i])<0) {
+      ERROR("sendFile: region %d+%d not sent",offsets[i],lengths[i]);
+      goto end;
+    }
+    if((sbusloop_next(a,&msgtag,&peerid,LOOP_WAIT_MS)!=lengths[i])||(peerid<0)||
+       (msgtag!=LOOP_MSGCODE+i)||memcmp(msg,data+offsets[i],lengths[i])) {
+      ERROR("sendFile: region %d+%d not delivered (code %d)",offsets[i],lengths[i],msgtag);
+      goto end;
+    }
+  }
+  if(sbus_sendFile(b,LOOP_MSGCODE,pa,fd,LOOP_MAX_BYTES-10,20)>=0) {
+    ERROR("sendFile: region past the end of the file taken");
+    goto end;
+  }
+  res=0;
+end:
+  close(fd);
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return res;
+}
+
+/// Un lote de mensajes multicast sale en una sola llamada y llega en orden
+int sbusloop_batch() {
+  SBusOptions options;
+  SBusBatchMsg batch[50];
+  SBusType a, b;
+  int i, msgtag, peerid, res=-1;
+  sbus_defaultOptions(&options);
+  a=sbusloop_create(LOOP_PORT+9,&options);
+  b=sbusloop_create(LOOP_PORT+9,&options);
+  RET_ON_FALSE((a!=NULL)&&(b!=NULL));
+  usleep(100000);
+  sbusloop_drain(b);
+  sbusloop_body(data,LOOP_MAX_BYTES,7);
+  for(i=0;i<50;i++) {
+    batch[i].msgtag=LOOP_MSGCODE+(i%3);
+    batch[i].data=data+i*100;
+    batch[i].bytes=1+i*20;
+  }
+  if(sbus_mcsend_many(a,batch,50)!=50) {
+    ERROR("batch: not all the messages sent");
+    goto end;
+  }
+  for(i=0;i<50;i++) {
+    if((sbusloop_next(b,&msgtag,&peerid,LOOP_WAIT_MS)!=batch[i].bytes)||(peerid<0)||
+       (msgtag!=batch[i].msgtag)||memcmp(msg,batch[i].data,batch[i].bytes)) {
+      ERROR("batch: message %d lost or out of order (code %d)",i,msgtag);
+      goto end;
+    }
+  }
+  res=0;
+end:
+  sbus_dispose(a);
+  sbus_dispose(b);
+  return res;
+}
+
+/// Una prueba en bucle local
+typedef struct sbusloop_test {
+  /// Nombre de la prueba
+  const char* name;
+  /// Funcin de la prueba, 0 si pasa
+  int (*run)();
+} sbusloop_test;
+
+/// Pasa todas las pruebas, da las que fallan
+int sbusloop_run() {
+  sbusloop_test tests[]={
+    {"streams",sbusloop_streams},
+    {"fragments",sbusloop_fragments},
+    {"overflow",sbusloop_overflow},
+    {"lanes",sbusloop_lanes},
+    {"tags",sbusloop_tags},
+    {"reactors",sbusloop_reactors},
+    {"cork",sbusloop_cork},
+    {"async",sbusloop_async},
+    {"sendFile",sbusloop_sendFile},
+    {"batch",sbusloop_batch},
+  };
+  unsigned int i;
+  int failed=0;
+  for(i=0;i<sizeof(tests)/sizeof(sbusloop_test);i++) {
+    if(tests[i].run()==0) {
+      INFO("%s: ok",tests[i].name);
+    } else {
+      ERROR("%s: FAILED",tests[i].name);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+int main(int argc, char* argv[]) {
+  int failed;
+  if((argc>1)&&(strcmp(argv[1],"uring")==0)) {
+    engine=SBUS_ENGINE_URING;
+  } else if(argc>1) {
+    INFO("Usage: %s [uring]",argv[0]);
+    return -1;
+  }
+  failed=sbusloop_run();
+  if(failed>0) {
+    ERROR("%d tests failed",failed);
+    return -1;
+  }
+  INFO("All tests passed");
+  return 0;
+}
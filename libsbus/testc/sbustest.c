@@ -78,7 +78,7 @@ int sbustest_start_pinger(const char *name, char *device) {
   RET_ON_FALSE(sbus!=0);
   INFO("SBUS pinger started (default name is %s)",sbus_getName(sbus));
   // SBus unique name registration
-  if(sbus_setName(sbus,(char*)name)!=0) {
+  if(sbus_setName(sbus,(char*)name)<0) {
     INFO("Could not register SBUS with name %s",name);
     return -1;
   }
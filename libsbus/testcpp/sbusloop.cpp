@@ -0,0 +1,968 @@
+/*
+      SBUS library: Simple BUS communcations library for distributed software developments
+      Copyright (C) 2004  Jos Luis Vzquez Gonzlez <josvazg@terra.es>
+
+      This library is free software; you can redistribute it and/or modify it
+      under the terms of the GNU Lesser General Public License as published by
+      the Free Software Foundation; either version 2.1 of the License, or (at
+      your option) any later version.
+
+      This library is distributed in the hope that it will be useful, but
+      WITHOUT ANY WARRANTY; without even the implied warranty of
+      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+      Lesser General Public License for more details.
+
+      You should have received a copy of the GNU Lesser General Public
+      License along with this library; if not, write to the Free Software
+      Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307,
+      USA.
+*/
+/** sbusloop.cpp
+
+  Simple-BUS loopback tests: several SBus (or plain sockets) on this machine,
+  a test per library feature
+
+*/
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <log.h>
+#include <errdefs.h>
+#include <SBufPool.h>
+#include <SBus.h>
+
+using namespace std;
+using namespace simple;
+
+/// Base multicast port, each test takes its own
+#define LOOP_PORT 10900
+
+/// Lowest message code used by the tests, those below are skipped
+#define LOOP_MSGCODE 100
+
+/// Time (ms) waited for a message that must arrive
+#define LOOP_WAIT_MS 2000
+
+/// Time (ms) waited for a message that must not arrive
+#define LOOP_QUIET_MS 300
+
+/// Engine the tests run on
+int engine=SBUS_ENGINE_POLL;
+
+/// Test message body, a pattern depending on the seed
+string sbusloop_body(int bytes, int seed) {
+  string body(bytes,' ');
+  for(int i=0;i<bytes;i++) {
+    body[i]=(char)((i*7+seed+(i>>12))&0xff);
+  }
+  return body;
+}
+
+/// Default options for the tests
+void sbusloop_options(SBusOptions* options) {
+  SBus::defaultOptions(options);
+  options->engine=engine;
+}
+
+/// Frames written a few bytes at a time are reassembled whole
+int sbusloop_partialReads() {
+  int sizes[]={0,1,7,1000,70000};
+  int count=sizeof(sizes)/sizeof(int);
+  SBusOptions options;
+  sbusloop_options(&options);
+  SMessenger messenger(NULL,DEFAULT_MCIP,LOOP_PORT,&options);
+  int fd=stcp_client((char*)"127.0.0.1",messenger.getServerPort(),1);
+  if(fd<0) {
+    ERROR("partialReads: could not connect");
+    return -1;
+  }
+  string stream;
+  for(int i=0;i<count;i++) {
+    smsg_header header;
+    header.code=htons(LOOP_MSGCODE+i);
+    header.port=htons(1);
+    header.length=htonl(sizes[i]);
+    stream.append((char*)&header,HDRLEN);
+    stream+=sbusloop_body(sizes[i],i);
+  }
+  // header and body split anywhere, with pauses so the reads see the pieces
+  int writes=0;
+  for(size_t at=0;at<stream.size();writes++) {
+    size_t bytes=1+(writes%13);
+    if(at+bytes>stream.size()) {
+      bytes=stream.size()-at;
+    }
+    if(write(fd,stream.data()+at,bytes)!=(ssize_t)bytes) {
+      ERROR("partialReads: write failed");
+      close(fd);
+      return -1;
+    }
+    at+=bytes;
+    if((writes%64)==0) {
+      usleep(200);
+    }
+  }
+  SMsg* msgs[8];
+  int got=0, res=0;
+  for(int waited=0;(waited<LOOP_WAIT_MS)&&(got<count);waited+=50) {
+    int n=messenger.recvBatch(msgs,8,50);
+    for(int i=0;i<n;i++) {
+      int msgtag=msgs[i]->getMsgTag();
+      if(msgtag>=LOOP_MSGCODE) {
+        SBufSlice& body=msgs[i]->getBody();
+        string want=sbusloop_body(sizes[got],got);
+        if((msgtag!=LOOP_MSGCODE+got)||((size_t)body.size()!=want.size())||
+           memcmp(body.data(),want.data(),want.size())) {
+          ERROR("partialReads: message %d (code %d, %d bytes) is wrong",got,msgtag,(int)body.size());
+          res=-1;
+        }
+        got++;
+      }
+      delete msgs[i];
+    }
+  }
+  close(fd);
+  if(got!=count) {
+    ERROR("partialReads: got %d of %d messages",got,count);
+    return -1;
+  }
+  return res;
+}
+
+/// Next test message (skips the system ones), -1 peer on timeout
+int sbusloop_next(SBus& sbus, int* msgtag, SBusPeer* peer, string& msg, int timeout) {
+  int res;
+  for(int waited=0;waited<timeout;waited+=10) {
+    res=sbus.recv(msgtag,peer,msg,10);
+    if((*peer>=0)&&(*msgtag>=LOOP_MSGCODE)) {
+      return res;
+    }
+  }
+  *peer=-1;
+  return 0;
+}
+
+/// Next test message or stream part (skips the system ones), -2 on timeout
+int sbusloop_nextPart(SBus& sbus, int* msgtag, SBufSlice& body, SBusStreamPart* part) {
+  SBusPeer peer;
+  int res;
+  for(int waited=0;waited<LOOP_WAIT_MS;waited+=5) {
+    if(sbus.getPending()==0) {
+      usleep(5000);
+      continue;
+    }
+    res=sbus.recvStream(msgtag,&peer,body,part);
+    if(*msgtag>=LOOP_MSGCODE) {
+      return res;
+    }
+  }
+  return -2;
+}
+
+/// Drops whatever is waiting on the sbus
+void sbusloop_drain(SBus& sbus) {
+  int msgtag;
+  SBusPeer peer;
+  string msg;
+  while((sbus.recv(&msgtag,&peer,msg,LOOP_QUIET_MS)>0)||(peer>=0));
+}
+
+/// Finds out the peer id of from as seen by to
+SBusPeer sbusloop_peer(SBus& from, SBus& to) {
+  int msgtag;
+  SBusPeer peer;
+  string hi="hi", msg;
+  from.send(LOOP_MSGCODE,hi);
+  sbusloop_next(to,&msgtag,&peer,msg,LOOP_WAIT_MS);
+  return peer;
+}
+
+/// Streamed messages arrive whole or in parts, recv() only takes whole ones
+int sbusloop_streams() {
+  long long int bytes=300000;
+  string data=sbusloop_body(bytes,4), small="small";
+  SBusOptions options, partsOptions;
+  sbusloop_options(&options);
+  partsOptions=options;
+  partsOptions.streamReassembleBytes=64*1024;
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+2,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+2,&options);
+  SBus c(NULL,DEFAULT_MCIP,LOOP_PORT+2,&partsOptions);
+  // named, so b does not mix up the contacts of a and c
+  string na="loopa", nb="loopb", nc="loopc";
+  a.setName(na);
+  b.setName(nb);
+  c.setName(nc);
+  usleep(100000);
+  sbusloop_drain(b);
+  SBusPeer pa=sbusloop_peer(a,b);
+  sbusloop_drain(b);
+  SBusPeer pc=sbusloop_peer(c,b);
+  sbusloop_drain(a);
+  sbusloop_drain(c);
+  if((pa<0)||(pc<0)) {
+    ERROR("streams: peers not found");
+    return -1;
+  }
+  int msgtag, res;
+  SBufSlice body;
+  SBusStreamPart part;
+  // reassembled
+  b.sendStream(LOOP_MSGCODE+1,pa,data.data(),bytes);
+  res=sbusloop_nextPart(a,&msgtag,body,&part);
+  if((msgtag!=LOOP_MSGCODE+1)||(res!=bytes)||(part.kind!=SBUS_STREAM_NONE)||
+     memcmp(body.data(),data.data(),bytes)) {
+    ERROR("streams: not reassembled (code %d, %d bytes, kind %d)",msgtag,res,part.kind);
+    return -1;
+  }
+  body.release();
+  // in parts
+  b.sendStream(LOOP_MSGCODE+2,pc,data.data(),bytes);
+  res=sbusloop_nextPart(c,&msgtag,body,&part);
+  if((msgtag!=LOOP_MSGCODE+2)||(part.kind!=SBUS_STREAM_BEGIN)||(part.total!=bytes)) {
+    ERROR("streams: no begin (code %d, kind %d)",msgtag,part.kind);
+    return -1;
+  }
+  unsigned int stream=part.stream;
+  long long int offset=0;
+  while(1) {
+    res=sbusloop_nextPart(c,&msgtag,body,&part);
+    if((res<0)||(part.stream!=stream)) {
+      ERROR("streams: part lost at %lld",offset);
+      return -1;
+    }
+    if(part.kind==SBUS_STREAM_END) {
+      break;
+    }
+    if((part.kind!=SBUS_STREAM_CHUNK)||(part.offset!=offset)||
+       memcmp(body.data(),data.data()+offset,res)) {
+      ERROR("streams: wrong chunk at %lld",offset);
+      return -1;
+    }
+    offset+=res;
+  }
+  if((offset!=bytes)||(part.offset!=bytes)||(part.total!=bytes)) {
+    ERROR("streams: wrong end (%lld bytes, offset %lld, total %lld)",offset,part.offset,part.total);
+    return -1;
+  }
+  // recv() drops the parts
+  b.sendStream(LOOP_MSGCODE+3,pc,data.data(),bytes);
+  b.send(LOOP_MSGCODE+4,pc,small);
+  SBusPeer peer;
+  string msg;
+  sbusloop_next(c,&msgtag,&peer,msg,LOOP_WAIT_MS);
+  if((peer<0)||(msgtag!=LOOP_MSGCODE+4)||(msg!=small)) {
+    ERROR("streams: recv() took a part (code %d)",msgtag);
+    return -1;
+  }
+  return 0;
+}
+
+/// Sends a fragment of a message as a plain multicast datagram
+int sbusloop_sendFragment(int fd, struct sockaddr_in* to, unsigned int msgid, int msgtag,
+  int index, int count, string& msg) {
+  int piece=(msg.size()+count-1)/count;
+  int offset=index*piece;
+  int bytes=((offset+piece)>(int)msg.size())?(msg.size()-offset):piece;
+  string dgram(HDRLEN+FRAGHDRLEN,'\0');
+  smsg_header* header=(smsg_header*)&dgram[0];
+  header->code=htons(FRAGMENT_TAG);
+  header->port=htons(1);
+  header->length=htonl(FRAGHDRLEN+bytes);
+  sfrag_header* frag=(sfrag_header*)&dgram[HDRLEN];
+  frag->msgid=htonl(msgid);
+  frag->msgtag=htons(msgtag);
+  frag->index=htons(index);
+  frag->count=htons(count);
+  frag->length=htonl(msg.size());
+  frag->offset=htonl(offset);
+  dgram.append(msg,offset,bytes);
+  return sendto(fd,dgram.data(),dgram.size(),0,(struct sockaddr*)to,sizeof(*to));
+}
+
+/// Big multicast messages go in fragments; a lost fragment drops the message on timeout
+int sbusloop_fragments() {
+  SBusOptions options;
+  sbusloop_options(&options);
+  options.mcastDatagramBytes=SBUS_MCAST_DATAGRAM_BYTES;
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+1,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+1,&options);
+  usleep(100000);
+  sbusloop_drain(b);
+  int msgtag;
+  SBusPeer peer;
+  string msg, big=sbusloop_body(20000,1);
+  if(a.send(LOOP_MSGCODE,big)<0) {
+    ERROR("fragments: send failed");
+    return -1;
+  }
+  sbusloop_next(b,&msgtag,&peer,msg,LOOP_WAIT_MS);
+  if((peer<0)||(msgtag!=LOOP_MSGCODE)||(msg!=big)) {
+    ERROR("fragments: %d bytes message not reassembled (got %d bytes)",(int)big.size(),(int)msg.size());
+    return -1;
+  }
+  // hand made fragments, the second one lost
+  int fd=socket(AF_INET,SOCK_DGRAM,0);
+  struct sockaddr_in to;
+  memset(&to,0,sizeof(to));
+  to.sin_family=AF_INET;
+  to.sin_port=htons(LOOP_PORT+1);
+  to.sin_addr.s_addr=inet_addr(DEFAULT_MCIP);
+  string lossy=sbusloop_body(3000,2), whole=sbusloop_body(3000,3);
+  sbusloop_sendFragment(fd,&to,7000,LOOP_MSGCODE+1,0,3,lossy);
+  sbusloop_sendFragment(fd,&to,7000,LOOP_MSGCODE+1,2,3,lossy);
+  sbusloop_next(b,&msgtag,&peer,msg,LOOP_QUIET_MS);
+  if(peer>=0) {
+    ERROR("fragments: incomplete message delivered (code %d)",msgtag);
+    close(fd);
+    return -1;
+  }
+  // once timed out, the late fragment does not complete it
+  usleep((MCAST_REASSEMBLY_MS+100)*1000);
+  sbusloop_sendFragment(fd,&to,7000,LOOP_MSGCODE+1,1,3,lossy);
+  sbusloop_next(b,&msgtag,&peer,msg,LOOP_QUIET_MS);
+  if(peer>=0) {
+    ERROR("fragments: timed out message delivered (code %d)",msgtag);
+    close(fd);
+    return -1;
+  }
+  // fragments out of order make it
+  sbusloop_sendFragment(fd,&to,7001,LOOP_MSGCODE+2,2,3,whole);
+  sbusloop_sendFragment(fd,&to,7001,LOOP_MSGCODE+2,0,3,whole);
+  sbusloop_sendFragment(fd,&to,7001,LOOP_MSGCODE+2,1,3,whole);
+  close(fd);
+  sbusloop_next(b,&msgtag,&peer,msg,LOOP_WAIT_MS);
+  if((peer<0)||(msgtag!=LOOP_MSGCODE+2)||(msg!=whole)) {
+    ERROR("fragments: out of order message not reassembled (code %d, %d bytes)",msgtag,(int)msg.size());
+    return -1;
+  }
+  return 0;
+}
+
+/// Fills up an incoming queue with a policy, returns the messages got (first and last values too)
+int sbusloop_overflowRun(int policy, int msgs, long long int bytes, int size, int* first,
+  int* last, SBusInQueueStats* stats) {
+  SBusOptions options, fullOptions;
+  sbusloop_options(&options);
+  fullOptions=options;
+  fullOptions.inQueueMsgs=msgs;
+  fullOptions.inQueueBytes=bytes;
+  fullOptions.inQueuePolicy=policy;
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+3,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+3,&fullOptions);
+  usleep(100000);
+  sbusloop_drain(b);
+  for(int i=0;i<50;i++) {
+    string msg(size,' ');
+    sprintf(&msg[0],"%d",i);
+    a.send(LOOP_MSGCODE,msg);
+    usleep(500);
+  }
+  usleep(100000);
+  b.getInQueueStats(stats);
+  int msgtag, got=0;
+  SBusPeer peer;
+  string msg;
+  *first=-1;
+  while(sbusloop_next(b,&msgtag,&peer,msg,LOOP_QUIET_MS)>0) {
+    int value=atoi(msg.c_str());
+    if(*first<0) {
+      *first=value;
+    }
+    *last=value;
+    got++;
+  }
+  return got;
+}
+
+/// Full incoming queue policies and their counters
+int sbusloop_overflow() {
+  int first, last, got;
+  SBusInQueueStats stats;
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_BLOCK,10,0,8,&first,&last,&stats);
+  if((got!=50)||(stats.blocked==0)) {
+    ERROR("overflow: block got %d, blocked %lld",got,stats.blocked);
+    return -1;
+  }
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_DROP_NEWEST,10,0,8,&first,&last,&stats);
+  if((got!=10)||(first!=0)||(last!=9)||(stats.droppedNewest!=40)) {
+    ERROR("overflow: drop newest got %d (%d to %d), dropped %lld",got,first,last,stats.droppedNewest);
+    return -1;
+  }
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_DROP_OLDEST,10,0,8,&first,&last,&stats);
+  if((got!=10)||(first!=40)||(last!=49)||(stats.droppedOldest!=40)) {
+    ERROR("overflow: drop oldest got %d (%d to %d), dropped %lld",got,first,last,stats.droppedOldest);
+    return -1;
+  }
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_DROP_MCAST,10,0,8,&first,&last,&stats);
+  if((got!=10)||(stats.droppedMCast!=40)) {
+    ERROR("overflow: drop multicast got %d, dropped %lld",got,stats.droppedMCast);
+    return -1;
+  }
+  got=sbusloop_overflowRun(SBUS_IN_QUEUE_DROP_NEWEST,1000,1000,300,&first,&last,&stats);
+  if((got!=3)||(stats.droppedNewest!=47)) {
+    ERROR("overflow: byte limit got %d, dropped %lld",got,stats.droppedNewest);
+    return -1;
+  }
+  return 0;
+}
+
+/// Order in which queued messages of a lane (code +1, "c") and the default lane ("b") are taken
+string sbusloop_lanesRun(int dequeue, int weight) {
+  SBusOptions options, laneOptions;
+  sbusloop_options(&options);
+  laneOptions=options;
+  laneOptions.lanes=1;
+  laneOptions.lane[0].fromTag=LOOP_MSGCODE+1;
+  laneOptions.lane[0].toTag=LOOP_MSGCODE+1;
+  laneOptions.lane[0].weight=weight;
+  laneOptions.laneDequeue=dequeue;
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+4,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+4,&laneOptions);
+  usleep(100000);
+  sbusloop_drain(b);
+  string low="b", high="c", order, msg;
+  for(int i=0;i<6;i++) {
+    a.send(LOOP_MSGCODE,low);
+    usleep(300);
+  }
+  for(int i=0;i<4;i++) {
+    a.send(LOOP_MSGCODE+1,high);
+    usleep(300);
+  }
+  usleep(100000);
+  int msgtag;
+  SBusPeer peer;
+  while(sbusloop_next(b,&msgtag,&peer,msg,LOOP_QUIET_MS)>0) {
+    order+=msg;
+  }
+  return order;
+}
+
+/// Priority lanes served strictly or by weight
+int sbusloop_lanes() {
+  string order=sbusloop_lanesRun(SBUS_LANES_STRICT,1);
+  if(order!="ccccbbbbbb") {
+    ERROR("lanes: strict order %s",order.c_str());
+    return -1;
+  }
+  order=sbusloop_lanesRun(SBUS_LANES_WEIGHTED,2);
+  if((order!="ccbccbbbbb")&&(order!="bccbccbbbb")) {
+    ERROR("lanes: weighted order %s",order.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+/// Codes and sizes of the test messages waiting
+string sbusloop_tagsGot(SBus& sbus) {
+  int msgtag;
+  SBusPeer peer;
+  string msg, got;
+  char item[32];
+  while((sbusloop_next(sbus,&msgtag,&peer,msg,LOOP_QUIET_MS)>0)||(peer>=0)) {
+    sprintf(item,"%d:%d ",msgtag-LOOP_MSGCODE,(int)msg.size());
+    got+=item;
+  }
+  return got;
+}
+
+/// Unsubscribed codes, and those not subscribed once subscribing, are dropped
+int sbusloop_tags() {
+  SBusOptions options;
+  sbusloop_options(&options);
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+5,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+5,&options);
+  usleep(100000);
+  sbusloop_drain(b);
+  SBusPeer pb=sbusloop_peer(b,a);
+  sbusloop_drain(b);
+  if(pb<0) {
+    ERROR("tags: peer not found");
+    return -1;
+  }
+  string big(5000,'z'), small="s", got;
+  b.unsubscribe(LOOP_MSGCODE+1);
+  a.send(LOOP_MSGCODE+1,small);
+  a.send(LOOP_MSGCODE+2,small);
+  a.send(LOOP_MSGCODE+1,big);
+  a.send(LOOP_MSGCODE+2,big);
+  got=sbusloop_tagsGot(b);
+  if(got!="2:1 2:5000 ") {
+    ERROR("tags: unsubscribed got %s",got.c_str());
+    return -1;
+  }
+  b.subscribe(LOOP_MSGCODE+3);
+  a.send(LOOP_MSGCODE+1,small);
+  a.send(LOOP_MSGCODE+2,small);
+  a.send(LOOP_MSGCODE+3,small);
+  a.send(LOOP_MSGCODE+3,pb,big);
+  a.send(LOOP_MSGCODE+2,pb,big);
+  got=sbusloop_tagsGot(b);
+  if(got!="3:1 3:5000 ") {
+    ERROR("tags: subscribed got %s",got.c_str());
+    return -1;
+  }
+  // streams are filtered on their message code
+  a.sendStream(LOOP_MSGCODE+1,pb,big.data(),big.size());
+  a.sendStream(LOOP_MSGCODE+3,pb,big.data(),big.size());
+  got=sbusloop_tagsGot(b);
+  if(got!="3:5000 ") {
+    ERROR("tags: streams got %s",got.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+/// Connections spread over several reactors keep the order of each sender
+int sbusloop_reactors() {
+  const int senders=3, msgs=300;
+  SBusOptions options, multiOptions;
+  sbusloop_options(&options);
+  multiOptions=options;
+  multiOptions.reactors=3;
+  multiOptions.reactorPolicy=SBUS_REACTOR_LEAST_LOADED;
+  SBus r(NULL,DEFAULT_MCIP,LOOP_PORT+6,&multiOptions);
+  SBus* s[senders];
+  SBusPeer toR[senders];
+  int msgtag, next[senders], got=0, res=0;
+  SBusPeer peer;
+  string hi="hi", msg;
+  for(int i=0;i<senders;i++) {
+    s[i]=new SBus(NULL,DEFAULT_MCIP,LOOP_PORT+6,&options);
+  }
+  usleep(100000);
+  r.send(LOOP_MSGCODE,hi);
+  for(int i=0;i<senders;i++) {
+    sbusloop_next(*s[i],&msgtag,&toR[i],msg,LOOP_WAIT_MS);
+    next[i]=0;
+    if(toR[i]<0) {
+      ERROR("reactors: sender %d did not find the receiver",i);
+      res=-1;
+    }
+  }
+  for(int n=0;(res==0)&&(n<msgs);n++) {
+    for(int i=0;i<senders;i++) {
+      char item[32];
+      sprintf(item,"%d:%d",i,n);
+      msg=item;
+      if(s[i]->send(LOOP_MSGCODE+1,toR[i],msg)<0) {
+        ERROR("reactors: sender %d send %d failed",i,n);
+        res=-1;
+        break;
+      }
+    }
+  }
+  while((res==0)&&(got<senders*msgs)&&(sbusloop_next(r,&msgtag,&peer,msg,LOOP_WAIT_MS)>0)) {
+    int i, n;
+    if((msgtag!=LOOP_MSGCODE+1)||(sscanf(msg.c_str(),"%d:%d",&i,&n)!=2)) {
+      continue;
+    }
+    if((i<0)||(i>=senders)||(n!=next[i])) {
+      ERROR("reactors: sender %d message %d out of order (%d expected)",i,n,next[i]);
+      res=-1;
+      break;
+    }
+    next[i]++;
+    got++;
+  }
+  if((res==0)&&(got!=senders*msgs)) {
+    ERROR("reactors: got %d of %d messages",got,senders*msgs);
+    res=-1;
+  }
+  for(int i=0;i<senders;i++) {
+    delete s[i];
+  }
+  return res;
+}
+
+/// The pump thread keeps going while set
+volatile bool sbusloop_pumping;
+
+/// Runs the messenger reactor (it writes out the queued messages) while pumping
+void* sbusloop_pump(void* arg) {
+  SMessenger* messenger=(SMessenger*)arg;
+  SMsg* msgs[8];
+  while(sbusloop_pumping) {
+    int n=messenger->recvBatch(msgs,8,5);
+    for(int i=0;i<n;i++) {
+      delete msgs[i];
+    }
+  }
+  return NULL;
+}
+
+/// A peer not reading gets its messages queued up to the high watermark, then refused
+int sbusloop_watermark() {
+  const int msgs=2000, size=10000;
+  SBusOptions options;
+  sbusloop_options(&options);
+  options.sendHighWatermark=256*1024;
+  options.sendLowWatermark=64*1024;
+  SMessenger messenger(NULL,DEFAULT_MCIP,LOOP_PORT+7,&options);
+  int server=stcp_server((char*)"127.0.0.1",0);
+  int fd=messenger.connect((int)ntohl(inet_addr("127.0.0.1")),stcp_getLocalPort(server));
+  int peer=(fd>=0)?accept(server,NULL,NULL):-1;
+  close(server);
+  if(peer<0) {
+    ERROR("watermark: could not connect");
+    return -1;
+  }
+  string body=sbusloop_body(size,5);
+  int sent=0, queued=0, res=0;
+  // nobody reads, the kernel buffers and then the outbound queue fill up
+  for(int i=0;i<msgs;i++) {
+    memcpy(&body[0],&i,sizeof(int));
+    int r=messenger.send(LOOP_MSGCODE,fd,body);
+    if(r<0) {
+      break;
+    }
+    sent++;
+    if(r==SBUS_QUEUED) {
+      queued++;
+    }
+  }
+  if((queued==0)||(sent==msgs)) {
+    ERROR("watermark: %d sent, %d queued and none refused",sent,queued);
+    close(peer);
+    return -1;
+  }
+  // once read, the accepted ones come in order
+  pthread_t pump;
+  sbusloop_pumping=true;
+  pthread_create(&pump,NULL,sbusloop_pump,&messenger);
+  string frame(HDRLEN+size,' ');
+  for(int i=0;(res==0)&&(i<sent);i++) {
+    int have=0, index;
+    while(have<(int)frame.size()) {
+      int r=read(peer,&frame[have],frame.size()-have);
+      if(r<=0) {
+        ERROR("watermark: read failed after %d messages",i);
+        res=-1;
+        break;
+      }
+      have+=r;
+    }
+    memcpy(&index,&frame[HDRLEN],sizeof(int));
+    if((res==0)&&(index!=i)) {
+      ERROR("watermark: message %d read instead of %d",index,i);
+      res=-1;
+    }
+  }
+  // drained, new messages are taken again
+  if((res==0)&&(messenger.send(LOOP_MSGCODE,fd,body)<0)) {
+    ERROR("watermark: still refused once drained");
+    res=-1;
+  }
+  sbusloop_pumping=false;
+  pthread_join(pump,NULL);
+  close(peer);
+  return res;
+}
+
+/// Corked messages are held until flushed, then delivered in order
+int sbusloop_cork() {
+  SBusOptions options, corkOptions;
+  sbusloop_options(&options);
+  corkOptions=options;
+  corkOptions.corkBytes=16*1024;
+  corkOptions.corkUs=0;
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+8,&corkOptions), b(NULL,DEFAULT_MCIP,LOOP_PORT+8,&options);
+  usleep(100000);
+  sbusloop_drain(a);
+  SBusPeer pb=sbusloop_peer(b,a);
+  sbusloop_drain(b);
+  if(pb<0) {
+    ERROR("cork: peer not found");
+    return -1;
+  }
+  int msgtag;
+  SBusPeer peer;
+  string msg;
+  for(int i=0;i<5;i++) {
+    string item=sbusloop_body(10+i,i);
+    int res=a.send(LOOP_MSGCODE+i,pb,item);
+    if(res!=SBUS_QUEUED) {
+      ERROR("cork: message %d not held back (%d)",i,res);
+      return -1;
+    }
+  }
+  sbusloop_next(b,&msgtag,&peer,msg,LOOP_QUIET_MS);
+  if(peer>=0) {
+    ERROR("cork: message %d delivered before the flush",msgtag-LOOP_MSGCODE);
+    return -1;
+  }
+  if(a.flush(pb)<0) {
+    ERROR("cork: flush failed");
+    return -1;
+  }
+  for(int i=0;i<5;i++) {
+    sbusloop_next(b,&msgtag,&peer,msg,LOOP_WAIT_MS);
+    if((peer<0)||(msgtag!=LOOP_MSGCODE+i)||(msg!=sbusloop_body(10+i,i))) {
+      ERROR("cork: message %d not delivered after the flush (code %d)",i,msgtag);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/// Asynchronous sends complete once written, in order; those to gone peers fail
+int sbusloop_async() {
+  const int msgs=200;
+  SBusOptions options;
+  sbusloop_options(&options);
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+9,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+9,&options);
+  SBus* c=new SBus(NULL,DEFAULT_MCIP,LOOP_PORT+9,&options);
+  string na="loopa", nb="loopb", nc="loopc";
+  a.setName(na);
+  b.setName(nb);
+  c->setName(nc);
+  usleep(100000);
+  sbusloop_drain(a);
+  SBusPeer pb=sbusloop_peer(b,a);
+  sbusloop_drain(a);
+  SBusPeer pc=sbusloop_peer(*c,a);
+  delete c;
+  sbusloop_drain(b);
+  if((pb<0)||(pc<0)) {
+    ERROR("async: peers not found");
+    return -1;
+  }
+  // the peer gone can not be connected, it does not hold the others
+  string msg="gone";
+  SSend* gone=a.sendAsync(LOOP_MSGCODE,pc,msg);
+  SSend* last=NULL;
+  for(int i=0;i<msgs;i++) {
+    char item[16];
+    sprintf(item,"%d",i);
+    msg=item;
+    SSend* handle=a.sendAsync(LOOP_MSGCODE+1,pb,msg);
+    if(handle==NULL) {
+      ERROR("async: send %d not taken",i);
+      return -1;
+    }
+    if(last!=NULL) {
+      last->unref();
+    }
+    last=handle;
+  }
+  int res=last->wait(LOOP_WAIT_MS);
+  last->unref();
+  if(res!=0) {
+    ERROR("async: last send not completed (%d)",res);
+    gone->unref();
+    return -1;
+  }
+  res=gone->wait(LOOP_WAIT_MS);
+  int error=gone->getError();
+  gone->unref();
+  if((res!=-1)||(error!=EHOSTUNREACH)) {
+    ERROR("async: send to a gone peer completed with %d (error %d)",res,error);
+    return -1;
+  }
+  int msgtag;
+  SBusPeer peer;
+  for(int i=0;i<msgs;i++) {
+    sbusloop_next(b,&msgtag,&peer,msg,LOOP_WAIT_MS);
+    if((peer<0)||(msgtag!=LOOP_MSGCODE+1)||(atoi(msg.c_str())!=i)) {
+      ERROR("async: message %d lost or out of order (got %s)",i,msg.c_str());
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/// File regions arrive as the message bodies; regions out of the file are refused
+int sbusloop_sendFile() {
+  const int bytes=300000;
+  int offsets[]={0,5,1000};
+  int lengths[]={0,1000,200000};
+  string content=sbusloop_body(bytes,6);
+  char path[]="/tmp/sbusloopXXXXXX";
+  int fd=mkstemp(path);
+  if(fd<0) {
+    ERROR("sendFile: no temporary file");
+    return -1;
+  }
+  unlink(path);
+  if(write(fd,content.data(),bytes)!=bytes) {
+    ERROR("sendFile: temporary file not written");
+    close(fd);
+    return -1;
+  }
+  SBusOptions options;
+  sbusloop_options(&options);
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+10,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+10,&options);
+  usleep(100000);
+  sbusloop_drain(b);
+  SBusPeer pa=sbusloop_peer(a,b);
+  sbusloop_drain(a);
+  if(pa<0) {
+    ERROR("sendFile: peer not found");
+    close(fd);
+    return -1;
+  }
+  int msgtag, res=0;
+  SBusPeer peer;
+  string msg;
+  for(int i=0;(res==0)&&(i<3);i++) {
+    if(b.sendFile(LOOP_MSGCODE+i,pa,fd,offsets[i],lengths[i])<0) {
+      ERROR("sendFile: region %d+%d not sent",offsets[i],lengths[i]);
+      res=-1;
+      break;
+    }
+    sbusloop_next(a,&msgtag,&peer,msg,LOOP_WAIT_MS);
+    if((peer<0)||(msgtag!=LOOP_MSGCODE+i)||(msg!=content.substr(offsets[i],lengths[i]))) {
+      ERROR("sendFile: region %d+%d not delivered (code %d, %d bytes)",offsets[i],lengths[i],
+        msgtag,(int)msg.size());
+      res=-1;
+    }
+  }
+  if((res==0)&&(b.sendFile(LOOP_MSGCODE,pa,fd,bytes-10,20)>=0)) {
+    ERROR("sendFile: region past the end of the file taken");
+    res=-1;
+  }
+  close(fd);
+  return res;
+}
+
+/// A batch of multicast messages goes out in one call and arrives in order
+int sbusloop_batch() {
+  const int msgs=50;
+  SBusOptions options;
+  sbusloop_options(&options);
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+11,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+11,&options);
+  usleep(100000);
+  sbusloop_drain(b);
+  SBusBatchMsg batch[msgs];
+  string bodies[msgs];
+  for(int i=0;i<msgs;i++) {
+    bodies[i]=sbusloop_body(1+i*20,i);
+    batch[i].msgtag=LOOP_MSGCODE+(i%3);
+    batch[i].data=bodies[i].data();
+    batch[i].bytes=bodies[i].size();
+  }
+  int sent=a.sendBatch(batch,msgs);
+  if(sent!=msgs) {
+    ERROR("batch: %d of %d messages sent",sent,msgs);
+    return -1;
+  }
+  int msgtag;
+  SBusPeer peer;
+  string msg;
+  for(int i=0;i<msgs;i++) {
+    sbusloop_next(b,&msgtag,&peer,msg,LOOP_WAIT_MS);
+    if((peer<0)||(msgtag!=batch[i].msgtag)||(msg!=bodies[i])) {
+      ERROR("batch: message %d lost or out of order (code %d, %d bytes)",i,msgtag,(int)msg.size());
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/// Big bodies sent without copying arrive intact, their buffer is let go once written
+int sbusloop_zeroCopy() {
+  const int bytes=512*1024, msgs=8;
+  SBusOptions options;
+  sbusloop_options(&options);
+  options.zeroCopyBytes=64*1024;
+  SBus a(NULL,DEFAULT_MCIP,LOOP_PORT+12,&options), b(NULL,DEFAULT_MCIP,LOOP_PORT+12,&options);
+  usleep(100000);
+  sbusloop_drain(a);
+  SBusPeer pb=sbusloop_peer(b,a);
+  sbusloop_drain(b);
+  if(pb<0) {
+    ERROR("zeroCopy: peer not found");
+    return -1;
+  }
+  string content=sbusloop_body(bytes,8);
+  SBuf* buf=SBufPool::alloc(bytes);
+  memcpy(buf->data(),content.data(),bytes);
+  SBufSlice body(buf,0,bytes);
+  int msgtag, res=0;
+  SBusPeer peer;
+  string msg;
+  for(int i=0;(res==0)&&(i<msgs);i++) {
+    if(a.send(LOOP_MSGCODE,pb,body)<0) {
+      ERROR("zeroCopy: send %d failed",i);
+      res=-1;
+    }
+  }
+  for(int i=0;(res==0)&&(i<msgs);i++) {
+    sbusloop_next(b,&msgtag,&peer,msg,LOOP_WAIT_MS);
+    if((peer<0)||(msg!=content)) {
+      ERROR("zeroCopy: message %d not delivered intact (%d bytes)",i,(int)msg.size());
+      res=-1;
+    }
+  }
+  // only the reference taken here is left once the kernel is done with the pages
+  body.release();
+  for(int waited=0;(res==0)&&(waited<LOOP_WAIT_MS)&&buf->isShared();waited+=10) {
+    usleep(10000);
+  }
+  if((res==0)&&buf->isShared()) {
+    ERROR("zeroCopy: buffer still pinned");
+    res=-1;
+  }
+  buf->unref();
+  return res;
+}
+
+/// A loopback test
+typedef struct sbusloop_test {
+  /// Test name
+  const char* name;
+  /// Test function, 0 if passed
+  int (*run)();
+} sbusloop_test;
+
+/// Runs all the tests, returns the failed ones
+int sbusloop_run() {
+  sbusloop_test tests[]={
+    {"partial reads",sbusloop_partialReads},
+    {"streams",sbusloop_streams},
+    {"fragments",sbusloop_fragments},
+    {"overflow",sbusloop_overflow},
+    {"lanes",sbusloop_lanes},
+    {"tags",sbusloop_tags},
+    {"reactors",sbusloop_reactors},
+    {"watermark",sbusloop_watermark},
+    {"cork",sbusloop_cork},
+    {"async",sbusloop_async},
+    {"sendFile",sbusloop_sendFile},
+    {"batch",sbusloop_batch},
+    {"zero copy",sbusloop_zeroCopy},
+  };
+  int failed=0;
+  for(unsigned int i=0;i<sizeof(tests)/sizeof(sbusloop_test);i++) {
+    try {
+      if(tests[i].run()==0) {
+        INFO("%s: ok",tests[i].name);
+        continue;
+      }
+    } catch(string* e) {
+      ERROR("%s: %s",tests[i].name,e->c_str());
+      delete e;
+    }
+    ERROR("%s: FAILED",tests[i].name);
+    failed++;
+  }
+  return failed;
+}
+
+/// Main function
+int main(int argc, char** argv) {
+  if((argc>1)&&(strcmp(argv[1],"uring")==0)) {
+    engine=SBUS_ENGINE_URING;
+  } else if(argc>1) {
+    printf("Usage: %s [uring]\n",argv[0]);
+    return -1;
+  }
+  int failed=sbusloop_run();
+  if(failed>0) {
+    ERROR("%d tests failed",failed);
+    return -1;
+  }
+  INFO("All tests passed");
+  return 0;
+}
@@ -70,7 +70,7 @@ int sbustest_start_pinger(string& name, char* device) {
     // SBus cretion / binding
     SBus sbus(device);
     INFO("SBUS pinger started (default name is %s)",sbus.getName().c_str());
-    if(sbus.setName(name)!=0) {
+    if(sbus.setName(name)<0) {
       INFO("Could not register SBUS with name %s",name.c_str());
       return -1;
     }